@@ -5,45 +5,354 @@
   - Pot (coarse) wiper -> A0
   - Pot (fine)   wiper -> A1
   - Fan PWM -> D9 (must be a PWM pin)
+  - Fan tach -> D8 (open collector, internal pull-up, 2 pulses/rev)
+  - Dispense valve driver -> D10 (active high)
+  - Chuck vacuum sensor -> A3 (ratiometric 0.5..4.5 V for 0..-100 kPa)
+  - Motor NTC (10k, B 3950) -> A6 to GND, 10k pull-up to 5 V
+    (A6 is on the Nano / Pro Mini; the UNO has no A6)
+
+  - Pots, LCD and keypad can be left out of the build (USE_POTS, USE_LCD,
+    USE_KEYPAD) for units run by the line PLC; without pots, manual jobs
+    run at FIXED_PWM. host/sizeReport.sh builds each such configuration
+    and prints its flash and RAM; loop time is measured on the board
+    (Modbus input registers, profiler dumps).
+
+  - loop() runs every task each pass by default. USE_TT_SCHEDULE runs
+    them from a static table of 1 ms slots instead, for a bounded start
+    jitter of the control task; slot overruns and the worst jitter are
+    Modbus input registers.
 
   - I2C LCD:
     SDA -> A4
     SCL -> A5
     NOTE: Your message said A4/A5 are SDA/SCL respectively. On Arduino UNO/Nano:
     A4 = SDA, A5 = SCL.
+  - MPU6050 accelerometer on the same I2C bus (address 0x68, AD0 low),
+    mounted on the motor frame. Optional.
+
+  - Modbus RTU (optional, USE_MODBUS): UART RX/TX on D0/D1, 115200 8N1.
+    D0/D1 are keypad R1/R2, so only R3/R4 are scanned and R1/R2 must be
+    left unconnected: keys 7-9, 0, *, #, C and D remain. Meant for
+    PLC-driven units.
+
+  - Telemetry (optional, USE_TELEMETRY): text lines on the UART TX at
+    115200 8N1; 'H' on RX dumps the job history, 'C' the production
+    counters. Takes D0/D1 like Modbus (keypad R3/R4 only), so not in
+    the same build. With USE_TELEMETRY_DELTA the lines become binary
+    frames of the fields that changed, for shared or slow links;
+    host/telemetryPack decodes them.
+
+  - LCD mirror (optional, USE_LCD_MIRROR): the LCD cells that change,
+    as text lines on the UART TX at 115200 8N1; host/lcdView shows the
+    screen from them. Shares the TX with telemetry and the profiler;
+    the UART still takes D0/D1, so keypad R3/R4 only.
+
+  - Profiler (optional, USE_PROFILER): a histogram of where the CPU was
+    when Timer1 interrupted it, dumped on the UART TX at 115200 8N1
+    every few seconds; host/profSym turns it into a flat profile against
+    the ELF. Takes D0/D1 like Modbus (keypad R3/R4 only). Leave
+    USE_SD_LOG off: the histogram needs the RAM.
+
+  - SD card logger (optional, USE_SD_LOG): SPI on D11/D12/D13, CS -> A2.
+    D10 stays an output (dispense), which keeps the SPI in master mode.
+    Card must hold a pre-allocated, contiguous SPINLOG.BIN in the root
+    directory (FAT16/32, zero-filled), e.g. copied onto a freshly formatted
+    card after: dd if=/dev/zero of=SPINLOG.BIN bs=1M count=64
 
   - 4x4 membrane keypad:
     R1..R4 and C1..C4 -> D0..D7 (in that order)
     NOTE: D0/D1 are also Serial RX/TX on UNO/Nano. If you use D0/D1 for keypad,
     avoid Serial and disconnect keypad when uploading if uploads act weird.
+    Builds that use the UART (Modbus, telemetry, the LCD mirror or the
+    profiler) scan R3/R4 only, as under Modbus above: no recipe ('A')
+    or trajectory ('B') key.
 
   Behavior
   - Coarse + Fine pots combine into a single PWM output (0..255).
   - Keypad enters job duration (seconds).
   - LCD shows speed (PWM + %) and duration (set + remaining while running).
+  - Every job compares tach RPM in the hold phase with the calibration and
+    keeps a drift average in EEPROM; "RECAL" shows once the fan has drifted.
+  - Recipe mode runs the multi-step program stored in EEPROM. Each step can
+    open the dispense valve at an offset into the step; the valve edges are
+    timed by Timer2 compare match, not by loop(). Ramp corners are rounded
+    off under the recipe's jerk limit without moving any step boundary.
+  - Trajectory mode plays a piecewise-linear PWM profile from flash,
+    stepped every millisecond with integer (Bresenham) increments.
+  - Jobs only start with the chuck vacuum up. Losing it while running
+    cuts the fan from the ADC interrupt and stops the job; "NOVAC" shows
+    until the next start. A sensor reading above its range counts as
+    lost.
+  - A job whose fan is driven but gives no tach for 1.5 s stops
+    ("TACH?"): tach cable off or rotor locked.
+  - Vibration: RMS acceleration (mg) over each job and live, from the
+    accelerometer's FIFO; shown on the third LCD page, with I2C errors
+    and the stack's high-water mark (bytes it has never reached).
+  - Motor temperature caps the PWM above 60 C, down to half at 80 C, where
+    the job stops; no job starts until it is back under 70 C ("HOT").
+  - The supply is watched through the internal bandgap. On a power loss
+    the fan is cut and the running job (step, time left) is checkpointed
+    to EEPROM; at the next power-up the LCD offers to resume it.
+  - Job history: a record per job (power-up and start time, mode, recipe,
+    time run, hold-phase tach error, why it ended) in a ring of the last
+    64 in EEPROM; read over telemetry ('H') or Modbus.
+  - Production counters: jobs done and aborted, spin and idle time in
+    EEPROM; utilisation and jobs in the last hour from them. Fourth LCD
+    page, telemetry ('C') and Modbus.
+  - Dip trigger mode: after '#' the fan spins up but the countdown waits for
+    the RPM dip of fluid landing on the wafer. If no dip is seen in time the
+    countdown waits for a second '#' instead.
 
   Keypad controls
   - Digits 0-9: enter duration (seconds)
   - * : clear duration
   - # : start job
+  - A : toggle manual / recipe mode
+  - B : toggle manual / trajectory mode
+  - C : toggle dip trigger mode
+  - # while waiting for a dip: start the countdown now
   - D : stop job (abort) while running
+  - # / * at RESUME?: resume the job cut by a power loss / discard it
+  - D when idle, * while running: main / diagnostics / vibration /
+    production page
 */
 
-#include <Wire.h>
-#include <LiquidCrystal_I2C.h>
+/* Build options
+   Each can also be set from the build, e.g. -DUSE_MODBUS=1 (arduino-cli:
+   --build-property compiler.cpp.extra_flags=-DUSE_MODBUS=1) */
+/* Hardware fitted; a unit driven only by the line PLC needs none of it */
+/* 16x2 LCD on the I2C bus */
+#ifndef USE_LCD
+#define USE_LCD 1
+#endif
+/* 4x4 keypad on D0..D7 */
+#ifndef USE_KEYPAD
+#define USE_KEYPAD 1
+#endif
+/* Coarse and fine speed pots on A0/A1 */
+#ifndef USE_POTS
+#define USE_POTS 1
+#endif
+/* Modbus RTU slave on the UART (replaces Serial, takes D0/D1) */
+#ifndef USE_MODBUS
+#define USE_MODBUS 0
+#endif
+/* Per-job traces on an SD card */
+#ifndef USE_SD_LOG
+#define USE_SD_LOG 0
+#endif
+/* Text telemetry lines on the UART (takes D0/D1) */
+#ifndef USE_TELEMETRY
+#define USE_TELEMETRY 0
+#endif
+/* With USE_TELEMETRY: change-only binary frames instead of the lines */
+#ifndef USE_TELEMETRY_DELTA
+#define USE_TELEMETRY_DELTA 0
+#endif
+/* PC-sampling profile dumps on the UART (takes D0/D1) */
+#ifndef USE_PROFILER
+#define USE_PROFILER 0
+#endif
+/* LCD frame mirrored on the UART TX (takes D0/D1) */
+#ifndef USE_LCD_MIRROR
+#define USE_LCD_MIRROR 0
+#endif
+/* loop() runs a static time-triggered schedule instead of every task
+   each pass */
+#ifndef USE_TT_SCHEDULE
+#define USE_TT_SCHEDULE 0
+#endif
+
+#if USE_TELEMETRY && USE_MODBUS
+#error "USE_TELEMETRY and USE_MODBUS both need the UART"
+#endif
+#if USE_TELEMETRY_DELTA && !USE_TELEMETRY
+#error "USE_TELEMETRY_DELTA needs USE_TELEMETRY"
+#endif
+#if USE_PROFILER && USE_MODBUS
+#error "USE_PROFILER and USE_MODBUS both need the UART"
+#endif
+#if USE_PROFILER && USE_SD_LOG
+#error "USE_PROFILER and USE_SD_LOG do not both fit in RAM"
+#endif
+#if USE_LCD_MIRROR && USE_MODBUS
+#error "USE_LCD_MIRROR and USE_MODBUS both need the UART"
+#endif
+#if USE_LCD_MIRROR && !USE_LCD
+#error "USE_LCD_MIRROR mirrors the LCD frame"
+#endif
+#if !USE_KEYPAD && !USE_MODBUS
+#error "Without the keypad, jobs are started over Modbus"
+#endif
+
+/* Serial.begin() takes both D0 and D1, even for a TX-only stream */
+#define UART_IN_USE (USE_MODBUS || USE_TELEMETRY || USE_PROFILER || USE_LCD_MIRROR)
+
+#include <Arduino.h>
+#include <avr/pgmspace.h>
+#if USE_KEYPAD
 #include <Keypad.h>
+#endif
+#include <EEPROM.h>
+#if USE_SD_LOG && defined(__AVR__)
+#include <SPI.h>
+#endif
+#if USE_SD_LOG && !defined(__AVR__)
+#include <stdio.h>
+#endif
+
+/* I2C
+   Interrupt-driven TWI master at 100 kHz, shared by the LCD and the
+   accelerometer. An owner queues an I2cXfer and polls its state; the
+   interrupt runs the queue back to back, so loop() never waits on the
+   bus. A transaction writes tx (register address first), then reads rx
+   after a repeated start. Wire is not used: its TWI interrupt would
+   clash with this one.
+*/
+const unsigned long I2C_HZ = 100000UL;
+const byte I2C_QUEUE_N = 4;
+/* Longest transaction is about 7 ms; past this the bus is hung */
+const unsigned long I2C_TIMEOUT_MS = 20UL;
+
+/* Transaction state */
+const byte I2C_IDLE = 0;
+const byte I2C_QUEUED = 1;
+const byte I2C_DONE = 2;
+const byte I2C_FAILED = 3;
+
+struct I2cXfer {
+  byte addr;
+  const byte *tx;
+  byte txLen;
+  byte *rx;
+  byte rxLen;
+  volatile byte state;
+};
+
+/* Ring of queued transactions; the head one is on the bus */
+I2cXfer *volatile i2cQueue[I2C_QUEUE_N];
+volatile byte i2cHead = 0;
+volatile byte i2cCount = 0;
+/* Byte position in the head transaction, and which half it is in */
+volatile byte i2cPos = 0;
+volatile bool i2cReading = false;
+volatile unsigned long i2cXferStartMs = 0;
+/* NACKs, bus errors and timeouts */
+volatile unsigned int i2cErrors = 0;
 
+#if USE_LCD
+/* LCD
+   16x2 HD44780 behind a PCF8574 at 0x27, 4-bit mode. updateLcd() only
+   draws into lcd's frame; serviceLcd() sends the cells that changed, a
+   run of up to LCD_RUN_MAX per transaction, through the I2C queue.
+*/
+const byte LCD_ADDR = 0x27;
+const byte LCD_COLS = 16;
+const byte LCD_ROWS = 2;
+/* 4 bytes per cell, plus 4 for the cursor address */
+const byte LCD_RUN_MAX = 8;
+/* PCF8574: P0 RS, P1 RW, P2 EN, P3 backlight, P4..P7 D4..D7 */
+const byte LCD_RS = 0x01;
+const byte LCD_EN = 0x04;
+const byte LCD_BACKLIGHT = 0x08;
+
+/* Frame behind the Print interface the drawing code uses */
+class LcdFrame : public Print {
+ public:
+  char text[LCD_ROWS][LCD_COLS];
+  /* Cells changed since they were sent, a bit per column */
+  uint16_t dirty[LCD_ROWS];
+#if USE_LCD_MIRROR
+  /* The same, for the mirror */
+  uint16_t mirrorDirty[LCD_ROWS];
+#endif
+  byte col;
+  byte row;
+
+  void setCursor(byte c, byte r) {
+    col = c;
+    row = r < LCD_ROWS ? r : LCD_ROWS - 1;
+  }
+
+  void clear() {
+    for (byte r = 0; r < LCD_ROWS; r++) {
+      setCursor(0, r);
+      for (byte c = 0; c < LCD_COLS; c++) write(' ');
+    }
+    setCursor(0, 0);
+  }
+
+  size_t write(uint8_t ch) {
+    if (col < LCD_COLS && text[row][col] != (char)ch) {
+      text[row][col] = (char)ch;
+      dirty[row] |= 1U << col;
+#if USE_LCD_MIRROR
+      mirrorDirty[row] |= 1U << col;
+#endif
+    }
+    col++;
+    return 1;
+  }
+  using Print::write;
+};
+
+LcdFrame lcd;
 
-LiquidCrystal_I2C lcd(0x27, 16, 2);
+/* Run being sent, put back as dirty if the transaction fails */
+byte lcdTx[4 + 4 * LCD_RUN_MAX];
+I2cXfer lcdXfer = { LCD_ADDR, lcdTx, 0, 0, 0, I2C_IDLE };
+byte lcdSentRow = 0;
+uint16_t lcdSentMask = 0;
+
+#if USE_LCD_MIRROR
+/* LCD mirror
+   The frame's changed cells go out on the UART TX, a run per loop()
+   pass and only when the TX buffer has room for the whole line:
+     L<row><col><cells>
+   row (0-1) and col (0-F) one character each, then the run of changed
+   cells from there. Every LCD_MIRROR_REFRESH_MS the whole frame goes
+   again, for a viewer that joined late or lost a line.
+*/
+const unsigned long LCD_MIRROR_BAUD = 115200UL;
+const unsigned long LCD_MIRROR_REFRESH_MS = 5000UL;
+/* Longest line: a whole row, CR LF included */
+const byte LCD_MIRROR_LINE_MAX = 3 + LCD_COLS + 2;
+const uint16_t LCD_ALL_COLS = (uint16_t)((1UL << LCD_COLS) - 1);
+
+unsigned long lcdMirrorRefreshMs = 0;
+#endif
+#endif
 
 /* Pins */
+#if USE_POTS
 const int potCoarsePin = A0;
 const int potFinePin   = A1;
+#endif
 const int fanPwmPin    = 9;
+/* Tach must stay on D8: it uses PCINT0 */
+const int tachPin      = 8;
+/* Dispense must stay on D10: the Timer2 ISR drives PB2 directly */
+const int dispensePin  = 10;
+const int vacuumPin    = A3;
+const int ntcPin       = A6;
 
+#if USE_KEYPAD
 /* Keypad wiring: R1..R4 then C1..C4 mapped to D0..D7 */
-const byte rows = 4;
 const byte cols = 4;
+#if UART_IN_USE
+/* R1/R2 are the UART's RX/TX: not scanned, so bus traffic never reads
+   as a key and a key never shorts the TX driver */
+const byte rows = 2;
+
+char keys[rows][cols] = {
+  {'7','8','9','C'},
+  {'*','0','#','D'}
+};
+
+/* Row pins: R3/R4 -> D2/D3 */
+byte rowPins[rows] = {2, 3};
+#else
+const byte rows = 4;
 
 /* Keypad layout (standard 4x4) */
 char keys[rows][cols] = {
@@ -55,18 +364,856 @@ char keys[rows][cols] = {
 
 /* Row pins: R1..R4 -> D0..D3 */
 byte rowPins[rows] = {0, 1, 2, 3};
+#endif
 /* Col pins: C1..C4 -> D4..D7 */
 byte colPins[cols] = {4, 5, 6, 7};
 
 Keypad keypad = Keypad(makeKeymap(keys), rowPins, colPins, rows, cols);
+#endif
+
 /* RPM estimate calibration
-   Fill these with measurements from your build.
-   Use a phone tachometer app or a cheap laser tach.
+   Uniform grid: entry i is the RPM at PWM (i << CAL_SHIFT), so the lookup
+   is a shift and one multiply instead of a search and a divide.
+
+   Regenerate with host/calFit from PWM/RPM samples (phone tach app, laser
+   tach or logged runs); it rejects outliers, fits a monotone curve and picks
+   the coarsest grid within the requested error bound.
+
+   Current table comes from the original bench points
+     PWM   0  60  100  140  180  220
+     RPM   0 800 1500 2200 2900 3500
+   interpolated to one sample per PWM value in host/calBench.txt:
+     host/calFit -b 20 -k 8 -l 0 < host/calBench.txt
+*/
+/* Generated by host/calFit (-b 20 -k 8 -l 0): 256 samples, 1 rejected */
+const int CAL_SHIFT = 3;
+const int CAL_N = 33;
+const int rpmCal[CAL_N] PROGMEM = {
+     0,  106,  213,  320,  426,  533,  640,  744,  867,
+  1010, 1150, 1290, 1430, 1570, 1710, 1850, 1990, 2130,
+  2270, 2410, 2550, 2689, 2831, 2962, 3079, 3201, 3318,
+  3448, 3501, 3501, 3501, 3501, 3501
+};
+
+/* Tach
+   Fan tach gives TACH_PULSES_PER_REV falling+rising pairs per revolution.
+   The ISR timestamps rising edges; no edge for TACH_TIMEOUT_US means stopped.
+*/
+const unsigned long TACH_PULSES_PER_REV = 2;
+const unsigned long TACH_TIMEOUT_US = 500000UL;
+/* Shorter periods are contact bounce / noise (> 30000 RPM) */
+const unsigned long TACH_MIN_PERIOD_US = 1000UL;
+
+volatile unsigned long tachLastUs = 0;
+/* 0 while stopped, 1 from the first edge until the second */
+volatile unsigned long tachPeriodUs = 0;
+
+/* Driven for this much by the calibration, but no tach for TACH_LOSS_MS
+   on top of the timeout: cable off or rotor locked, the job stops */
+const int TACH_LOSS_MIN_RPM = 300;
+const unsigned long TACH_LOSS_MS = 1000UL;
+unsigned long tachQuietSinceMs = 0;
+/* Job stopped for it; shown until the next start */
+bool tachLost = false;
+
+/* Drift detection
+   During the hold phase (PWM steady for DRIFT_SETTLE_MS) the tach RPM is
+   compared with estimateRpmFromPwm(). Each job yields a mean deviation in
+   permille, folded into an exponential average (weight 1/8) in EEPROM.
+*/
+const unsigned long DRIFT_SETTLE_MS = 3000UL;
+const unsigned long DRIFT_SAMPLE_MS = 100UL;
+/* Need at least this many hold samples for the job to count */
+const int DRIFT_MIN_SAMPLES = 10;
+/* Ignore predictions below this (fan stalled / deadband) */
+const int DRIFT_MIN_RPM = 300;
+/* Warn past 8 % average deviation, once a few jobs have been seen */
+const int DRIFT_WARN_PERMILLE = 80;
+const unsigned int DRIFT_WARN_MIN_JOBS = 4;
+
+/* Per-job hold accumulators */
+long driftSumMeasured = 0;
+long driftSumPredicted = 0;
+int driftSamples = 0;
+/* PWM seen at the last sample and when it last changed */
+int driftLastPwm = -1;
+unsigned long driftSteadySinceMs = 0;
+unsigned long driftLastSampleMs = 0;
+
+/* Spin-up inertia and ramp limit
+   The fan with its chuck is taken as first order: rpm' = (cmd - rpm) / tau,
+   cmd being the calibrated RPM of the PWM output and tau growing with the
+   inertia. Integrated over the start of each spin-up:
+     tau = sum((cmd - rpm) * dt) / (rpm_end - rpm_start)
+   so the estimate is running sums and one divide at the end. The tach
+   value is the mean over its last period, so it trails by about
+   delay = age of the last edge + period / 2; that adds delay * d(rpm) to
+   the lag sum, which is summed alongside and taken back out.
+   Following a ramp of slope a, the fan lags by a * tau; the drive current
+   grows with that lag, so the ramp limit for the run is RAMP_LAG_RPM / tau.
+   Until the estimate is in, RAMP_DEFAULT_RPM_PER_S applies. The limit
+   slews manual jobs only: recipe ramps are checked against the recipe's
+   accel by host/recipeCompiler and trajectories are planned as they
+   are, and slewing either would eat into the step and segment times.
+*/
+const unsigned long INERTIA_SAMPLE_MS = 10UL;
+/* Window starts here; below it tach periods are long and few */
+const int INERTIA_START_RPM = 300;
+/* Window: until the fan has risen this far, or this long after the start */
+const int INERTIA_RISE_RPM = 1000;
+const unsigned long INERTIA_WINDOW_MS = 2000UL;
+/* Less rise than this says nothing (low setpoint, stalled fan) */
+const int INERTIA_MIN_RISE_RPM = 200;
+/* Estimates outside this range are not believed (ms) */
+const unsigned int INERTIA_MIN_TAU_MS = 20;
+const unsigned int INERTIA_MAX_TAU_MS = 5000;
+
+const unsigned int RAMP_LAG_RPM = 300;
+const unsigned int RAMP_DEFAULT_RPM_PER_S = 1000;
+const unsigned int RAMP_MIN_RPM_PER_S = 100;
+const unsigned int RAMP_MAX_RPM_PER_S = 8000;
+
+/* Estimator: measuring, done, or no estimate this run */
+const byte INERTIA_MEASURING = 0;
+const byte INERTIA_DONE = 1;
+const byte INERTIA_FAILED = 2;
+byte inertiaState = INERTIA_FAILED;
+unsigned long inertiaStartMs = 0;
+unsigned long inertiaLastSampleMs = 0;
+/* Window start RPM (-1 before it), last sample */
+int inertiaStartRpm = -1;
+int inertiaLastRpm = 0;
+/* Sum of (cmd - rpm) over the samples, RPM */
+long inertiaLagSum = 0;
+/* Sum of tach delay * d(rpm), RPM * 0.1 ms */
+long inertiaDelaySum = 0;
+/* Last estimate (ms), kept across runs for display */
+unsigned int inertiaTauMs = 0;
+
+/* Ramp limiter on the PWM output */
+unsigned int rampRpmPerS = RAMP_DEFAULT_RPM_PER_S;
+long rampPwmQ12 = 0;
+unsigned long rampLastMs = 0;
+/* Calibration cell the step below was worked out for */
+byte rampCell = 0xFF;
+/* PWM per ms (Q12) that moves the calibrated RPM at rampRpmPerS */
+long rampStepQ12 = 0;
+
+/* Background ADC
+   Conversions run back to back from the ADC interrupt through adcScan[];
+   loop() reads adcRaw[] instead of calling analogRead(), which would
+   fight the interrupt for the converter. At clk/128 a conversion takes
+   104 us, so a pass over the list takes about 0.6 ms (0.4 ms without
+   the pots).
+*/
+/* Channel 14 is the internal 1.1 V bandgap */
+const byte ADC_BANDGAP = 14;
+const byte adcScan[] = {
+#if USE_POTS
+  potCoarsePin - A0,
+  potFinePin - A0,
+#endif
+  vacuumPin - A0,
+  ntcPin - A0,
+  /* The first conversion after switching to the bandgap is off; it is
+     only there to let the input settle */
+  ADC_BANDGAP,
+  ADC_BANDGAP
+};
+const byte ADC_SCAN_N = sizeof(adcScan) / sizeof(adcScan[0]);
+/* adcRaw[] slots */
+#if USE_POTS
+const byte ADC_SLOT_COARSE = 0;
+const byte ADC_SLOT_FINE = 1;
+const byte ADC_SLOT_VACUUM = 2;
+#else
+const byte ADC_SLOT_VACUUM = 0;
+#endif
+const byte ADC_SLOT_NTC = ADC_SLOT_VACUUM + 1;
+const byte ADC_SLOT_BANDGAP = ADC_SLOT_VACUUM + 3;
+
+volatile unsigned int adcRaw[ADC_SCAN_N];
+/* Slot of the conversion in progress */
+volatile byte adcSlot = 0;
+
+/* Chuck vacuum interlock
+   Checked on every pass of the scan, in the ADC interrupt: losing the
+   vacuum while running turns the fan off there, within a pass, and
+   loop() then stops the job. Hysteresis between the two levels.
+*/
+/* Held above -40 kPa (2.1 V), lost above -30 kPa (1.7 V) */
+const unsigned int VACUUM_ON_RAW = 430;
+const unsigned int VACUUM_OFF_RAW = 348;
+/* The sensor tops out at 4.5 V; above 4.7 V it is shorted to the
+   supply, and counts as lost */
+const unsigned int VACUUM_FAULT_RAW = 962;
+
+volatile bool vacuumOk = false;
+/* Lost during a job; fan held off until the next start */
+volatile bool vacuumTripped = false;
+
+/* Motor temperature
+   ntcTable[] maps the NTC reading to 0.1 C on a uniform grid, entry i at
+   raw (i << NTC_SHIFT), like rpmCal[]; within 0.9 C over 0..100 C for a
+   10k B 3950 NTC under a 10k pull-up. A reading near either rail is an
+   open or shorted NTC and counts as a trip.
+   Above TEMP_DERATE_DC the PWM is capped, linearly down to
+   TEMP_DERATE_MIN_PWM at TEMP_TRIP_DC, where the job stops.
+*/
+const int NTC_SHIFT = 5;
+const int NTC_N = 33;
+const int ntcTable[NTC_N] PROGMEM = {
+  1500, 1293, 1016,  866,  763,  685,  621,  567,  519,
+   477,  438,  403,  369,  338,  307,  278,  250,  222,
+   194,  166,  139,  111,   82,   52,   21,  -12,  -48,
+   -88, -133, -188, -258, -368, -400
+};
+const unsigned int NTC_SHORT_RAW = 10;
+const unsigned int NTC_OPEN_RAW = 1000;
+
+const unsigned long TEMP_SAMPLE_MS = 100UL;
+const int TEMP_DERATE_DC = 600;
+const int TEMP_TRIP_DC = 800;
+/* Jobs start again below this */
+const int TEMP_RESET_DC = 700;
+const int TEMP_DERATE_MIN_PWM = 128;
+
+/* Filtered reading (Q4), -1 before the first sample */
+long tempRawQ4 = -1;
+unsigned long tempLastSampleMs = 0;
+int tempDeciC = 0;
+/* PWM cap from the derating */
+int tempMaxPwm = 255;
+/* NTC open or shorted */
+bool tempFault = false;
+/* Over TEMP_TRIP_DC (or NTC fault) and not yet back under TEMP_RESET_DC */
+bool tempTripped = false;
+
+/* Vibration
+   MPU6050 at 0x68 on the LCD's bus, accelerometer only (2 g range,
+   16384 counts/g), sampling at 250 Hz into its own FIFO. Every
+   MPU_POLL_MS one transaction reads the FIFO count and the next reads
+   the whole samples in one burst, so no sample is polled for.
+   Per axis a slow low-pass (about 1 s) tracks gravity and tilt and is
+   taken off; what is left is vibration. Its mean square is summed over
+   the job (RMS at the end) and low-passed for display, in mg.
+*/
+const byte MPU_ADDR = 0x68;
+const byte MPU_SMPLRT_DIV = 0x19;
+const byte MPU_CONFIG = 0x1A;
+const byte MPU_ACCEL_CONFIG = 0x1C;
+const byte MPU_FIFO_EN = 0x23;
+const byte MPU_USER_CTRL = 0x6A;
+const byte MPU_PWR_MGMT_1 = 0x6B;
+const byte MPU_FIFO_COUNTH = 0x72;
+const byte MPU_FIFO_R_W = 0x74;
+const byte MPU_WHO_AM_I = 0x75;
+/* USER_CTRL: FIFO on, and reset it */
+const byte MPU_FIFO_ON_RESET = 0x44;
+
+const unsigned long MPU_POLL_MS = 40UL;
+const byte MPU_SAMPLE_BYTES = 6;
+/* 10 samples come in per poll; a late poll catches up in bursts */
+const byte MPU_BURST_SAMPLES = 12;
+/* FIFO count sticks here when it has overflowed */
+const unsigned int MPU_FIFO_BYTES = 1024;
+
+/* Not fitted, waiting to poll, count read queued, burst read queued,
+   FIFO reset queued */
+const byte MPU_OFF = 0;
+const byte MPU_WAIT = 1;
+const byte MPU_COUNT = 2;
+const byte MPU_BURST = 3;
+const byte MPU_RESET = 4;
+byte mpuState = MPU_OFF;
+unsigned long mpuLastPollMs = 0;
+byte mpuTx[2];
+byte mpuRx[MPU_BURST_SAMPLES * MPU_SAMPLE_BYTES];
+I2cXfer mpuXfer = { MPU_ADDR, mpuTx, 0, mpuRx, 0, I2C_IDLE };
+/* Samples in the burst being read, and whether the FIFO held more */
+byte mpuBurstSamples = 0;
+bool mpuMore = false;
+unsigned int mpuOverflows = 0;
+
+/* Gravity and tilt per axis (counts, Q4); unset before the first sample */
+long mpuOffsetQ4[3];
+bool mpuOffsetSet = false;
+/* Mean square, low-passed (mg^2) */
+long vibMeanSq = 0;
+/* Job sums (mg^2) */
+uint64_t vibJobSumSq = 0;
+unsigned long vibJobSamples = 0;
+unsigned int vibLiveMg = 0;
+/* RMS of the last job */
+unsigned int vibJobRmsMg = 0;
+
+#if USE_LCD
+/* LCD pages */
+const byte LCD_PAGE_MAIN = 0;
+const byte LCD_PAGE_DIAG = 1;
+const byte LCD_PAGE_VIB = 2;
+const byte LCD_PAGE_PROD = 3;
+const byte LCD_PAGE_COUNT = 4;
+byte lcdPage = LCD_PAGE_MAIN;
+#endif
+
+#if USE_TELEMETRY
+/* Telemetry
+   One text line per TELEMETRY_MS (fields in the header line printed at
+   power-up). A line is only queued when the TX buffer has room for all
+   of it, so loop() never waits on the UART; skipped lines are counted.
+*/
+const unsigned long TELEMETRY_BAUD = 115200UL;
+const unsigned long TELEMETRY_MS = 100UL;
+/* Longest line, CR LF included; the TX buffer holds 63 */
+const byte TELEMETRY_LINE_MAX = 62;
+
+unsigned long telemetryLastMs = 0;
+unsigned int telemetrySkipped = 0;
+
+/* Fields of a line, in the order of the header */
+const byte TELEMETRY_FIELDS = 11;
+
+#if USE_TELEMETRY_DELTA
+/* Change-only telemetry
+   A frame per TELEMETRY_MS carries only the fields that moved past
+   their deadband since the value last sent, each as a zigzag varint of
+   the change from it, so the receiver is never off by more than the
+   deadband. Every TELEMETRY_KEY_TICKS a keyframe carries every field as
+   its value, for a receiver that joined late or lost bytes. ms is in
+   every frame; when nothing else moved, nothing is sent.
+     0xA5 <len> <flags> <mask> <field>... <sum>
+   len counts flags to the last field; flags bit 0 marks a keyframe;
+   mask has a bit per field (bit 0 ms), as a varint; sum is the low byte
+   of the sum of len to the last field. Query answers ('H', 'C') are
+   still text between frames.
+*/
+const byte TELEMETRY_SYNC = 0xA5;
+const byte TELEMETRY_KEY_FLAG = 0x01;
+/* A keyframe every 5 s */
+const byte TELEMETRY_KEY_TICKS = 50;
+/* Largest change not sent, per field */
+const unsigned int telemetryDeadband[TELEMETRY_FIELDS] PROGMEM = {
+  /* ms, run, step, pwm, rpm, left_s */
+  0, 0, 0, 2, 20, 0,
+  /* temp_dC, pwm_max, vib_mg, stack_free, skipped */
+  3, 0, 20, 16, 0
+};
+
+/* The receiver's view: what was last sent of each field */
+long telemetrySent[TELEMETRY_FIELDS];
+/* Ticks to the next keyframe; 0 sends one (the first frame is one) */
+byte telemetryKeyIn = 0;
+#endif
+
+/* History query
+   'H' on RX streams the job history, oldest record first, as the TX
+   buffer has room (telemetry lines are skipped meanwhile):
+     H# <records> <slots> <dropped> <boot now>
+     H <boot> <start_s> <mode> <recipe> <run_s> <end> <err_mean> <err_max>
+     H.
+   mode and end are JOB_* and JOB_END_* values, errors in RPM; run_s is
+   "-" for a job still open (running, or cut by a power loss).
+*/
+const byte HISTORY_LINE_MAX = 48;
+/* Next line: header, records 0.., trailer; or none */
+const int HISTORY_DUMP_HEADER = -1;
+const int HISTORY_DUMP_IDLE = -2;
+int historyDumpPos = HISTORY_DUMP_IDLE;
+
+/* Counters query
+   'C' on RX answers with one line:
+     C <done> <aborted> <spin_s> <idle_s> <util_permille> <jobs_last_h>
+*/
+bool prodQueryPending = false;
+#endif
+
+#if USE_PROFILER
+/* Profiler
+   Timer1 (already running the fan PWM, phase correct at ~490 Hz)
+   interrupts on compare B, twice a period; OCR1B is reloaded from an
+   LFSR so the samples do not lock to anything periodic in loop(). Each
+   sample counts the interrupted address into a flash bin of
+   2^profileShift bytes, sized so the bins cover the whole program.
+   Every PROFILE_DUMP_MS the bins are printed and cleared, a line per
+   loop() pass as the TX buffer has room:
+     P# <shift> <bins> <ms> <outside> <loop_us_mean> <loop_us_max>
+     P <bin> <count>      (nonzero bins only)
+     P.
+*/
+const unsigned long PROFILE_BAUD = 115200UL;
+const unsigned long PROFILE_DUMP_MS = 5000UL;
+const byte PROFILE_BINS = 128;
+/* Longest line, CR LF included */
+const byte PROFILE_LINE_MAX = 44;
+
+/* Interrupted PC (word address), left by the vector stub */
+volatile unsigned int profilePc;
+volatile unsigned int profileBins[PROFILE_BINS];
+/* Samples past the last bin (bootloader) */
+volatile unsigned int profileOutside = 0;
+byte profileShift = 0;
+volatile byte profileLfsr = 1;
+unsigned long profileLastDumpMs = 0;
+/* Next bin to print, -1 between dumps */
+int profileDumpBin = -1;
+#endif
+
+/* Stack
+   The free RAM between .bss and the top of the stack is painted at
+   reset, before main(). The stack overwrites the paint as it grows and
+   nothing paints it back, so the first byte up from the bottom that is
+   not paint is the deepest the stack (interrupts included) has been.
+   The scan runs a chunk per loop() pass.
+*/
+#if defined(__AVR__)
+extern byte __heap_start;
+extern byte __stack;
+byte *const stackLow = &__heap_start;
+byte *const stackHigh = &__stack;
+#else
+/* host/sim runs the firmware on a stack of its own */
+byte *const stackLow = simStack;
+byte *const stackHigh = simStack + SIM_STACK_BYTES - 1;
+#endif
+const byte STACK_PAINT = 0xC5;
+const byte STACK_SCAN_CHUNK = 64;
+
+byte *stackScanPos = stackLow;
+/* Bytes the stack has never reached */
+unsigned int stackFree = 0;
+
+/* Loop time
+   From one loop() pass to the next (us), to compare builds on the
+   board: a running mean (a sixteenth per pass) and the longest since
+   power-up. Not kept under USE_TT_SCHEDULE, which times its slots
+   instead.
+*/
+unsigned long loopLastUs = 0;
+unsigned long loopUsMeanQ4 = 0;
+unsigned int loopUsMean = 0;
+unsigned int loopUsMax = 0;
+
+#if USE_TT_SCHEDULE
+/* Time-triggered schedule
+   loop() runs a fixed table instead of every task each pass: a major
+   frame of TT_SLOTS slots of TT_SLOT_US, each slot a set of tasks, the
+   control task in every one. A slot starts when its time comes, not
+   when the work before it ends, so the start jitter of the control
+   task is one loop() call plus interrupts, whatever the other tasks
+   do. The tasks are already cut into bounded chunks (a byte of EEPROM,
+   a run of LCD cells, a telemetry line, a chunk of the stack scan),
+   which is what keeps each inside its slot.
+   A slot that ends past its time is an overrun: counted, with the
+   slot, and the frame goes on from the current time rather than
+   running late slots back to back to catch up.
+*/
+const unsigned long TT_SLOT_US = 1000UL;
+const byte TT_SLOTS = 10;
+
+/* Tasks, a bit each */
+const byte TT_KEYPAD = 0x01;
+const byte TT_SENSORS = 0x02;
+const byte TT_CONTROL = 0x04;
+const byte TT_UI = 0x08;
+const byte TT_IO = 0x10;
+const byte TT_COMM = 0x20;
+const byte TT_BACKGROUND = 0x40;
+
+/* Control at 1 kHz; keypad (the library debounces it to 10 ms
+   anyway), sensors and I2C at 500 Hz; telemetry and the background at
+   200 Hz; LCD page at 100 Hz */
+const byte ttSchedule[TT_SLOTS] PROGMEM = {
+  TT_CONTROL | TT_SENSORS | TT_KEYPAD,
+  TT_CONTROL | TT_IO,
+  TT_CONTROL | TT_SENSORS | TT_KEYPAD | TT_UI,
+  TT_CONTROL | TT_IO | TT_COMM,
+  TT_CONTROL | TT_SENSORS | TT_KEYPAD | TT_BACKGROUND,
+  TT_CONTROL | TT_IO,
+  TT_CONTROL | TT_SENSORS | TT_KEYPAD,
+  TT_CONTROL | TT_IO,
+  TT_CONTROL | TT_SENSORS | TT_KEYPAD | TT_COMM,
+  TT_CONTROL | TT_IO | TT_BACKGROUND
+};
+
+/* When the next slot is due, and which it is */
+unsigned long ttDueUs = 0;
+byte ttSlot = 0;
+/* Slots that ended past their time, and the last one that did */
+unsigned int ttOverruns = 0;
+byte ttOverrunSlot = 0;
+/* Latest start of a slot after its time (us) */
+unsigned int ttJitterMaxUs = 0;
+/* Longest run of each slot (us) */
+unsigned int ttSlotMaxUs[TT_SLOTS];
+#endif
+
+/* Supply monitor
+   The bandgap is converted against AVcc, so its reading rises as Vcc
+   falls: raw = 1.1 V * 1024 / Vcc. The bandgap is only good to 10 %, so
+   the limits are relative to the reading taken at power-up.
+   A drop of POWER_FAIL_PERMILLE for POWER_FAIL_PASSES passes is a power
+   loss: the ADC interrupt turns the fan and the valve off (less load,
+   longer hold-up) and sets checkpointDue; serviceCheckpoint() writes the
+   checkpoint at the top of the next loop() pass. Nothing in loop() waits
+   on the bus or the EEPROM, so that adds at most one pass (under 1 ms),
+   plus up to 3.3 ms for a write-behind byte already in flight. Each
+   changed EEPROM byte takes 3.3 ms; mode and duration are written behind
+   at job start, so a checkpoint is at most step, remaining ms and commit:
+   6 bytes, 20 ms. Hold-up needed from detection to the brown-out reset at
+   2.7 V: about 25 ms.
+*/
+const unsigned int POWER_FAIL_PERMILLE = 80;
+/* Back above this drop without a reset: supply recovered */
+const unsigned int POWER_RECOVER_PERMILLE = 40;
+const byte POWER_FAIL_PASSES = 2;
+/* Power-up readings outside 3.0..5.5 V: no bandgap, monitor stays off */
+const unsigned int POWER_MIN_RAW = 205;
+const unsigned int POWER_MAX_RAW = 375;
+
+/* Supply good, lost (outputs off, checkpoint written by loop()), back
+   without a reset (loop() stops the job) */
+const byte POWER_OK = 0;
+const byte POWER_LOST = 1;
+const byte POWER_BACK = 2;
+volatile byte powerState = POWER_OK;
+/* Set by the ADC interrupt, taken by loop(): the EEPROM is only ever
+   written from loop(), so no write can be cut in half by another */
+volatile bool checkpointDue = false;
+/* Bandgap limits (raw), 0 while the monitor is off */
+unsigned int powerFailRaw = 0;
+unsigned int powerRecoverRaw = 0;
+byte powerLowPasses = 0;
+/* First low reading of the current dip */
+unsigned long powerLowUs = 0;
+
+/* Persistent data (EEPROM)
+   RAM copies are the master; persistRegions[] maps them to EEPROM and
+   changed bytes are written behind by servicePersist(), one byte per pass,
+   so loop() never waits on EEPROM.
+*/
+const byte PERSIST_MAGIC = 0xC5;
+const byte PERSIST_VERSION = 2;
+const int PERSIST_ADDR = 0;
+
+/* Fixed-width and packed so the layout matches on host builds */
+struct __attribute__((packed)) PersistData {
+  uint8_t magic;
+  uint8_t version;
+  /* Drift average, permille in Q4 */
+  int16_t driftQ4;
+  /* Jobs folded into the average (saturates) */
+  uint16_t driftJobs;
+  /* Power-ups, this one included (version 2) */
+  uint16_t boots;
+};
+
+PersistData persist;
+
+/* Seconds since power-up; millis() alone wraps after 49.7 days */
+unsigned long uptimeSec = 0;
+unsigned long uptimeMarkMs = 0;
+
+/* Recalibration warning */
+bool driftWarn = false;
+
+/* Recipe
+   Stored in EEPROM at RECIPE_ADDR as RecipeData; host/recipeCompiler
+   builds the image (RPM already mapped to PWM, ramp slopes precomputed)
+   and uploads it over Modbus. A step ramps linearly from the previous
+   step's PWM (0 for the first) for rampMs, then holds for holdSec.
+   dispenseUs counts from the start of the step (start of its ramp).
+   With jerkQ8 set, the corners of the ramps are rounded off, see
+   planBlends().
+*/
+const byte RECIPE_MAGIC = 0xA6;
+const int RECIPE_ADDR = 32;
+const byte RECIPE_MAX_STEPS = 8;
+/* dispenseUs value for steps without a dispense */
+const unsigned long DISPENSE_NONE = 0xFFFFFFFFUL;
+
+struct __attribute__((packed)) RecipeStep {
+  /* Fan PWM for the step */
+  uint8_t pwm;
+  /* Ramp time into the step, and its nominal slope in PWM/ms (Q8):
+     recipeValid() checks the image by it, planBlends() works out the
+     slope the ramp runs at */
+  uint16_t rampMs;
+  int16_t rampQ8;
+  /* Time at speed after the ramp */
+  uint16_t holdSec;
+  /* Valve open offset into the step */
+  uint32_t dispenseUs;
+  /* Valve open time */
+  uint16_t dispenseMs;
+};
+
+struct __attribute__((packed)) RecipeData {
+  uint8_t magic;
+  /* Recipe number, for traceability */
+  uint8_t id;
+  uint8_t count;
+  /* Limit on the change of ramp slope, Q8 PWM/ms per second; 0 = sharp */
+  uint16_t jerkQ8;
+  RecipeStep steps[RECIPE_MAX_STEPS];
+};
+
+RecipeData recipeData;
+
+/* Blend plan for the running recipe (planBlends(), at job start) */
+struct StepBlend {
+  /* Ramp slope, steepened to make room for the blends, PWM/ms (Q16;
+     Q8 would be off by a few PWM at the end of a long ramp) */
+  long slopeQ16;
+  /* Blend widths at the start and the end of the ramp (ms) */
+  unsigned int inMs;
+  unsigned int outMs;
+  /* Blend shared with the previous / next ramp (no hold between) */
+  bool chainIn;
+  bool chainOut;
+};
+
+StepBlend stepBlend[RECIPE_MAX_STEPS];
+
+/* Resume checkpoint
+   Filled in and written behind when a job starts; on a power loss the
+   ADC interrupt flags it and loop() (serviceCheckpoint()) updates step
+   and remaining time and writes them out, commit byte last, so a torn
+   checkpoint is never offered.
+*/
+const int RESUME_ADDR = 160;
+const byte RESUME_COMMIT = 0x5A;
+const byte RESUME_NONE = 0xFF;
+
+const byte JOB_MANUAL = 0;
+const byte JOB_RECIPE = 1;
+const byte JOB_TRAJ = 2;
+
+struct __attribute__((packed)) ResumeData {
+  uint8_t mode;
+  /* Recipe id and step (recipe jobs) */
+  uint8_t recipeId;
+  uint8_t step;
+  uint32_t durationSec;
+  uint32_t remainingMs;
+  uint8_t commit;
+  /* Last checkpoint: first low supply reading to commit written (us),
+     written after the commit when the hold-up allows */
+  uint16_t writeUs;
+};
+
+ResumeData resume;
+
+/* Checkpoint found at power-up (or after a supply dip): '#' resumes */
+bool resumeOffered = false;
+
+/* Job history
+   One record per job in a ring of HISTORY_SLOTS up to the production
+   counters, so each slot is written once every HISTORY_SLOTS jobs. The
+   record is opened at the start and closed at the end, both written
+   behind; a job cut by a power loss or reset stays on file as cut. The
+   newest slot is found at power-up by scanning for where (boot, start)
+   stops increasing, so there is no head pointer to wear out.
 */
-const int CAL_N = 6;
+const int HISTORY_ADDR = 192;
+const byte HISTORY_SLOTS = 64;
+/* boot of a never-written slot */
+const uint16_t HISTORY_BLANK = 0xFFFF;
+/* runSec of a job that has not ended */
+const uint16_t HISTORY_RUN_OPEN = 0xFFFF;
+/* RPM error is kept in steps of 8 RPM */
+const byte HISTORY_ERR_SHIFT = 3;
 
-const int pwmCal[CAL_N] = {  0,  60, 100, 140, 180, 220 };
-const int rpmCal[CAL_N] = {  0, 800,1500,2200,2900,3500 };
+/* End reasons, low nibble of end; the job mode is in the high one */
+const byte JOB_END_DONE = 0;
+const byte JOB_END_KEY = 1;
+const byte JOB_END_REMOTE = 2;
+const byte JOB_END_VACUUM = 3;
+const byte JOB_END_HOT = 4;
+const byte JOB_END_TACH = 5;
+/* Supply dip without a reset; a record still open is shown as this */
+const byte JOB_END_POWER = 6;
+
+/* 12 bytes; boot last, so a record torn by a power loss while being
+   opened still reads as the slot's old one */
+struct __attribute__((packed)) HistoryRecord {
+  /* Seconds since the job's power-up, at the start */
+  uint32_t startSec;
+  /* Job clock at the end (s, saturates), HISTORY_RUN_OPEN while open */
+  uint16_t runSec;
+  /* Recipe jobs */
+  uint8_t recipeId;
+  uint8_t end;
+  /* |tach - calibration| over the hold phase, mean and max */
+  uint8_t errMean;
+  uint8_t errMax;
+  /* Power-up count (persist.boots) */
+  uint16_t boot;
+};
+
+/* The newest record; RAM is its master until written */
+HistoryRecord historyRec;
+/* Slot of historyRec (HISTORY_SLOTS: none this power-up), next slot */
+byte historySlot = HISTORY_SLOTS;
+byte historyNext = 0;
+byte historyCount = 0;
+/* The running job has a record to close */
+bool historyOpen = false;
+/* Jobs not recorded: the previous record was still being written */
+unsigned int historyDropped = 0;
+
+/* Production counters
+   Totals kept in RAM and written behind when a job ends (its spin time
+   and the idle time before it), each time into the next of PROD_COPIES
+   copies, so a copy is written once every PROD_COPIES jobs; the copy
+   with the most jobs is the newest. Idle time after the last job before
+   a power-off is not counted, nor is a job cut by a reset.
+*/
+const int PROD_ADDR = 960;
+const byte PROD_COPIES = 4;
+/* Jobs ended in the last hour, in 5 minute buckets */
+const byte PROD_RATE_BUCKETS = 12;
+const unsigned int PROD_RATE_BUCKET_SEC = 300;
+
+/* Job counts last: a copy torn by a power loss while being written
+   still has its old counts, or the other fields already new */
+struct __attribute__((packed)) ProdCounters {
+  uint32_t spinSec;
+  uint32_t idleSec;
+  uint32_t jobsAborted;
+  uint32_t jobsDone;
+};
+
+ProdCounters prod;
+byte prodCopy = 0;
+/* Start of the current spin or idle stretch, and the ms the totals
+   have not taken yet */
+unsigned long prodMarkMs = 0;
+unsigned int prodSpinMs = 0;
+unsigned int prodIdleMs = 0;
+byte prodRate[PROD_RATE_BUCKETS];
+unsigned long prodRateBucket = 0;
+/* Live figures, the running stretch included (loop()) */
+unsigned int prodUtilPermille = 0;
+unsigned int prodJobsPerHour = 0;
+
+/* Hold-phase tach error of the running job */
+unsigned long jobErrSum = 0;
+unsigned int jobErrMax = 0;
+unsigned long jobErrSamples = 0;
+
+/* EEPROM regions kept by the write-behind path */
+struct PersistRegion {
+  byte *ram;
+  int addr;
+  byte len;
+  /* Dirty byte range [dirtyLo, dirtyHi) */
+  byte dirtyLo;
+  byte dirtyHi;
+};
+
+PersistRegion persistRegions[] = {
+  { (byte *)&persist, PERSIST_ADDR, sizeof(persist), 0, 0 },
+  { (byte *)&recipeData, RECIPE_ADDR, sizeof(recipeData), 0, 0 },
+  { (byte *)&resume, RESUME_ADDR, sizeof(resume), 0, 0 },
+  /* addr moves to the slot of each new record, or copy */
+  { (byte *)&historyRec, HISTORY_ADDR, sizeof(historyRec), 0, 0 },
+  { (byte *)&prod, PROD_ADDR, sizeof(prod), 0, 0 }
+};
+const byte PERSIST_REGION_COUNT = sizeof(persistRegions) / sizeof(persistRegions[0]);
+/* Index of the moving entries above */
+const byte HISTORY_REGION = 3;
+const byte PROD_REGION = 4;
+
+/* Recipe mode selected (A key) */
+bool recipeMode = false;
+/* Current step while a recipe runs */
+byte jobStep = 0;
+/* Job-clock time the current step started */
+unsigned long stepStartMs = 0;
+
+/* Trajectory
+   Breakpoints in PROGMEM: each one reaches pwm after ms milliseconds,
+   linearly from the previous breakpoint (the first starts from 0).
+   The player advances one tick per millisecond; a segment costs one
+   divide when loaded, each tick only adds and compares.
+*/
+struct TrajPoint {
+  uint16_t ms;
+  uint8_t pwm;
+};
+
+/* Spread at low speed, spin up, spin, spin down */
+const TrajPoint trajectory[] PROGMEM = {
+  {   500,  60 },
+  {  2000,  60 },
+  {  1500, 200 },
+  { 20000, 200 },
+  {  3000,   0 }
+};
+const byte TRAJ_N = sizeof(trajectory) / sizeof(trajectory[0]);
+
+/* Trajectory mode selected (B key) */
+bool trajMode = false;
+/* Player state */
+byte trajIndex = 0;
+byte trajPwm = 0;
+unsigned int trajTicksLeft = 0;
+/* Segment length, whole and fractional step per tick, direction */
+unsigned int trajDt = 1;
+byte trajStepQ = 0;
+unsigned int trajStepR = 0;
+unsigned long trajErr = 0;
+bool trajUp = true;
+unsigned long trajTickMs = 0;
+
+/* Dispense timing
+   Timer2 free-runs at clk/64 (4 us/tick); compare A is used as a one-shot
+   alarm (compare B is the Modbus T3.5 alarm). Long delays are split into
+   chunks so the 8-bit compare never has to reach a value the counter has
+   already passed.
+*/
+const unsigned long DISPENSE_US_PER_TICK = 4UL;
+/* Offsets shorter than this open the valve immediately */
+const unsigned long DISPENSE_MIN_TICKS = 8UL;
+
+const byte DISPENSE_IDLE = 0;
+const byte DISPENSE_WAIT = 1;
+const byte DISPENSE_OPEN = 2;
+
+volatile byte dispensePhase = DISPENSE_IDLE;
+/* Ticks still to go in the current phase */
+volatile unsigned long dispenseTicksLeft = 0;
+/* Valve open time, loaded when the valve opens */
+volatile unsigned long dispenseOpenTicks = 0;
+
+/* Dip trigger
+   Tach RPM is low-pass filtered every DIP_SAMPLE_MS; the first difference
+   of that, filtered again, is the acceleration. Once the fan has been
+   steady for DIP_STEADY_MS, an acceleration below -DIP_RPM_PER_S starts
+   the countdown. Filters are shift-based EMAs on Q4 values.
+*/
+const unsigned long DIP_SAMPLE_MS = 10UL;
+/* Spin-up must be over: |accel| below DIP_STEADY_RPM_PER_S this long */
+const unsigned long DIP_STEADY_MS = 500UL;
+const long DIP_STEADY_RPM_PER_S = 150L;
+/* Dip threshold (deceleration) */
+const long DIP_RPM_PER_S = 600L;
+/* No dip this long after '#': fall back to manual start */
+const unsigned long DIP_TIMEOUT_MS = 30000UL;
+
+/* Dip trigger mode selected (C key) */
+bool dipMode = false;
+/* Job started, countdown waiting for the dip */
+bool dipWaiting = false;
+/* Timed out, countdown waiting for '#' */
+bool dipTimedOut = false;
+unsigned long dipArmMs = 0;
+unsigned long dipLastSampleMs = 0;
+unsigned long dipSteadySinceMs = 0;
+/* Filtered RPM and acceleration (Q4) */
+long dipRpmQ4 = 0;
+long dipAccelQ4 = 0;
 
 /* Duration input */
 unsigned long durationSeconds = 0;
@@ -77,8 +1224,277 @@ unsigned long jobStartMs = 0;
 /* Latched duration for the run */
 unsigned long jobDurationSeconds = 0;
 
+#if USE_LCD
 /* UI refresh timing */
 unsigned long lastUiMs = 0;
+#endif
+
+/* Live values copied by the control task each pass, for remote
+   readers (the only registers that are copies, see USE_MODBUS) */
+int measuredRpm = 0;
+unsigned long remainingSeconds = 0;
+/* PWM the control task worked out (pots or job), for the UI and
+   telemetry */
+int controlPwm = 0;
+
+/* Remote setpoint, above 255 = follow the pots */
+const unsigned int PWM_FROM_POTS = 0xFFFF;
+volatile unsigned int pwmOverride = PWM_FROM_POTS;
+
+#if USE_MODBUS
+/* Modbus RTU slave
+   Frames are collected by the RX ISR with the CRC updated per byte; the
+   Timer2 compare B alarm marks T3.5 silence, and the request is answered
+   from that ISR so loop() latency never delays a reply.
+   Registers point at the controller variables and are read in place,
+   with two exceptions: measured RPM and remaining time are worked out
+   by the control task and copied to measuredRpm and remainingSeconds
+   each pass, with interrupts off so a read never sees half an update.
+   The other multi-byte registers are not guarded: one written by
+   loop() can be read torn, if the reply lands between its bytes.
+   Writes to the job settings (duration, recipe and dip mode) are
+   refused while a job runs and staged for loop(), which applies them
+   between jobs; they read back the old value until it has.
+*/
+const byte MODBUS_ADDR = 1;
+const unsigned long MODBUS_BAUD = 115200UL;
+/* T3.5 is fixed at 1750 us above 19200 baud (4 us Timer2 ticks) */
+const unsigned int MODBUS_T35_TICKS = 1750U / 4U;
+/* Frame buffer, shared by request and reply */
+const byte MODBUS_BUF_SIZE = 96;
+
+/* Commands written to the command register */
+const byte MODBUS_CMD_NONE = 0;
+const byte MODBUS_CMD_START = 1;
+const byte MODBUS_CMD_STOP = 2;
+/* Validate the uploaded recipe and save it to EEPROM */
+const byte MODBUS_CMD_SAVE_RECIPE = 3;
+
+/* Holding registers from here on are the recipe image, 2 bytes each */
+const unsigned int MODBUS_RECIPE_BASE = 0x100;
+const unsigned int MODBUS_RECIPE_WORDS = (sizeof(RecipeData) + 1) / 2;
+/* Input registers from here on are the job history, oldest record
+   first, MODBUS_HISTORY_WORDS each (HistoryRecord bytes, high first) */
+const unsigned int MODBUS_HISTORY_BASE = 0x100;
+const unsigned int MODBUS_HISTORY_WORDS = sizeof(HistoryRecord) / 2;
+
+/* Holding registers 1..4 are the job settings: duration (2 words, low
+   first), recipe mode, dip mode */
+const byte MODBUS_HOLD_DURATION = 1;
+const byte MODBUS_SETTING_WORDS = 4;
+
+/* Exception codes */
+const byte MODBUS_EX_FUNCTION = 1;
+const byte MODBUS_EX_ADDRESS = 2;
+const byte MODBUS_EX_VALUE = 3;
+const byte MODBUS_EX_BUSY = 6;
+
+/* CRC-16/MODBUS, reflected poly 0xA001 */
+const unsigned int modbusCrcTable[256] PROGMEM = {
+  0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+  0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+  0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+  0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+  0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+  0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+  0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+  0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+  0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+  0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+  0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+  0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+  0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+  0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+  0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+  0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+  0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+  0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+  0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+  0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+  0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+  0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+  0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+  0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+  0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+  0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+  0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+  0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+  0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+  0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+  0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+  0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+
+struct ModbusReg {
+  /* Backing variable (low word for 32-bit values) */
+  void *ptr;
+  /* 1 or 2 bytes */
+  byte size;
+  /* Largest value a write may store */
+  unsigned int maxValue;
+};
+
+volatile byte modbusCommand = MODBUS_CMD_NONE;
+/* Job settings written by the reply ISR, a bit per word pending */
+volatile unsigned int modbusSettings[MODBUS_SETTING_WORDS];
+volatile byte modbusSettingsPending = 0;
+/* Good frames for this address, and frames dropped (CRC/overrun) */
+volatile unsigned int modbusFrameCount = 0;
+volatile unsigned int modbusErrorCount = 0;
+
+/* Input registers (FC 04) */
+const ModbusReg modbusInputRegs[] PROGMEM = {
+  { (void *)&isRunning, 1, 0 },
+  { (void *)&dipWaiting, 1, 0 },
+  { (void *)&jobStep, 1, 0 },
+  { (void *)&measuredRpm, 2, 0 },
+  { (void *)&remainingSeconds, 2, 0 },
+  { (byte *)&remainingSeconds + 2, 2, 0 },
+  { (void *)&persist.driftQ4, 2, 0 },
+  { (void *)&persist.driftJobs, 2, 0 },
+  { (void *)&modbusFrameCount, 2, 0 },
+  { (void *)&modbusErrorCount, 2, 0 },
+  { (void *)&inertiaTauMs, 2, 0 },
+  { (void *)&rampRpmPerS, 2, 0 },
+  { (void *)&resumeOffered, 1, 0 },
+  { (void *)&resume.writeUs, 2, 0 },
+  { (void *)&vacuumOk, 1, 0 },
+  { (void *)&adcRaw[ADC_SLOT_VACUUM], 2, 0 },
+  { (void *)&tempDeciC, 2, 0 },
+  { (void *)&tempMaxPwm, 2, 0 },
+  { (void *)&vibLiveMg, 2, 0 },
+  { (void *)&vibJobRmsMg, 2, 0 },
+  { (void *)&stackFree, 2, 0 },
+  { (void *)&historyCount, 1, 0 },
+  { (void *)&historyDropped, 2, 0 },
+  { (void *)&persist.boots, 2, 0 },
+  { (void *)&prod.jobsDone, 2, 0 },
+  { (byte *)&prod.jobsDone + 2, 2, 0 },
+  { (void *)&prod.jobsAborted, 2, 0 },
+  { (byte *)&prod.jobsAborted + 2, 2, 0 },
+  { (void *)&prod.spinSec, 2, 0 },
+  { (byte *)&prod.spinSec + 2, 2, 0 },
+  { (void *)&prod.idleSec, 2, 0 },
+  { (byte *)&prod.idleSec + 2, 2, 0 },
+  { (void *)&prodUtilPermille, 2, 0 },
+  { (void *)&prodJobsPerHour, 2, 0 },
+  { (void *)&loopUsMean, 2, 0 },
+  { (void *)&loopUsMax, 2, 0 },
+#if USE_TT_SCHEDULE
+  { (void *)&ttOverruns, 2, 0 },
+  { (void *)&ttOverrunSlot, 1, 0 },
+  { (void *)&ttJitterMaxUs, 2, 0 },
+  /* Longest run of slots 0..9 */
+  { (void *)&ttSlotMaxUs[0], 2, 0 },
+  { (void *)&ttSlotMaxUs[1], 2, 0 },
+  { (void *)&ttSlotMaxUs[2], 2, 0 },
+  { (void *)&ttSlotMaxUs[3], 2, 0 },
+  { (void *)&ttSlotMaxUs[4], 2, 0 },
+  { (void *)&ttSlotMaxUs[5], 2, 0 },
+  { (void *)&ttSlotMaxUs[6], 2, 0 },
+  { (void *)&ttSlotMaxUs[7], 2, 0 },
+  { (void *)&ttSlotMaxUs[8], 2, 0 },
+  { (void *)&ttSlotMaxUs[9], 2, 0 },
+#endif
+};
+
+/* Holding registers (FC 03 / 06 / 16) */
+const ModbusReg modbusHoldingRegs[] PROGMEM = {
+  { (void *)&pwmOverride, 2, 0xFFFF },
+  { (void *)&durationSeconds, 2, 0xFFFF },
+  { (byte *)&durationSeconds + 2, 2, 0xFFFF },
+  { (void *)&recipeMode, 1, 1 },
+  { (void *)&dipMode, 1, 1 },
+  { (void *)&modbusCommand, 1, MODBUS_CMD_SAVE_RECIPE }
+};
+
+const byte MODBUS_INPUT_COUNT = sizeof(modbusInputRegs) / sizeof(modbusInputRegs[0]);
+const byte MODBUS_HOLDING_COUNT = sizeof(modbusHoldingRegs) / sizeof(modbusHoldingRegs[0]);
+
+volatile byte modbusBuf[MODBUS_BUF_SIZE];
+volatile byte modbusLen = 0;
+volatile unsigned int modbusCrc = 0xFFFF;
+/* Frame overran the buffer; dropped at T3.5 */
+volatile bool modbusOverrun = false;
+/* Reply being sent: RX is ignored */
+volatile bool modbusTxBusy = false;
+volatile byte modbusTxPos = 0;
+/* Ticks left before the T3.5 alarm fires */
+volatile unsigned int modbusT35Left = 0;
+#endif
+
+#if USE_SD_LOG
+/* SD card job log
+   Records go into SPINLOG.BIN, located once at boot by reading the FAT.
+   The file is written with raw multi-block writes (CMD25), so the FAT and
+   directory are never touched while logging. Two small record buffers
+   alternate: one fills while the other is streamed into the open 512-byte
+   block, a few bytes per loop() pass. The card's busy time after each
+   block is polled, never waited on; a full buffer drops records instead.
+   Host builds write the same block stream into a file (SD_IMAGE_PATH).
+*/
+const int sdCsPin = A2;
+const char SD_LOG_NAME[11] = {'S','P','I','N','L','O','G',' ','B','I','N'};
+#if !defined(__AVR__)
+const char SD_IMAGE_PATH[] = "sdcard.img";
+#endif
+
+const unsigned int SD_BLOCK_SIZE = 512;
+const unsigned long SD_SAMPLE_MS = 20UL;
+/* Each record buffer holds 4 records */
+const byte SD_BUF_SIZE = 32;
+/* Bytes clocked out per loop() pass (~3 us each at 8 MHz) */
+const byte SD_BYTES_PER_PASS = 16;
+
+/* Record types; 0 is never written, it marks empty space */
+const byte SD_REC_EMPTY = 0;
+const byte SD_REC_JOB_START = 1;
+const byte SD_REC_SAMPLE = 2;
+const byte SD_REC_JOB_END = 3;
+
+/* 8 bytes, 64 per block */
+struct SdRecord {
+  uint8_t type;
+  /* Job start: recipe mode; job end: JOB_END_* */
+  uint8_t pwm;
+  uint16_t rpm;
+  /* Job start: duration (s); others: ms since job start */
+  uint32_t timeMs;
+};
+
+/* Stream states */
+const byte SD_OFF = 0;
+const byte SD_IDLE = 1;
+const byte SD_BLOCK = 2;
+const byte SD_BUSY = 3;
+const byte SD_STOPPING = 4;
+
+byte sdState = SD_OFF;
+/* Log file location, in blocks */
+unsigned long sdFileLba = 0;
+unsigned long sdFileBlocks = 0;
+/* Next block to write (relative to the file) */
+unsigned long sdNextBlock = 0;
+/* Bytes already sent in the open block */
+unsigned int sdBlockPos = 0;
+/* Job ends once the current block is padded out */
+bool sdFlushing = false;
+
+byte sdBuf[2][SD_BUF_SIZE];
+byte sdFill = 0;
+byte sdFillLen = 0;
+byte sdDrainLen = 0;
+byte sdDrainPos = 0;
+
+unsigned long sdLastSampleMs = 0;
+/* Records lost to a slow card */
+unsigned int sdDropped = 0;
+
+#if !defined(__AVR__)
+FILE *sdImage = NULL;
+long sdImagePos = 0;
+#endif
+#endif
 
 /* Helpers */
 int clampInt(int v, int lo, int hi) {
@@ -87,6 +1503,15 @@ int clampInt(int v, int lo, int hi) {
   return v;
 }
 
+/* Latest conversion of an adcScan[] slot */
+unsigned int readAdc(byte slot) {
+  noInterrupts();
+  unsigned int raw = adcRaw[slot];
+  interrupts();
+  return raw;
+}
+
+#if USE_POTS
 /*
   Coarse/fine mapping strategy:
   - Coarse sets a base PWM in steps of 16 (0..240)
@@ -95,9 +1520,9 @@ int clampInt(int v, int lo, int hi) {
 */
 int readPwmFromPots() {
   /* Read coarse pot */
-  int coarseRaw = analogRead(potCoarsePin);
+  int coarseRaw = readAdc(ADC_SLOT_COARSE);
   /* Read fine pot */
-  int fineRaw = analogRead(potFinePin);
+  int fineRaw = readAdc(ADC_SLOT_FINE);
 
   /* Map coarse to 0..15 steps */
   int coarseStep = map(coarseRaw, 0, 1023, 0, 15);
@@ -114,117 +1539,2384 @@ int readPwmFromPots() {
 
   return pwm;
 }
+#else
+/* Manual job speed without pots; the PLC or a recipe sets its own */
+const int FIXED_PWM = 192;
+#endif
 
-void writeFanPwm(int pwm) {
-  /* Write PWM to fan */
-  analogWrite(fanPwmPin, pwm);
-}
-
-void clearDuration() {
-  /* Reset entered duration */
-  durationSeconds = 0;
-}
+int estimateRpmFromPwm(int pwm) {
+  pwm = clampInt(pwm, 0, 255);
 
-void startJob() {
-  /* Ignore if duration is zero */
-  if (durationSeconds == 0) return;
+  /* Grid cell and position inside it */
+  int i = pwm >> CAL_SHIFT;
+  int frac = pwm & ((1 << CAL_SHIFT) - 1);
 
-  /* Latch duration */
-  jobDurationSeconds = durationSeconds;
-  /* Start timer */
-  jobStartMs = millis();
-  /* Set running */
-  isRunning = true;
-}
+  int y0 = (int)pgm_read_word(&rpmCal[i]);
+  int y1 = (int)pgm_read_word(&rpmCal[i + 1]);
 
-void stopJob() {
-  /* Stop running */
-  isRunning = false;
-  /* Clear latched duration */
-  jobDurationSeconds = 0;
+  /* Table is monotone so the step is never negative */
+  return y0 + (int)(((long)(y1 - y0) * frac) >> CAL_SHIFT);
 }
 
-unsigned long getRemainingSeconds() {
-  /* If not running, remaining is 0 */
-  if (!isRunning) return 0;
+/* NTC reading to 0.1 C, same grid lookup as estimateRpmFromPwm() */
+int ntcToDeciC(unsigned int raw) {
+  if (raw > 1023) raw = 1023;
 
-  /* Elapsed milliseconds */
-  unsigned long elapsedMs = millis() - jobStartMs;
-  /* Elapsed seconds */
-  unsigned long elapsedSec = elapsedMs / 1000UL;
+  int i = raw >> NTC_SHIFT;
+  int frac = raw & ((1 << NTC_SHIFT) - 1);
 
-  /* If elapsed passed duration, remaining is 0 */
-  if (elapsedSec >= jobDurationSeconds) return 0;
+  int y0 = (int)pgm_read_word(&ntcTable[i]);
+  int y1 = (int)pgm_read_word(&ntcTable[i + 1]);
 
-  return (jobDurationSeconds - elapsedSec);
+  /* Table falls with the reading */
+  return y0 - (int)(((long)(y0 - y1) * frac) >> NTC_SHIFT);
 }
-int estimateRpmFromPwm(int pwm) {
-  if (pwm <= pwmCal[0]) return rpmCal[0];
-  if (pwm >= pwmCal[CAL_N - 1]) return rpmCal[CAL_N - 1];
 
-  for (int i = 0; i < CAL_N - 1; i++) {
-    int x0 = pwmCal[i];
-    int x1 = pwmCal[i + 1];
+/* Tach edge: PCINT0 fires on both edges of D8 */
+ISR(PCINT0_vect) {
+  /* Rising edges only */
+  if (!(PINB & _BV(PB0))) return;
 
-    if (pwm >= x0 && pwm <= x1) {
-      int y0 = rpmCal[i];
-      int y1 = rpmCal[i + 1];
+  unsigned long nowUs = micros();
+  unsigned long periodUs = nowUs - tachLastUs;
+  if (periodUs < TACH_MIN_PERIOD_US) return;
 
-      long num = (long)(pwm - x0) * (long)(y1 - y0);
-      long den = (long)(x1 - x0);
+  /* First edge after a stop only starts the next period: the time since
+     the last one is unknown modulo the micros() wrap */
+  tachPeriodUs = tachPeriodUs ? periodUs : 1;
+  tachLastUs = nowUs;
+}
 
-      return (int)(y0 + (num / den));
-    }
+void setupTach() {
+  pinMode(tachPin, INPUT_PULLUP);
+  /* Enable PCINT0 (D8) */
+  PCMSK0 |= _BV(PCINT0);
+  PCICR |= _BV(PCIE0);
+}
+
+int readMeasuredRpm() {
+  /* Copy ISR state atomically */
+  noInterrupts();
+  unsigned long periodUs = tachPeriodUs;
+  unsigned long lastUs = tachLastUs;
+  /* No recent edge: stopped. Forget the period, or once micros() wraps
+     (every 71.6 min) the last edge would look recent again. */
+  if (periodUs != 0 && micros() - lastUs > TACH_TIMEOUT_US) {
+    tachPeriodUs = 0;
+    periodUs = 0;
   }
+  interrupts();
 
-  return 0;
+  /* Stopped, or one edge so far */
+  if (periodUs <= 1) return 0;
+
+  return (int)(60000000UL / (periodUs * TACH_PULSES_PER_REV));
 }
-void updateLcd(int pwm, unsigned long remainingSec) {
-  int percent = (pwm * 100) / 255;
-  int rpmEst = estimateRpmFromPwm(pwm);
 
-  /* Line 1: speed */
-  lcd.setCursor(0, 0);
-  lcd.print("SPD ");
+/* How far readMeasuredRpm() trails: age of the last edge plus half the
+   period it averages over */
+unsigned long readTachDelayUs() {
+  noInterrupts();
+  unsigned long periodUs = tachPeriodUs;
+  unsigned long lastUs = tachLastUs;
+  interrupts();
 
-  if (percent < 100) lcd.print(" ");
-  if (percent < 10)  lcd.print(" ");
-  lcd.print(percent);
-  lcd.print("% ");
+  return micros() - lastUs + periodUs / 2;
+}
 
-  /* RPM field */
-  if (rpmEst < 1000) lcd.print(" ");
-  if (rpmEst < 100)  lcd.print(" ");
-  if (rpmEst < 10)   lcd.print(" ");
-  lcd.print(rpmEst);
-  lcd.print("R");
+/* Start the head transaction (interrupts off) */
+void i2cStartHead(byte twcr) {
+  i2cPos = 0;
+  i2cReading = i2cQueue[i2cHead]->txLen == 0;
+  i2cXferStartMs = millis();
+  TWCR = twcr;
+}
 
-  /* Line 2: duration */
-  lcd.setCursor(0, 1);
-  if (!isRunning) {
-    lcd.print("T ");
-    lcd.print(durationSeconds);
-    lcd.print("s");
-    lcd.print("           ");
+/* Head transaction over: STOP, and START the next one if queued */
+void i2cFinish(byte state) {
+  i2cQueue[i2cHead]->state = state;
+  i2cHead = (i2cHead + 1) % I2C_QUEUE_N;
+  i2cCount--;
+  if (i2cCount) {
+    i2cStartHead(_BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTO) | _BV(TWSTA));
   } else {
-    lcd.print("RUN ");
-    lcd.print(remainingSec);
-    lcd.print("s left");
-    lcd.print("       ");
+    TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWSTO);
   }
 }
 
+/* One bus event of the head transaction */
+ISR(TWI_vect) {
+  I2cXfer *x = i2cQueue[i2cHead];
 
-void handleKeypad() {
-  /* Get key press (non-blocking) */
-  char key = keypad.getKey();
-  if (!key) return;
+  switch (TWSR & 0xF8) {
+    case 0x08:  /* START */
+    case 0x10:  /* repeated START */
+      TWDR = (byte)(x->addr << 1) | (i2cReading ? 1 : 0);
+      TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+      break;
 
-  /* While running: allow abort */
-  if (isRunning) {
-    /* D aborts */
-    if (key == 'D') {
-      stopJob();
+    case 0x18:  /* SLA+W ACKed */
+    case 0x28:  /* data byte ACKed */
+      if (i2cPos < x->txLen) {
+        TWDR = x->tx[i2cPos++];
+        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+      } else if (x->rxLen) {
+        /* Register address sent: read back after a repeated start */
+        i2cReading = true;
+        i2cPos = 0;
+        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);
+      } else {
+        i2cFinish(I2C_DONE);
+      }
+      break;
+
+    case 0x50:  /* byte received, ACK sent */
+      x->rx[i2cPos++] = TWDR;
+      /* fall through */
+    case 0x40:  /* SLA+R ACKed: ACK all but the last byte */
+      TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | (i2cPos + 1 < x->rxLen ? _BV(TWEA) : 0);
+      break;
+
+    case 0x58:  /* last byte received, NACK sent */
+      x->rx[i2cPos++] = TWDR;
+      i2cFinish(I2C_DONE);
+      break;
+
+    default:
+      /* Address or data NACKed, arbitration lost, bus error */
+      i2cErrors++;
+      i2cFinish(I2C_FAILED);
+      break;
+  }
+}
+
+void setupI2c() {
+  /* Internal pull-ups, on top of the modules' own */
+  digitalWrite(SDA, HIGH);
+  digitalWrite(SCL, HIGH);
+
+  /* Prescaler 1 */
+  TWSR = 0;
+  TWBR = (byte)((F_CPU / I2C_HZ - 16) / 2);
+  TWCR = _BV(TWEN);
+}
+
+/* Queue a transaction; false if the queue is full */
+bool i2cSubmit(I2cXfer *x) {
+  bool queued = false;
+
+  noInterrupts();
+  if (i2cCount < I2C_QUEUE_N) {
+    x->state = I2C_QUEUED;
+    i2cQueue[(i2cHead + i2cCount) % I2C_QUEUE_N] = x;
+    i2cCount++;
+    if (i2cCount == 1) {
+      /* Bus idle: let the last STOP finish, then START */
+      while (TWCR & _BV(TWSTO)) {}
+      i2cStartHead(_BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTA));
+    }
+    queued = true;
+  }
+  interrupts();
+
+  return queued;
+}
+
+/* Bus clear: a slave cut off in the middle of a read holds SDA low
+   until it has clocked out the rest of its byte, which resetting the
+   TWI does not do. With the TWI off, pulse SCL (up to 9 times) until
+   SDA is released, then send a STOP. The lines are only ever pulled
+   low or left to the pull-ups. About 100 us. */
+void i2cBusClear() {
+  pinMode(SDA, INPUT_PULLUP);
+  for (byte i = 0; i < 9 && digitalRead(SDA) == LOW; i++) {
+    digitalWrite(SCL, LOW);
+    pinMode(SCL, OUTPUT);
+    delayMicroseconds(5);
+    pinMode(SCL, INPUT_PULLUP);
+    delayMicroseconds(5);
+  }
+
+  /* STOP: SDA rises while SCL is high */
+  digitalWrite(SCL, LOW);
+  pinMode(SCL, OUTPUT);
+  digitalWrite(SDA, LOW);
+  pinMode(SDA, OUTPUT);
+  delayMicroseconds(5);
+  pinMode(SCL, INPUT_PULLUP);
+  delayMicroseconds(5);
+  pinMode(SDA, INPUT_PULLUP);
+  delayMicroseconds(5);
+}
+
+/* Bus hung (slave holding SDA, lost edge): fail everything queued, clear
+   the bus and restart the TWI (called from loop(); no interrupt
+   submits, so the clear can run with interrupts on) */
+void serviceI2c() {
+  bool hung = false;
+
+  noInterrupts();
+  if (i2cCount && millis() - i2cXferStartMs >= I2C_TIMEOUT_MS) {
+    TWCR = 0;
+    while (i2cCount) {
+      i2cQueue[i2cHead]->state = I2C_FAILED;
+      i2cHead = (i2cHead + 1) % I2C_QUEUE_N;
+      i2cCount--;
+    }
+    i2cErrors++;
+    hung = true;
+  }
+  interrupts();
+  if (!hung) return;
+
+  i2cBusClear();
+  TWCR = _BV(TWEN);
+}
+
+/* Transaction run to the end (setup() only) */
+bool i2cRun(I2cXfer *x) {
+  if (!i2cSubmit(x)) return false;
+  while (x->state == I2C_QUEUED) {
+    delayMicroseconds(100);
+    serviceI2c();
+  }
+  return x->state == I2C_DONE;
+}
+
+#if USE_LCD
+/* Byte as two 4-bit transfers, each latched on EN's falling edge */
+byte lcdPackByte(byte *out, byte value, byte rs) {
+  byte hi = (value & 0xF0) | rs | LCD_BACKLIGHT;
+  byte lo = (byte)(value << 4) | rs | LCD_BACKLIGHT;
+  out[0] = hi | LCD_EN;
+  out[1] = hi;
+  out[2] = lo | LCD_EN;
+  out[3] = lo;
+  return 4;
+}
+
+/* HD44780 into 4-bit mode, display on and cleared (setup() only) */
+void setupLcd() {
+  /* Reset by instruction: 8-bit mode three times, then 4-bit */
+  const byte resetNibbles[4] = { 0x30, 0x30, 0x30, 0x20 };
+  /* 2 lines 5x8, display on, cursor advances, clear */
+  const byte commands[4] = { 0x28, 0x0C, 0x06, 0x01 };
+
+  /* Power-up time of the controller */
+  delay(50);
+  for (byte i = 0; i < 4; i++) {
+    lcdTx[0] = resetNibbles[i] | LCD_BACKLIGHT | LCD_EN;
+    lcdTx[1] = resetNibbles[i] | LCD_BACKLIGHT;
+    lcdXfer.txLen = 2;
+    i2cRun(&lcdXfer);
+    delayMicroseconds(4500);
+  }
+  for (byte i = 0; i < 4; i++) {
+    lcdXfer.txLen = lcdPackByte(lcdTx, commands[i], 0);
+    i2cRun(&lcdXfer);
+    /* Clear takes 1.5 ms */
+    delay(2);
+  }
+
+  /* Frame matches the cleared display */
+  memset(lcd.text, ' ', sizeof(lcd.text));
+  lcd.dirty[0] = 0;
+  lcd.dirty[1] = 0;
+#if USE_LCD_MIRROR
+  /* The mirror's copy does not */
+  lcd.mirrorDirty[0] = LCD_ALL_COLS;
+  lcd.mirrorDirty[1] = LCD_ALL_COLS;
+#endif
+  lcdXfer.state = I2C_IDLE;
+}
+
+/* Next run of changed cells, once the last run is off the bus (called
+   from loop()) */
+void serviceLcd() {
+  if (lcdXfer.state == I2C_QUEUED) return;
+  /* Lost on the bus: send those cells again */
+  if (lcdXfer.state == I2C_FAILED) lcd.dirty[lcdSentRow] |= lcdSentMask;
+  lcdXfer.state = I2C_IDLE;
+
+  for (byte r = 0; r < LCD_ROWS; r++) {
+    uint16_t d = lcd.dirty[r];
+    if (!d) continue;
+
+    byte c = 0;
+    while (!(d & (1U << c))) c++;
+
+    /* Cursor address, then up to LCD_RUN_MAX adjacent changed cells */
+    byte len = lcdPackByte(lcdTx, 0x80 | (r ? 0x40 : 0x00) | c, 0);
+    lcdSentMask = 0;
+    for (byte n = 0; n < LCD_RUN_MAX && c < LCD_COLS && (d & (1U << c)); n++, c++) {
+      len += lcdPackByte(lcdTx + len, (byte)lcd.text[r][c], LCD_RS);
+      lcdSentMask |= 1U << c;
+    }
+    lcdSentRow = r;
+    lcdXfer.txLen = len;
+
+    if (i2cSubmit(&lcdXfer)) lcd.dirty[r] &= ~lcdSentMask;
+    return;
+  }
+}
+
+#if USE_LCD_MIRROR
+/* Next run of changed cells to the mirror */
+void serviceLcdMirror() {
+  unsigned long nowMs = millis();
+  if (nowMs - lcdMirrorRefreshMs >= LCD_MIRROR_REFRESH_MS) {
+    lcdMirrorRefreshMs = nowMs;
+    for (byte r = 0; r < LCD_ROWS; r++) lcd.mirrorDirty[r] = LCD_ALL_COLS;
+  }
+  if (Serial.availableForWrite() < LCD_MIRROR_LINE_MAX) return;
+
+  for (byte r = 0; r < LCD_ROWS; r++) {
+    uint16_t d = lcd.mirrorDirty[r];
+    if (!d) continue;
+
+    byte c = 0;
+    while (!(d & (1U << c))) c++;
+    Serial.write('L');
+    Serial.write('0' + r);
+    Serial.write(c < 10 ? '0' + c : 'A' + c - 10);
+    for (; c < LCD_COLS && (d & (1U << c)); c++) {
+      Serial.write(lcd.text[r][c]);
+      d &= ~(1U << c);
+    }
+    Serial.println();
+    lcd.mirrorDirty[r] = d;
+    return;
+  }
+}
+#endif
+
+/* Frame sent out before going on (setup() only) */
+void lcdFlush() {
+  unsigned long startMs = millis();
+  while ((lcd.dirty[0] || lcd.dirty[1] || lcdXfer.state == I2C_QUEUED) &&
+         millis() - startMs < 50UL) {
+    serviceLcd();
+    delayMicroseconds(100);
+    serviceI2c();
+  }
+}
+#endif
+
+/* Mark part of a persistent region for write-behind */
+void persistTouch(const void *field, byte len) {
+  const byte *p = (const byte *)field;
+
+  for (byte r = 0; r < PERSIST_REGION_COUNT; r++) {
+    PersistRegion &region = persistRegions[r];
+    if (p < region.ram || p >= region.ram + region.len) continue;
+
+    byte lo = (byte)(p - region.ram);
+    byte hi = lo + len;
+    if (region.dirtyLo == region.dirtyHi) {
+      region.dirtyLo = lo;
+      region.dirtyHi = hi;
+    } else {
+      if (lo < region.dirtyLo) region.dirtyLo = lo;
+      if (hi > region.dirtyHi) region.dirtyHi = hi;
+    }
+    return;
+  }
+}
+
+void loadPersist() {
+  EEPROM.get(PERSIST_ADDR, persist);
+
+  /* Version 1 had no boot count; the drift average carries over */
+  if (persist.magic == PERSIST_MAGIC && persist.version == 1) {
+    persist.version = PERSIST_VERSION;
+    persist.boots = 0;
+    persistTouch(&persist, sizeof(persist));
+  }
+
+  /* Blank or foreign EEPROM: start fresh */
+  if (persist.magic != PERSIST_MAGIC || persist.version != PERSIST_VERSION) {
+    memset(&persist, 0, sizeof(persist));
+    persist.magic = PERSIST_MAGIC;
+    persist.version = PERSIST_VERSION;
+    persistTouch(&persist, sizeof(persist));
+  }
+
+  /* This power-up; never the blank history marker */
+  persist.boots++;
+  if (persist.boots == HISTORY_BLANK) persist.boots = 0;
+  persistTouch(&persist.boots, sizeof(persist.boots));
+}
+
+/* Write at most one dirty byte, and only if EEPROM is idle */
+void servicePersist() {
+  if (!eeprom_is_ready()) return;
+
+  for (byte r = 0; r < PERSIST_REGION_COUNT; r++) {
+    PersistRegion &region = persistRegions[r];
+    if (region.dirtyLo == region.dirtyHi) continue;
+
+    byte offset = region.dirtyLo++;
+    byte value = region.ram[offset];
+    /* Skip unchanged bytes (saves wear, costs one read) */
+    if (EEPROM.read(region.addr + offset) != value) {
+      EEPROM.write(region.addr + offset, value);
+    }
+    return;
+  }
+}
+
+/* Anything still waiting to be written */
+bool persistPending() {
+  for (byte r = 0; r < PERSIST_REGION_COUNT; r++) {
+    if (persistRegions[r].dirtyLo != persistRegions[r].dirtyHi) return true;
+  }
+  return false;
+}
+
+void updateDriftWarn() {
+  int driftPermille = persist.driftQ4 / 16;
+  if (driftPermille < 0) driftPermille = -driftPermille;
+
+  driftWarn = persist.driftJobs >= DRIFT_WARN_MIN_JOBS &&
+              driftPermille >= DRIFT_WARN_PERMILLE;
+}
+
+void resetDriftJob() {
+  driftSumMeasured = 0;
+  driftSumPredicted = 0;
+  driftSamples = 0;
+  driftLastPwm = -1;
+}
+
+/* Called from loop() while running */
+void sampleDrift(int pwm) {
+  unsigned long nowMs = millis();
+
+  /* Restart the settle window whenever the speed is changed */
+  if (pwm != driftLastPwm) {
+    driftLastPwm = pwm;
+    driftSteadySinceMs = nowMs;
+    return;
+  }
+  if (nowMs - driftSteadySinceMs < DRIFT_SETTLE_MS) return;
+  if (nowMs - driftLastSampleMs < DRIFT_SAMPLE_MS) return;
+  driftLastSampleMs = nowMs;
+
+  int predicted = estimateRpmFromPwm(pwm);
+  if (predicted < DRIFT_MIN_RPM) return;
+
+  int measured = readMeasuredRpm();
+  driftSumMeasured += measured;
+  driftSumPredicted += predicted;
+  driftSamples++;
+
+  /* Tach error for the job's history record */
+  unsigned int err = (unsigned int)abs(measured - predicted);
+  jobErrSum += err;
+  if (err > jobErrMax) jobErrMax = err;
+  jobErrSamples++;
+}
+
+/* Fold the finished job into the persistent drift average */
+void finishDriftJob() {
+  if (driftSamples < DRIFT_MIN_SAMPLES || driftSumPredicted <= 0) return;
+
+  long devPermille = ((driftSumMeasured - driftSumPredicted) * 1000L) / driftSumPredicted;
+  devPermille = constrain(devPermille, -1000L, 1000L);
+
+  /* EWMA, weight 1/8, Q4 */
+  persist.driftQ4 += (int)(((devPermille * 16L) - persist.driftQ4) / 8L);
+  if (persist.driftJobs < 0xFFFF) persist.driftJobs++;
+  persistTouch(&persist.driftQ4, sizeof(persist.driftQ4) + sizeof(persist.driftJobs));
+
+  updateDriftWarn();
+  resetDriftJob();
+}
+
+/* Fresh spin-up: fan stopped, estimator running, default ramp limit */
+void resetInertiaJob() {
+  inertiaState = INERTIA_MEASURING;
+  inertiaStartMs = millis();
+  inertiaLastSampleMs = inertiaStartMs;
+  inertiaStartRpm = -1;
+  inertiaLagSum = 0;
+  inertiaDelaySum = 0;
+
+  rampRpmPerS = RAMP_DEFAULT_RPM_PER_S;
+  rampPwmQ12 = 0;
+  rampLastMs = inertiaStartMs;
+  rampCell = 0xFF;
+}
+
+/* Called from loop() while running, with the PWM going to the fan */
+void sampleInertia(int pwm) {
+  if (inertiaState != INERTIA_MEASURING) return;
+
+  unsigned long nowMs = millis();
+  if (nowMs - inertiaLastSampleMs < INERTIA_SAMPLE_MS) return;
+  inertiaLastSampleMs = nowMs;
+
+  int rpm = readMeasuredRpm();
+  bool windowOver = nowMs - inertiaStartMs >= INERTIA_WINDOW_MS;
+  if (inertiaStartRpm < 0) {
+    if (rpm >= INERTIA_START_RPM) {
+      inertiaStartRpm = rpm;
+      inertiaLastRpm = rpm;
+    } else if (windowOver) {
+      inertiaState = INERTIA_FAILED;
+    }
+    return;
+  }
+
+  inertiaLagSum += estimateRpmFromPwm(pwm) - rpm;
+  inertiaDelaySum += (long)(readTachDelayUs() / 100UL) * (rpm - inertiaLastRpm);
+  inertiaLastRpm = rpm;
+
+  int rise = rpm - inertiaStartRpm;
+  if (rise < INERTIA_RISE_RPM && !windowOver) return;
+
+  /* tau in ms; the lag sum is in RPM per sample */
+  long tauMs = 0;
+  if (rise >= INERTIA_MIN_RISE_RPM) {
+    tauMs = (inertiaLagSum * (long)INERTIA_SAMPLE_MS - inertiaDelaySum / 10L) / rise;
+  }
+  if (tauMs < (long)INERTIA_MIN_TAU_MS || tauMs > (long)INERTIA_MAX_TAU_MS) {
+    inertiaState = INERTIA_FAILED;
+    return;
+  }
+  inertiaState = INERTIA_DONE;
+  inertiaTauMs = (unsigned int)tauMs;
+
+  /* Ramp limit for the rest of the run */
+  long limit = (long)RAMP_LAG_RPM * 1000L / tauMs;
+  rampRpmPerS = (unsigned int)constrain(limit, (long)RAMP_MIN_RPM_PER_S, (long)RAMP_MAX_RPM_PER_S);
+  rampCell = 0xFF;
+}
+
+/* Slew the PWM output so the calibrated RPM moves at most rampRpmPerS */
+int rampLimit(int pwm) {
+  unsigned long nowMs = millis();
+  unsigned long dtMs = nowMs - rampLastMs;
+  rampLastMs = nowMs;
+
+  /* PWM step per ms for the current calibration cell, only on a change */
+  byte cell = (byte)((rampPwmQ12 >> 12) >> CAL_SHIFT);
+  if (cell >= CAL_N - 1) cell = CAL_N - 2;
+  if (cell != rampCell) {
+    rampCell = cell;
+    long rpmPerCell = (long)pgm_read_word(&rpmCal[cell + 1]) - (long)pgm_read_word(&rpmCal[cell]);
+    /* Flat part of the table: RPM does not follow, nothing to limit */
+    rampStepQ12 = rpmPerCell > 0
+                      ? ((long)rampRpmPerS << (12 + CAL_SHIFT)) / (rpmPerCell * 1000L)
+                      : 255L << 12;
+    if (rampStepQ12 < 1) rampStepQ12 = 1;
+  }
+
+  long targetQ12 = (long)pwm << 12;
+  long stepQ12 = rampStepQ12 * (long)min(dtMs, 1000UL);
+  if (targetQ12 > rampPwmQ12 + stepQ12) {
+    rampPwmQ12 += stepQ12;
+  } else if (targetQ12 < rampPwmQ12 - stepQ12) {
+    rampPwmQ12 -= stepQ12;
+  } else {
+    rampPwmQ12 = targetQ12;
+  }
+  return (int)((rampPwmQ12 + 2048L) >> 12);
+}
+
+void writeFanPwm(int pwm) {
+  /* Fan stays off after a power loss or a vacuum trip until loop() has
+     seen it */
+  if (powerState != POWER_OK || vacuumTripped) pwm = 0;
+
+  /* Write PWM to fan */
+  analogWrite(fanPwmPin, pwm);
+}
+
+/* Advance compare A by the next chunk (ISR or interrupts off) */
+void dispenseNextChunk() {
+  unsigned long chunk = dispenseTicksLeft;
+  /* Keep chunks short enough that the remainder is never tiny */
+  if (chunk > 255UL) chunk = 128UL;
+
+  dispenseTicksLeft -= chunk;
+  OCR2A = (byte)(OCR2A + (byte)chunk);
+}
+
+void dispenseValve(bool open) {
+  if (open) {
+    PORTB |= _BV(PB2);
+  } else {
+    PORTB &= ~_BV(PB2);
+  }
+}
+
+/* Load the next phase; called with the valve edge just done */
+void dispenseEnterPhase(byte phase, unsigned long ticks) {
+  dispensePhase = phase;
+  dispenseTicksLeft = ticks;
+
+  if (phase == DISPENSE_IDLE) {
+    TIMSK2 &= ~_BV(OCIE2A);
+    return;
+  }
+  dispenseNextChunk();
+}
+
+ISR(TIMER2_COMPA_vect) {
+  if (dispenseTicksLeft > 0) {
+    dispenseNextChunk();
+    return;
+  }
+
+  if (dispensePhase == DISPENSE_WAIT) {
+    dispenseValve(true);
+    dispenseEnterPhase(DISPENSE_OPEN, dispenseOpenTicks);
+  } else {
+    dispenseValve(false);
+    dispenseEnterPhase(DISPENSE_IDLE, 0);
+  }
+}
+
+void setupDispense() {
+  pinMode(dispensePin, OUTPUT);
+  dispenseValve(false);
+
+  /* Timer2: normal mode, clk/64, no outputs, compare interrupts on demand */
+  TCCR2A = 0;
+  TCCR2B = _BV(CS22);
+  TIMSK2 = 0;
+}
+
+/* Schedule the valve relative to now */
+void armDispense(unsigned long offsetUs, unsigned int openMs) {
+  unsigned long waitTicks = offsetUs / DISPENSE_US_PER_TICK;
+  unsigned long openTicks = ((unsigned long)openMs * 1000UL) / DISPENSE_US_PER_TICK;
+  if (openTicks < DISPENSE_MIN_TICKS) openTicks = DISPENSE_MIN_TICKS;
+
+  noInterrupts();
+  /* Start the compare chain from the current count */
+  OCR2A = TCNT2;
+  dispenseOpenTicks = openTicks;
+
+  if (waitTicks < DISPENSE_MIN_TICKS) {
+    dispenseValve(true);
+    dispenseEnterPhase(DISPENSE_OPEN, openTicks);
+  } else {
+    dispenseEnterPhase(DISPENSE_WAIT, waitTicks);
+  }
+
+  /* Drop any stale match, then enable */
+  TIFR2 = _BV(OCF2A);
+  TIMSK2 |= _BV(OCIE2A);
+  interrupts();
+}
+
+void cancelDispense() {
+  noInterrupts();
+  dispenseValve(false);
+  dispenseEnterPhase(DISPENSE_IDLE, 0);
+  interrupts();
+}
+
+/* Step length: ramp plus hold */
+unsigned long stepMs(byte step) {
+  return recipeData.steps[step].rampMs + (unsigned long)recipeData.steps[step].holdSec * 1000UL;
+}
+
+/* PWM a step's ramp starts from */
+int stepFromPwm(byte step) {
+  return step == 0 ? 0 : recipeData.steps[step - 1].pwm;
+}
+
+/* Image as host/recipeCompiler builds it: at least one step, slopes
+   that match their ramps (rounded to Q8 the same way) and dispense
+   offsets inside their step, so an upload that skipped the compiler is
+   not run as it is */
+bool recipeValid() {
+  if (recipeData.magic != RECIPE_MAGIC || recipeData.count == 0 || recipeData.count > RECIPE_MAX_STEPS) {
+    return false;
+  }
+  for (byte k = 0; k < recipeData.count; k++) {
+    const RecipeStep &s = recipeData.steps[k];
+    long dQ8 = (long)(s.pwm - stepFromPwm(k)) * 256L;
+    long rampMs = s.rampMs;
+    long slopeQ8 = rampMs == 0 ? 0 : (dQ8 + (dQ8 < 0 ? -rampMs : rampMs) / 2) / rampMs;
+    if (s.rampQ8 != slopeQ8) return false;
+    if (s.dispenseUs != DISPENSE_NONE && s.dispenseUs / 1000UL >= stepMs(k)) return false;
+  }
+  return true;
+}
+
+void loadRecipe() {
+  EEPROM.get(RECIPE_ADDR, recipeData);
+  if (!recipeValid()) recipeData.count = 0;
+}
+
+/* Step ramps straight into the next one's ramp */
+bool stepChained(byte step) {
+  if (step + 1 >= recipeData.count) return false;
+  return recipeData.steps[step].holdSec == 0 && recipeData.steps[step].rampMs > 0 &&
+         recipeData.steps[step + 1].rampMs > 0;
+}
+
+/* Integer square root, rounded down */
+unsigned int isqrt32(unsigned long v) {
+  unsigned long root = 0;
+  unsigned long bitv = 1UL << 30;
+
+  while (bitv > v) bitv >>= 2;
+  while (bitv) {
+    if (v >= root + bitv) {
+      v -= root + bitv;
+      root = (root >> 1) + bitv;
+    } else {
+      root >>= 1;
+    }
+    bitv >>= 2;
+  }
+  return (unsigned int)root;
+}
+
+/*
+  Corner blends (look-ahead one step)
+  - Each corner of the PWM path gets a parabolic blend: the slope changes
+    at a constant rate, jerkQ8, so the width is the slope change / jerkQ8.
+  - Next to a hold the blend sits entirely inside the ramp, so the hold
+    is at the exact PWM for its whole time. Such a blend costs the ramp
+    half its width, so the ramp is steepened to still end on time.
+  - Between two ramps with no hold the blend straddles the step boundary
+    and goes straight from one slope to the other, never through zero.
+    It costs neither ramp any time.
+  - Step boundaries, dispense offsets and the job length do not move.
+  A blend never takes more than half of a ramp; a ramp too short for
+  its blends (host/recipeCompiler warns) gets steeper ones. Widths are
+  even so the half widths the ramps are shifted by are exact.
+*/
+void planBlends() {
+  byte n = recipeData.count;
+  unsigned long jerk = recipeData.jerkQ8;
+
+  /* Ramps and their hold-side blends */
+  for (byte k = 0; k < n; k++) {
+    const RecipeStep &s = recipeData.steps[k];
+    StepBlend &b = stepBlend[k];
+
+    b.chainIn = k > 0 && stepChained(k - 1);
+    b.chainOut = stepChained(k);
+    b.inMs = 0;
+    b.outMs = 0;
+    b.slopeQ16 = 0;
+    if (s.rampMs == 0) continue;
+
+    int dPwm = s.pwm - stepFromPwm(k);
+    byte holdEnds = (b.chainIn ? 0 : 1) + (b.chainOut ? 0 : 1);
+    unsigned int widthMs = 0;
+
+    if (jerk > 0 && holdEnds > 0 && dPwm != 0) {
+      /* Width w with slope dPwm / (rampMs - holdEnds * w / 2) and
+         w = slope / jerk: holdEnds/2 w^2 - rampMs w + c = 0 */
+      unsigned long rampMs = s.rampMs;
+      unsigned long c = (unsigned long)abs(dPwm) * 256000UL / jerk;
+      unsigned long cTerm = 2UL * holdEnds * c;
+      unsigned long sq = rampMs * rampMs;
+      unsigned long root = cTerm < sq ? isqrt32(sq - cTerm) : 0;
+
+      /* Rounded up: the wider blend stays under the limit */
+      widthMs = (unsigned int)((rampMs - root + holdEnds - 1) / holdEnds);
+      widthMs = min((widthMs + 1) & ~1U, (s.rampMs / 2) & ~1U);
+    }
+    if (!b.chainIn) b.inMs = widthMs;
+    if (!b.chainOut) b.outMs = widthMs;
+
+    long spanMs = (long)s.rampMs - (long)(b.inMs / 2) - (long)(b.outMs / 2);
+    long dQ16 = (long)dPwm * 65536L;
+    b.slopeQ16 = (dQ16 + (dQ16 < 0 ? -spanMs : spanMs) / 2) / spanMs;
+  }
+
+  /* Blends between chained ramps, from the final slopes */
+  for (byte k = 0; k + 1 < n; k++) {
+    if (!stepBlend[k].chainOut || jerk == 0) continue;
+
+    long dQ16 = labs(stepBlend[k + 1].slopeQ16 - stepBlend[k].slopeQ16);
+    unsigned long widthMs = (((unsigned long)(dQ16 + 255L) >> 8) * 1000UL + jerk - 1) / jerk;
+    unsigned int limitMs = min(recipeData.steps[k].rampMs, recipeData.steps[k + 1].rampMs);
+    widthMs = min((widthMs + 1) & ~1UL, (unsigned long)(limitMs & ~1U));
+
+    stepBlend[k].outMs = (unsigned int)widthMs;
+    stepBlend[k + 1].inMs = (unsigned int)widthMs;
+  }
+}
+
+/* a * u^2 / w, rounded down (u <= w), without overflowing 32 bits */
+unsigned long mulSquareDiv(unsigned long a, unsigned int u, unsigned int w) {
+  a *= u;
+  return (a / w) * u + (a % w) * u / w;
+}
+
+/* ds * u^2 / (2 w): slope change in Q16, result in Q8 */
+long blendQ8(long dSlopeQ16, unsigned int u, unsigned int w) {
+  bool neg = dSlopeQ16 < 0;
+  unsigned long m = neg ? -dSlopeQ16 : dSlopeQ16;
+  unsigned long q = mulSquareDiv(m >> 8, u, w) + (mulSquareDiv(m & 0xFF, u, w) >> 8);
+
+  q >>= 1;
+  return neg ? -(long)q : (long)q;
+}
+
+/* Blend centred on a shared step boundary at knot, u from the blend start */
+long chainBlendQ8(int knot, long sInQ16, long sOutQ16, unsigned int u, unsigned int w) {
+  return (long)knot * 256L + ((sInQ16 * ((long)u - (long)(w / 2))) >> 8) +
+         blendQ8(sOutQ16 - sInQ16, u, w);
+}
+
+/* PWM of a step at ms into it (Q8) */
+long stepPwmQ8(byte step, unsigned long intoMs) {
+  const RecipeStep &s = recipeData.steps[step];
+  const StepBlend &b = stepBlend[step];
+  unsigned int rampMs = s.rampMs;
+
+  if (rampMs == 0 || (intoMs >= rampMs && !b.chainOut)) return (long)s.pwm * 256L;
+  if (intoMs > rampMs) intoMs = rampMs;
+
+  int fromPwm = stepFromPwm(step);
+  unsigned int t = (unsigned int)intoMs;
+
+  if (b.chainIn && t < b.inMs / 2) {
+    /* Second half of the blend out of the previous ramp */
+    return chainBlendQ8(fromPwm, stepBlend[step - 1].slopeQ16, b.slopeQ16, t + b.inMs / 2,
+                        b.inMs);
+  }
+  if (b.chainOut && t > rampMs - b.outMs / 2) {
+    /* First half of the blend into the next ramp */
+    return chainBlendQ8(s.pwm, b.slopeQ16, stepBlend[step + 1].slopeQ16,
+                        t - (rampMs - b.outMs / 2), b.outMs);
+  }
+  if (!b.chainIn && t < b.inMs) {
+    /* Speeding up out of a hold */
+    return (long)fromPwm * 256L + blendQ8(b.slopeQ16, t, b.inMs);
+  }
+  if (!b.chainOut && t > rampMs - b.outMs) {
+    /* Settling into the hold */
+    return (long)s.pwm * 256L - blendQ8(b.slopeQ16, rampMs - t, b.outMs);
+  }
+
+  /* Straight part; shifted by half of a blend that sits inside the ramp */
+  long startMs = b.chainIn ? 0 : b.inMs / 2;
+  return (long)fromPwm * 256L + ((b.slopeQ16 * ((long)t - startMs)) >> 8);
+}
+
+/* PWM of a step at ms into it */
+int stepPwm(byte step, unsigned long intoMs) {
+  return clampInt((int)((stepPwmQ8(step, intoMs) + 128L) >> 8), 0, 255);
+}
+
+/* Apply a recipe step; the dispense offset counts from here. loop()
+   writes the step's PWM as it is */
+void startStep(byte step) {
+  jobStep = step;
+
+  if (recipeData.steps[step].dispenseUs != DISPENSE_NONE) {
+    armDispense(recipeData.steps[step].dispenseUs, recipeData.steps[step].dispenseMs);
+  }
+}
+
+/* Step sequencing on the job clock (called from loop() while running) */
+void serviceRecipe() {
+  if (!recipeMode) return;
+
+  unsigned long lengthMs = stepMs(jobStep);
+  if (millis() - stepStartMs < lengthMs) return;
+  if (jobStep + 1 >= recipeData.count) return;
+
+  /* Next step starts when this one was due to end */
+  stepStartMs += lengthMs;
+  startStep(jobStep + 1);
+}
+
+/* Set up segment i from the current PWM */
+void trajLoadSegment(byte i) {
+  TrajPoint pt;
+  memcpy_P(&pt, &trajectory[i], sizeof(pt));
+
+  trajIndex = i;
+  trajDt = pt.ms > 0 ? pt.ms : 1;
+  trajTicksLeft = trajDt;
+  trajUp = pt.pwm >= trajPwm;
+
+  byte dy = trajUp ? pt.pwm - trajPwm : trajPwm - pt.pwm;
+  trajStepQ = dy / trajDt;
+  trajStepR = dy % trajDt;
+  trajErr = 0;
+}
+
+void trajStart() {
+  trajPwm = 0;
+  trajTickMs = millis();
+  trajLoadSegment(0);
+}
+
+/* One control tick: O(1), adds and compares only */
+void trajTick() {
+  if (trajTicksLeft == 0) {
+    /* Last breakpoint holds */
+    if (trajIndex + 1 >= TRAJ_N) return;
+    trajLoadSegment(trajIndex + 1);
+  }
+
+  byte step = trajStepQ;
+  trajErr += trajStepR;
+  if (trajErr >= trajDt) {
+    trajErr -= trajDt;
+    step++;
+  }
+  trajPwm = trajUp ? trajPwm + step : trajPwm - step;
+  trajTicksLeft--;
+}
+
+/* Catch up on the ticks since the last call (called from loop()) */
+void serviceTrajectory() {
+  if (!trajMode) return;
+
+  while (millis() != trajTickMs) {
+    trajTickMs++;
+    trajTick();
+  }
+}
+
+unsigned long trajLengthMs() {
+  unsigned long totalMs = 0;
+  for (byte i = 0; i < TRAJ_N; i++) {
+    totalMs += pgm_read_word(&trajectory[i].ms);
+  }
+  return totalMs;
+}
+
+/* PWM the job wants right now */
+int jobPwm(int potPwm) {
+  if (recipeMode) return stepPwm(jobStep, millis() - stepStartMs);
+  if (trajMode) return trajPwm;
+  return potPwm;
+}
+
+void clearDuration() {
+  /* Reset entered duration */
+  durationSeconds = 0;
+}
+
+#if USE_SD_LOG
+/* Block device
+   AVR: SD card in SPI mode. Host: a disk image file with no busy time.
+   Reads stream bytes so no 512-byte buffer is needed.
+*/
+#if defined(__AVR__)
+/* SDHC/SDXC address blocks, SDSC addresses bytes */
+bool sdBlockAddressing = false;
+
+byte sdSpi(byte b) {
+  return SPI.transfer(b);
+}
+
+bool sdWaitReady(unsigned long timeoutMs) {
+  unsigned long startMs = millis();
+  while (sdSpi(0xFF) != 0xFF) {
+    if (millis() - startMs > timeoutMs) return false;
+  }
+  return true;
+}
+
+byte sdCommand(byte cmd, unsigned long arg) {
+  sdWaitReady(300);
+
+  sdSpi(0x40 | cmd);
+  sdSpi((byte)(arg >> 24));
+  sdSpi((byte)(arg >> 16));
+  sdSpi((byte)(arg >> 8));
+  sdSpi((byte)arg);
+  /* Only CMD0 and CMD8 need a real CRC */
+  sdSpi(cmd == 0 ? 0x95 : (cmd == 8 ? 0x87 : 0x01));
+
+  byte r = 0xFF;
+  for (byte i = 0; i < 10 && (r & 0x80); i++) r = sdSpi(0xFF);
+  return r;
+}
+
+bool sdCardInit() {
+  pinMode(sdCsPin, OUTPUT);
+  digitalWrite(sdCsPin, HIGH);
+  SPI.begin();
+
+  /* Wake-up clocks with CS high, at <= 400 kHz */
+  SPI.beginTransaction(SPISettings(250000, MSBFIRST, SPI_MODE0));
+  for (byte i = 0; i < 10; i++) sdSpi(0xFF);
+  digitalWrite(sdCsPin, LOW);
+
+  bool ok = sdCommand(0, 0) == 0x01;
+  bool v2 = false;
+  if (ok) {
+    /* CMD8 answers only on v2 cards */
+    if (sdCommand(8, 0x1AAUL) == 0x01) {
+      v2 = true;
+      for (byte i = 0; i < 4; i++) sdSpi(0xFF);
+    }
+
+    /* ACMD41 until the card leaves idle */
+    unsigned long startMs = millis();
+    do {
+      sdCommand(55, 0);
+      if (sdCommand(41, v2 ? 0x40000000UL : 0) == 0) break;
+    } while (millis() - startMs < 1000UL);
+    ok = millis() - startMs < 1000UL;
+  }
+
+  if (ok && v2 && sdCommand(58, 0) == 0) {
+    /* OCR: CCS bit set means block addressing */
+    sdBlockAddressing = (sdSpi(0xFF) & 0x40) != 0;
+    for (byte i = 0; i < 3; i++) sdSpi(0xFF);
+  }
+  if (ok && !sdBlockAddressing) ok = sdCommand(16, SD_BLOCK_SIZE) == 0;
+
+  digitalWrite(sdCsPin, HIGH);
+  sdSpi(0xFF);
+  SPI.endTransaction();
+  return ok;
+}
+
+unsigned long sdAddress(unsigned long lba) {
+  return sdBlockAddressing ? lba : lba * SD_BLOCK_SIZE;
+}
+
+void sdSelect() {
+  SPI.beginTransaction(SPISettings(8000000, MSBFIRST, SPI_MODE0));
+  digitalWrite(sdCsPin, LOW);
+}
+
+void sdDeselect() {
+  digitalWrite(sdCsPin, HIGH);
+  SPI.endTransaction();
+}
+
+bool sdReadStart(unsigned long lba) {
+  sdSelect();
+  if (sdCommand(17, sdAddress(lba)) != 0) {
+    sdDeselect();
+    return false;
+  }
+  /* Data token */
+  unsigned long startMs = millis();
+  byte token;
+  while ((token = sdSpi(0xFF)) == 0xFF) {
+    if (millis() - startMs > 300UL) break;
+  }
+  if (token != 0xFE) {
+    sdDeselect();
+    return false;
+  }
+  return true;
+}
+
+byte sdReadByte() {
+  return sdSpi(0xFF);
+}
+
+/* Called after exactly SD_BLOCK_SIZE sdReadByte() calls */
+void sdReadEnd() {
+  /* CRC */
+  sdSpi(0xFF);
+  sdSpi(0xFF);
+  sdDeselect();
+}
+
+/* CMD25 multi-block write. CS stays low from here to sdWriteEnd():
+   the card must not see it rise inside a block or between tokens, and
+   nothing else is on the SPI bus */
+bool sdWriteStart(unsigned long lba) {
+  sdSelect();
+  if (sdCommand(25, sdAddress(lba)) != 0) {
+    sdDeselect();
+    return false;
+  }
+  return true;
+}
+
+void sdWriteBlockStart() {
+  sdSpi(0xFC);
+}
+
+void sdWriteBytes(const byte *data, byte len) {
+  for (byte i = 0; i < len; i++) sdSpi(data[i]);
+}
+
+bool sdWriteBlockEnd() {
+  sdSpi(0xFF);
+  sdSpi(0xFF);
+  /* Data response: xxx00101 = accepted */
+  return (sdSpi(0xFF) & 0x1F) == 0x05;
+}
+
+/* Within the write, between blocks or after the stop token */
+bool sdIsBusy() {
+  return sdSpi(0xFF) != 0xFF;
+}
+
+void sdWriteStop() {
+  /* Stop-transmission token, then the card goes busy */
+  sdSpi(0xFD);
+  sdSpi(0xFF);
+}
+
+/* Once the card is no longer busy after sdWriteStop() */
+void sdWriteEnd() {
+  sdDeselect();
+}
+#else
+bool sdCardInit() {
+  sdImage = fopen(SD_IMAGE_PATH, "r+b");
+  return sdImage != NULL;
+}
+
+bool sdReadStart(unsigned long lba) {
+  return fseek(sdImage, (long)(lba * SD_BLOCK_SIZE), SEEK_SET) == 0;
+}
+
+byte sdReadByte() {
+  int c = fgetc(sdImage);
+  return c == EOF ? 0 : (byte)c;
+}
+
+void sdReadEnd() {
+}
+
+bool sdWriteStart(unsigned long lba) {
+  sdImagePos = (long)(lba * SD_BLOCK_SIZE);
+  return true;
+}
+
+void sdWriteBlockStart() {
+}
+
+void sdWriteBytes(const byte *data, byte len) {
+  fseek(sdImage, sdImagePos, SEEK_SET);
+  fwrite(data, 1, len, sdImage);
+  sdImagePos += len;
+}
+
+bool sdWriteBlockEnd() {
+  return true;
+}
+
+bool sdIsBusy() {
+  return false;
+}
+
+void sdWriteStop() {
+  fflush(sdImage);
+}
+
+void sdWriteEnd() {
+}
+#endif
+
+/* Read len bytes at offset of a block */
+bool sdReadBytes(unsigned long lba, unsigned int offset, byte *dst, unsigned int len) {
+  if (!sdReadStart(lba)) return false;
+  for (unsigned int i = 0; i < SD_BLOCK_SIZE; i++) {
+    byte b = sdReadByte();
+    if (i >= offset && i < offset + len) dst[i - offset] = b;
+  }
+  sdReadEnd();
+  return true;
+}
+
+unsigned int sdGet16(const byte *p) {
+  return (unsigned int)p[0] | ((unsigned int)p[1] << 8);
+}
+
+unsigned long sdGet32(const byte *p) {
+  return (unsigned long)sdGet16(p) | ((unsigned long)sdGet16(p + 2) << 16);
+}
+
+/* Locate SPINLOG.BIN; it must be contiguous to be used */
+bool sdFindLogFile() {
+  byte b[48];
+
+  /* MBR or bare volume */
+  unsigned long volLba = 0;
+  if (!sdReadBytes(0, 0, b, 1)) return false;
+  if (b[0] != 0xEB && b[0] != 0xE9) {
+    if (!sdReadBytes(0, 0x1C6, b, 4)) return false;
+    volLba = sdGet32(b);
+  }
+
+  /* Boot sector */
+  if (!sdReadBytes(volLba, 0, b, sizeof(b))) return false;
+  if (sdGet16(b + 0x0B) != SD_BLOCK_SIZE) return false;
+  byte secPerCluster = b[0x0D];
+  unsigned int reserved = sdGet16(b + 0x0E);
+  byte fatCount = b[0x10];
+  unsigned int rootEntries = sdGet16(b + 0x11);
+  unsigned long fatSize = sdGet16(b + 0x16);
+  bool fat32 = fatSize == 0;
+  if (fat32) fatSize = sdGet32(b + 0x24);
+  unsigned long rootCluster = sdGet32(b + 0x2C);
+  if (secPerCluster == 0) return false;
+
+  unsigned long fatLba = volLba + reserved;
+  unsigned long rootLba = fatLba + fatCount * fatSize;
+  unsigned long rootBlocks = ((unsigned long)rootEntries * 32UL + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE;
+  unsigned long dataLba = rootLba + rootBlocks;
+
+  /* FAT32 root is a cluster chain; only its first cluster is searched */
+  if (fat32) {
+    rootLba = dataLba + (rootCluster - 2) * secPerCluster;
+    rootBlocks = secPerCluster;
+  }
+
+  /* Directory entries, streamed 32 bytes at a time */
+  unsigned long firstCluster = 0;
+  unsigned long fileSize = 0;
+  for (unsigned long blk = 0; blk < rootBlocks && firstCluster == 0; blk++) {
+    if (!sdReadStart(rootLba + blk)) return false;
+    for (byte e = 0; e < SD_BLOCK_SIZE / 32; e++) {
+      for (byte i = 0; i < 32; i++) b[i] = sdReadByte();
+      if (firstCluster == 0 && memcmp(b, SD_LOG_NAME, 11) == 0) {
+        firstCluster = sdGet16(b + 0x1A) | ((unsigned long)sdGet16(b + 0x14) << 16);
+        fileSize = sdGet32(b + 0x1C);
+      }
+    }
+    sdReadEnd();
+  }
+  if (firstCluster < 2 || fileSize < SD_BLOCK_SIZE) return false;
+
+  /* Every cluster must link to the next one */
+  unsigned long clusterBytes = (unsigned long)secPerCluster * SD_BLOCK_SIZE;
+  unsigned long clusters = (fileSize + clusterBytes - 1) / clusterBytes;
+  byte entrySize = fat32 ? 4 : 2;
+  unsigned long pos = firstCluster * entrySize;
+  unsigned long fatBlock = 0xFFFFFFFFUL;
+
+  for (unsigned long c = 0; c < clusters; c++, pos += entrySize) {
+    if (pos / SD_BLOCK_SIZE != fatBlock) {
+      fatBlock = pos / SD_BLOCK_SIZE;
+      if (!sdReadStart(fatLba + fatBlock)) return false;
+      /* Skip to the entry */
+      for (unsigned int i = 0; i < pos % SD_BLOCK_SIZE; i++) sdReadByte();
+    }
+    for (byte i = 0; i < entrySize; i++) b[i] = sdReadByte();
+
+    unsigned long next = fat32 ? (sdGet32(b) & 0x0FFFFFFFUL) : sdGet16(b);
+    bool last = c + 1 == clusters;
+    bool linked = last ? next >= (fat32 ? 0x0FFFFFF8UL : 0xFFF8UL) : next == firstCluster + c + 1;
+
+    /* Finish the block before moving on or giving up: the card sends
+       all of it and the CRC */
+    if (!linked || (pos + entrySize) % SD_BLOCK_SIZE == 0 || last) {
+      unsigned int rest = SD_BLOCK_SIZE - (unsigned int)((pos + entrySize) % SD_BLOCK_SIZE);
+      if (rest != SD_BLOCK_SIZE) {
+        for (unsigned int i = 0; i < rest; i++) sdReadByte();
+      }
+      sdReadEnd();
+      fatBlock = 0xFFFFFFFFUL;
+    }
+    if (!linked) return false;
+  }
+
+  sdFileLba = dataLba + (firstCluster - 2) * secPerCluster;
+  sdFileBlocks = fileSize / SD_BLOCK_SIZE;
+  return true;
+}
+
+/* First empty block: blocks are filled in order, empty ones start with 0 */
+unsigned long sdFindLogEnd() {
+  unsigned long lo = 0;
+  unsigned long hi = sdFileBlocks;
+  byte first;
+
+  while (lo < hi) {
+    unsigned long mid = lo + (hi - lo) / 2;
+    if (!sdReadBytes(sdFileLba + mid, 0, &first, 1)) return sdFileBlocks;
+    if (first == SD_REC_EMPTY) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+void setupSdLog() {
+  sdState = SD_OFF;
+  if (!sdCardInit() || !sdFindLogFile()) return;
+
+  sdNextBlock = sdFindLogEnd();
+  sdState = SD_IDLE;
+}
+
+/* Queue one record; dropped if both buffers are taken */
+void sdLogRecord(byte type, byte pwm, unsigned int rpm, unsigned long timeMs) {
+  if (sdState <= SD_IDLE || sdFlushing) return;
+  if (sdFillLen + sizeof(SdRecord) > SD_BUF_SIZE) {
+    sdDropped++;
+    return;
+  }
+
+  SdRecord rec;
+  rec.type = type;
+  rec.pwm = pwm;
+  rec.rpm = rpm;
+  rec.timeMs = timeMs;
+  memcpy(&sdBuf[sdFill][sdFillLen], &rec, sizeof(rec));
+  sdFillLen += sizeof(rec);
+}
+
+/* Open the next block; the card must be ready */
+void sdOpenBlock() {
+  sdWriteBlockStart();
+  sdBlockPos = 0;
+  sdState = SD_BLOCK;
+}
+
+void sdLogJobStart(unsigned long durationSec) {
+  if (sdState != SD_IDLE || sdNextBlock >= sdFileBlocks) return;
+  if (!sdWriteStart(sdFileLba + sdNextBlock)) return;
+
+  sdFill = 0;
+  sdFillLen = 0;
+  sdDrainLen = 0;
+  sdDrainPos = 0;
+  sdFlushing = false;
+  sdLastSampleMs = millis();
+  sdOpenBlock();
+  sdLogRecord(SD_REC_JOB_START, recipeMode ? 1 : 0, 0, durationSec);
+}
+
+void sdLogJobEnd(unsigned long elapsedMs, byte reason) {
+  if (sdState <= SD_IDLE) return;
+  sdLogRecord(SD_REC_JOB_END, reason, 0, elapsedMs);
+  /* Pad out the block once the buffers are drained */
+  sdFlushing = true;
+}
+
+/* Streams buffered records to the card; called every loop() pass */
+void serviceSdLog() {
+  if (sdState <= SD_IDLE) return;
+
+  if (sdState == SD_STOPPING) {
+    if (!sdIsBusy()) {
+      sdWriteEnd();
+      sdState = SD_IDLE;
+    }
+    return;
+  }
+
+  if (sdState == SD_BUSY) {
+    /* Card programming the last block */
+    if (sdIsBusy()) return;
+
+    if (sdNextBlock >= sdFileBlocks || (sdFlushing && sdDrainPos == sdDrainLen && sdFillLen == 0)) {
+      sdWriteStop();
+      sdFlushing = false;
+      sdState = SD_STOPPING;
+      return;
+    }
+    sdOpenBlock();
+  }
+
+  /* Swap buffers once the drain side is empty */
+  if (sdDrainPos == sdDrainLen && sdFillLen > 0 &&
+      (sdFillLen == SD_BUF_SIZE || sdFlushing)) {
+    sdDrainLen = sdFillLen;
+    sdDrainPos = 0;
+    sdFill ^= 1;
+    sdFillLen = 0;
+  }
+
+  /* Bytes allowed this pass, never past the end of the block */
+  byte n = SD_BYTES_PER_PASS;
+  if (SD_BLOCK_SIZE - sdBlockPos < n) n = (byte)(SD_BLOCK_SIZE - sdBlockPos);
+
+  if (sdDrainPos < sdDrainLen) {
+    if (sdDrainLen - sdDrainPos < n) n = sdDrainLen - sdDrainPos;
+    sdWriteBytes(sdBuf[sdFill ^ 1] + sdDrainPos, n);
+    sdDrainPos += n;
+    sdBlockPos += n;
+  } else if (sdFlushing && sdFillLen == 0 && sdBlockPos > 0) {
+    /* Job over: zero-pad the rest of the block */
+    static const byte zeros[SD_BYTES_PER_PASS] = {0};
+    sdWriteBytes(zeros, n);
+    sdBlockPos += n;
+  }
+
+  if (sdBlockPos >= SD_BLOCK_SIZE) {
+    sdWriteBlockEnd();
+    sdNextBlock++;
+    sdState = SD_BUSY;
+  }
+}
+
+/* Sample at SD_SAMPLE_MS while running */
+void sdLogSample(int pwm, int rpm) {
+  unsigned long nowMs = millis();
+  if (nowMs - sdLastSampleMs < SD_SAMPLE_MS) return;
+  sdLastSampleMs = nowMs;
+
+  sdLogRecord(SD_REC_SAMPLE, (byte)pwm, (unsigned int)rpm, nowMs - jobStartMs);
+}
+#endif
+
+/* Register write (value), or read of rxLen bytes from reg, into mpuXfer */
+void mpuPrepare(byte reg, byte value, byte rxLen) {
+  mpuTx[0] = reg;
+  mpuTx[1] = value;
+  mpuXfer.txLen = rxLen ? 1 : 2;
+  mpuXfer.rxLen = rxLen;
+}
+
+/* Wake the MPU6050 and stream the accelerometer into its FIFO; stays
+   off if it does not answer */
+void setupVibration() {
+  /* Awake, clocked from the X gyro */
+  mpuPrepare(MPU_PWR_MGMT_1, 0x01, 0);
+  if (!i2cRun(&mpuXfer)) return;
+
+  /* 94 Hz low-pass, so a 1 kHz base rate; / 4 = 250 Hz */
+  mpuPrepare(MPU_CONFIG, 0x02, 0);
+  i2cRun(&mpuXfer);
+  mpuPrepare(MPU_SMPLRT_DIV, 3, 0);
+  i2cRun(&mpuXfer);
+  /* +-2 g */
+  mpuPrepare(MPU_ACCEL_CONFIG, 0x00, 0);
+  i2cRun(&mpuXfer);
+  /* Accelerometer only into the FIFO */
+  mpuPrepare(MPU_FIFO_EN, 0x08, 0);
+  i2cRun(&mpuXfer);
+  mpuPrepare(MPU_USER_CTRL, MPU_FIFO_ON_RESET, 0);
+  if (!i2cRun(&mpuXfer)) return;
+
+  mpuState = MPU_WAIT;
+  mpuLastPollMs = millis();
+}
+
+/* One FIFO sample (big-endian X, Y, Z): gravity off, mean square in */
+void vibSample(const byte *p) {
+  long sq = 0;
+  for (byte i = 0; i < 3; i++) {
+    long q4 = (long)(int16_t)((p[2 * i] << 8) | p[2 * i + 1]) << 4;
+    if (!mpuOffsetSet) mpuOffsetQ4[i] = q4;
+    mpuOffsetQ4[i] += (q4 - mpuOffsetQ4[i]) >> 8;
+
+    /* 1000 / 16384 mg per count */
+    long mg = ((q4 - mpuOffsetQ4[i]) * 125L) >> 15;
+    sq += mg * mg;
+  }
+  mpuOffsetSet = true;
+
+  vibMeanSq += (sq - vibMeanSq) >> 6;
+  if (isRunning) {
+    vibJobSumSq += (unsigned long)sq;
+    vibJobSamples++;
+  }
+}
+
+/* FIFO count, then a burst of whole samples (called from loop()) */
+void serviceVibration() {
+  if (mpuState == MPU_OFF || mpuXfer.state == I2C_QUEUED) return;
+  bool done = mpuXfer.state == I2C_DONE;
+  unsigned long nowMs = millis();
+
+  if (mpuState == MPU_WAIT) {
+    if (nowMs - mpuLastPollMs < MPU_POLL_MS) return;
+    mpuLastPollMs = nowMs;
+    mpuPrepare(MPU_FIFO_COUNTH, 0, 2);
+    if (i2cSubmit(&mpuXfer)) mpuState = MPU_COUNT;
+  } else if (mpuState == MPU_COUNT) {
+    mpuState = MPU_WAIT;
+    if (!done) return;
+
+    unsigned int count = ((unsigned int)mpuRx[0] << 8) | mpuRx[1];
+    if (count >= MPU_FIFO_BYTES) {
+      /* Overflowed, and out of step with the sample boundaries */
+      mpuOverflows++;
+      mpuPrepare(MPU_USER_CTRL, MPU_FIFO_ON_RESET, 0);
+      if (i2cSubmit(&mpuXfer)) mpuState = MPU_RESET;
+      return;
+    }
+
+    unsigned int samples = count / MPU_SAMPLE_BYTES;
+    if (samples == 0) return;
+    mpuMore = samples > MPU_BURST_SAMPLES;
+    mpuBurstSamples = mpuMore ? MPU_BURST_SAMPLES : (byte)samples;
+    mpuPrepare(MPU_FIFO_R_W, 0, mpuBurstSamples * MPU_SAMPLE_BYTES);
+    if (i2cSubmit(&mpuXfer)) mpuState = MPU_BURST;
+  } else if (mpuState == MPU_BURST) {
+    if (!done) {
+      /* Part of a sample may have been read: start the FIFO over */
+      mpuPrepare(MPU_USER_CTRL, MPU_FIFO_ON_RESET, 0);
+      mpuState = i2cSubmit(&mpuXfer) ? MPU_RESET : MPU_WAIT;
+      return;
+    }
+
+    for (byte i = 0; i < mpuBurstSamples; i++) {
+      vibSample(mpuRx + i * MPU_SAMPLE_BYTES);
+    }
+    vibLiveMg = isqrt32((unsigned long)vibMeanSq);
+
+    /* Behind: read the count again straight away */
+    mpuState = MPU_WAIT;
+    if (mpuMore) {
+      mpuPrepare(MPU_FIFO_COUNTH, 0, 2);
+      if (i2cSubmit(&mpuXfer)) mpuState = MPU_COUNT;
+    }
+  } else {
+    /* FIFO reset written */
+    mpuState = MPU_WAIT;
+  }
+}
+
+void armDip() {
+  unsigned long nowMs = millis();
+
+  dipTimedOut = false;
+  dipArmMs = nowMs;
+  dipLastSampleMs = nowMs;
+  dipSteadySinceMs = nowMs;
+  dipRpmQ4 = 0;
+  dipAccelQ4 = 0;
+}
+
+/* Countdown starts now (dip seen or '#' pressed) */
+void startCountdown() {
+  dipWaiting = false;
+  dipTimedOut = false;
+
+  /* Restart the job clock */
+  unsigned long nowMs = millis();
+  jobStartMs = nowMs;
+
+  /* A recipe is already past the first ramp: its hold counts from here,
+     and the job clock starts where the step did */
+  if (recipeMode) {
+    unsigned long intoMs = min(nowMs - stepStartMs, (unsigned long)recipeData.steps[0].rampMs);
+    stepStartMs = nowMs - intoMs;
+    jobStartMs = stepStartMs;
+  }
+}
+
+/* Called from loop() while waiting for the dip */
+void serviceDip() {
+  if (dipTimedOut) return;
+
+  unsigned long nowMs = millis();
+  if (nowMs - dipLastSampleMs < DIP_SAMPLE_MS) return;
+  dipLastSampleMs = nowMs;
+
+  /* RPM low-pass, weight 1/4 */
+  long rpmQ4 = (long)readMeasuredRpm() << 4;
+  long prevQ4 = dipRpmQ4;
+  dipRpmQ4 += (rpmQ4 - dipRpmQ4) >> 2;
+
+  /* Acceleration in RPM/s (Q4), low-pass weight 1/2 */
+  long accelQ4 = (dipRpmQ4 - prevQ4) * (long)(1000UL / DIP_SAMPLE_MS);
+  dipAccelQ4 += (accelQ4 - dipAccelQ4) >> 1;
+
+  long accel = dipAccelQ4 >> 4;
+  long accelAbs = accel < 0 ? -accel : accel;
+
+  if (nowMs - dipSteadySinceMs >= DIP_STEADY_MS && accel <= -DIP_RPM_PER_S) {
+    startCountdown();
+    return;
+  }
+  if (accelAbs > DIP_STEADY_RPM_PER_S) dipSteadySinceMs = nowMs;
+
+  if (nowMs - dipArmMs >= DIP_TIMEOUT_MS) {
+    /* Give up; the operator starts it with '#' */
+    dipTimedOut = true;
+  }
+}
+
+/* Job record for the checkpoint, written behind; no commit until a
+   power loss */
+void checkpointStart() {
+  resume.mode = recipeMode ? JOB_RECIPE : (trajMode ? JOB_TRAJ : JOB_MANUAL);
+  resume.recipeId = recipeData.id;
+  resume.step = 0;
+  resume.durationSec = jobDurationSeconds;
+  resume.remainingMs = jobDurationSeconds * 1000UL;
+  resume.commit = RESUME_NONE;
+  persistTouch(&resume, sizeof(resume));
+  resumeOffered = false;
+}
+
+/* Whole seconds since power-up, from millis() */
+void serviceUptime() {
+  unsigned long nowMs = millis();
+  while (nowMs - uptimeMarkMs >= 1000UL) {
+    uptimeMarkMs += 1000UL;
+    uptimeSec++;
+  }
+}
+
+/* a was started before b */
+bool historyOlder(const HistoryRecord &a, const HistoryRecord &b) {
+  int16_t boots = (int16_t)(a.boot - b.boot);
+  return boots < 0 || (boots == 0 && a.startSec < b.startSec);
+}
+
+/* Count the records and find the slot after the newest */
+void loadHistory() {
+  HistoryRecord newest = {};
+  for (byte slot = 0; slot < HISTORY_SLOTS; slot++) {
+    HistoryRecord r;
+    EEPROM.get(HISTORY_ADDR + slot * (int)sizeof(HistoryRecord), r);
+    if (r.boot == HISTORY_BLANK) continue;
+
+    if (historyCount == 0 || !historyOlder(r, newest)) {
+      newest = r;
+      historyNext = (slot + 1) % HISTORY_SLOTS;
+    }
+    historyCount++;
+  }
+}
+
+/* Record i, 0 the oldest; false while the EEPROM is busy */
+bool historyRead(byte i, HistoryRecord &r) {
+  byte oldest = historyCount < HISTORY_SLOTS ? 0 : historyNext;
+  byte slot = (oldest + i) % HISTORY_SLOTS;
+  if (slot == historySlot) {
+    r = historyRec;
+    return true;
+  }
+  if (!eeprom_is_ready()) return false;
+  EEPROM.get(HISTORY_ADDR + slot * (int)sizeof(HistoryRecord), r);
+  return true;
+}
+
+/* Open the starting job's record in the next slot */
+void historyStart() {
+  jobErrSum = 0;
+  jobErrMax = 0;
+  jobErrSamples = 0;
+
+  /* Last record not written out yet (a job of a few ms): skip this one */
+  PersistRegion &region = persistRegions[HISTORY_REGION];
+  historyOpen = region.dirtyLo == region.dirtyHi;
+  if (!historyOpen) {
+    historyDropped++;
+    return;
+  }
+
+  historySlot = historyNext;
+  historyNext = (historyNext + 1) % HISTORY_SLOTS;
+  if (historyCount < HISTORY_SLOTS) historyCount++;
+  region.addr = HISTORY_ADDR + historySlot * (int)sizeof(HistoryRecord);
+
+  byte mode = recipeMode ? JOB_RECIPE : (trajMode ? JOB_TRAJ : JOB_MANUAL);
+  historyRec.startSec = uptimeSec;
+  historyRec.runSec = HISTORY_RUN_OPEN;
+  historyRec.recipeId = recipeMode ? recipeData.id : 0;
+  historyRec.end = (byte)(mode << 4) | JOB_END_POWER;
+  historyRec.errMean = 0;
+  historyRec.errMax = 0;
+  historyRec.boot = persist.boots;
+  persistTouch(&historyRec, sizeof(historyRec));
+}
+
+/* Close it: time run, tach error, why it ended */
+void historyFinish(byte reason) {
+  if (!historyOpen) return;
+  historyOpen = false;
+
+  unsigned long runSec = (millis() - jobStartMs) / 1000UL;
+  unsigned long errMean = jobErrSamples ? jobErrSum / jobErrSamples : 0;
+  historyRec.runSec = (uint16_t)min(runSec, (unsigned long)HISTORY_RUN_OPEN - 1);
+  historyRec.end = (historyRec.end & 0xF0) | reason;
+  historyRec.errMean = (uint8_t)min(errMean >> HISTORY_ERR_SHIFT, 255UL);
+  historyRec.errMax = (uint8_t)min(jobErrMax >> HISTORY_ERR_SHIFT, 255U);
+  persistTouch(&historyRec.runSec, (byte)((byte *)&historyRec.boot - (byte *)&historyRec.runSec));
+}
+
+/* Newest complete copy of the counters; the next write goes after it */
+void loadProd() {
+  for (byte c = 0; c < PROD_COPIES; c++) {
+    ProdCounters p;
+    EEPROM.get(PROD_ADDR + c * (int)sizeof(ProdCounters), p);
+    if (p.jobsDone == 0xFFFFFFFFUL) continue;
+    if (p.jobsDone + p.jobsAborted >= prod.jobsDone + prod.jobsAborted) {
+      prod = p;
+      prodCopy = (c + 1) % PROD_COPIES;
+    }
+  }
+  prodMarkMs = millis();
+}
+
+/* Close the current stretch: whole seconds to add to its total, the
+   ms remainder kept for the next one */
+uint32_t prodAdd(unsigned int &restMs) {
+  unsigned long nowMs = millis();
+  unsigned long ms = nowMs - prodMarkMs + restMs;
+  prodMarkMs = nowMs;
+  restMs = (unsigned int)(ms % 1000UL);
+  return ms / 1000UL;
+}
+
+void prodStart() {
+  prod.idleSec += prodAdd(prodIdleMs);
+}
+
+void prodFinish(byte reason) {
+  prod.spinSec += prodAdd(prodSpinMs);
+  if (reason == JOB_END_DONE) {
+    prod.jobsDone++;
+    byte &rate = prodRate[prodRateBucket % PROD_RATE_BUCKETS];
+    if (rate < 255) rate++;
+  } else {
+    prod.jobsAborted++;
+  }
+
+  /* Into the next copy; the last one still being written (a job of a
+     few ms) is simply rewritten */
+  PersistRegion &region = persistRegions[PROD_REGION];
+  if (region.dirtyLo == region.dirtyHi) {
+    region.addr = PROD_ADDR + prodCopy * (int)sizeof(ProdCounters);
+    prodCopy = (prodCopy + 1) % PROD_COPIES;
+  }
+  persistTouch(&prod, sizeof(prod));
+}
+
+/* Rate buckets and the live figures */
+void serviceProd() {
+  unsigned long bucket = uptimeSec / PROD_RATE_BUCKET_SEC;
+  for (byte i = 0; prodRateBucket != bucket && i < PROD_RATE_BUCKETS; i++) {
+    prodRate[++prodRateBucket % PROD_RATE_BUCKETS] = 0;
+  }
+  prodRateBucket = bucket;
+
+  unsigned int perHour = 0;
+  for (byte i = 0; i < PROD_RATE_BUCKETS; i++) perHour += prodRate[i];
+  prodJobsPerHour = perHour;
+
+  unsigned long openSec = (millis() - prodMarkMs) / 1000UL;
+  unsigned long spin = prod.spinSec + (isRunning ? openSec : 0);
+  unsigned long total = spin + prod.idleSec + (isRunning ? 0 : openSec);
+  /* Halve both until spin * 1000 fits */
+  while (spin > 4000000UL) {
+    spin >>= 1;
+    total >>= 1;
+  }
+  prodUtilPermille = total ? (unsigned int)(spin * 1000UL / total) : 0;
+}
+
+/* Wafer held and motor cool enough to start */
+bool interlocksOk() {
+  return vacuumOk && !tempTripped;
+}
+
+void startJob() {
+  /* Never spin a wafer the chuck is not holding, or a hot motor */
+  if (!interlocksOk()) return;
+
+  if (recipeMode) {
+    /* Nothing stored */
+    if (recipeData.count == 0) return;
+
+    /* Job length is the sum of the steps, rounded up to whole seconds */
+    unsigned long totalMs = 0;
+    for (byte i = 0; i < recipeData.count; i++) {
+      totalMs += stepMs(i);
+    }
+    jobDurationSeconds = (totalMs + 999UL) / 1000UL;
+    if (jobDurationSeconds == 0) return;
+  } else if (trajMode) {
+    /* Job length is the trajectory length */
+    jobDurationSeconds = (trajLengthMs() + 999UL) / 1000UL;
+    if (jobDurationSeconds == 0) return;
+  } else {
+    /* Ignore if duration is zero */
+    if (durationSeconds == 0) return;
+
+    /* Latch duration */
+    jobDurationSeconds = durationSeconds;
+  }
+
+  /* Start timer */
+  jobStartMs = millis();
+  /* Set running; clears the last trips */
+  vacuumTripped = false;
+  tachLost = false;
+  tachQuietSinceMs = jobStartMs;
+  isRunning = true;
+
+  /* Countdown held until the dip (or a second '#'); a trajectory is
+     defined from t = 0, so it never waits */
+  dipWaiting = dipMode && !trajMode;
+  if (dipWaiting) armDip();
+
+  /* Fresh hold-phase accumulators */
+  resetDriftJob();
+  /* Spin-up estimate and ramp limit for this run */
+  resetInertiaJob();
+  /* Vibration over this run */
+  vibJobSumSq = 0;
+  vibJobSamples = 0;
+  /* Checkpoint record, in case the power goes */
+  checkpointStart();
+  /* History record, open until the job ends */
+  historyStart();
+  prodStart();
+
+#if USE_SD_LOG
+  sdLogJobStart(jobDurationSeconds);
+#endif
+
+  /* First recipe step */
+  if (recipeMode) {
+    planBlends();
+    stepStartMs = jobStartMs;
+    startStep(0);
+  }
+
+  /* Trajectory from its first breakpoint */
+  if (trajMode) trajStart();
+}
+
+void stopJob(byte reason) {
+  /* Hold-phase data counts for both completed and aborted jobs */
+  historyFinish(reason);
+  prodFinish(reason);
+  finishDriftJob();
+  if (vibJobSamples) vibJobRmsMg = isqrt32((unsigned long)(vibJobSumSq / vibJobSamples));
+
+#if USE_SD_LOG
+  sdLogJobEnd(millis() - jobStartMs, reason);
+#endif
+
+  /* Stop running */
+  isRunning = false;
+  /* Valve closed, pending dispense dropped */
+  cancelDispense();
+  /* Clear latched duration */
+  jobDurationSeconds = 0;
+}
+
+/* NTC sample, derating and trip (called from loop()) */
+void serviceTemperature() {
+  unsigned long nowMs = millis();
+  if (nowMs - tempLastSampleMs < TEMP_SAMPLE_MS) return;
+  tempLastSampleMs = nowMs;
+
+  /* Low-pass, weight 1/4 */
+  long rawQ4 = (long)readAdc(ADC_SLOT_NTC) << 4;
+  if (tempRawQ4 < 0) {
+    tempRawQ4 = rawQ4;
+  } else {
+    tempRawQ4 += (rawQ4 - tempRawQ4) >> 2;
+  }
+  unsigned int raw = (unsigned int)(tempRawQ4 >> 4);
+
+  tempFault = raw < NTC_SHORT_RAW || raw > NTC_OPEN_RAW;
+  tempDeciC = ntcToDeciC(raw);
+
+  /* Cap falls linearly across the derating band */
+  if (tempDeciC <= TEMP_DERATE_DC) {
+    tempMaxPwm = 255;
+  } else if (tempDeciC >= TEMP_TRIP_DC) {
+    tempMaxPwm = TEMP_DERATE_MIN_PWM;
+  } else {
+    tempMaxPwm = 255 - (int)((long)(255 - TEMP_DERATE_MIN_PWM) * (tempDeciC - TEMP_DERATE_DC) /
+                             (TEMP_TRIP_DC - TEMP_DERATE_DC));
+  }
+
+  if (tempFault || tempDeciC >= TEMP_TRIP_DC) {
+    tempTripped = true;
+  } else if (tempDeciC < TEMP_RESET_DC) {
+    tempTripped = false;
+  }
+  if (tempTripped && isRunning) stopJob(JOB_END_HOT);
+}
+
+#if defined(__AVR__)
+/* Runs from .init3: the stack pointer is set up, nothing is on it yet */
+void stackPaint() __attribute__((naked, used, section(".init3")));
+void stackPaint() {
+  for (byte *p = &__heap_start; p <= &__stack; p++) *p = STACK_PAINT;
+}
+#endif
+
+/* Next chunk of the scan for the deepest stack byte (called from
+   loop()) */
+void serviceStack() {
+  byte *p = stackScanPos;
+  byte *end = stackHigh - p > STACK_SCAN_CHUNK ? p + STACK_SCAN_CHUNK : stackHigh;
+  while (p < end && *p == STACK_PAINT) p++;
+
+  if (p == end && p < stackHigh) {
+    /* All paint so far */
+    stackScanPos = p;
+    return;
+  }
+  stackFree = (unsigned int)(p - stackLow);
+  stackScanPos = stackLow;
+}
+
+/* Time of the pass just ended (called first thing in loop()) */
+void serviceLoopTime() {
+  unsigned long nowUs = micros();
+  unsigned long us = nowUs - loopLastUs;
+  bool first = loopLastUs == 0;
+  loopLastUs = nowUs;
+  if (first) return;
+
+  if (us > 0xFFFFUL) us = 0xFFFFUL;
+  loopUsMeanQ4 = loopUsMeanQ4 - (loopUsMeanQ4 >> 4) + us;
+  loopUsMean = (unsigned int)(loopUsMeanQ4 >> 4);
+  if (us > loopUsMax) loopUsMax = (unsigned int)us;
+}
+
+/* Fan driven but no tach (called from loop() while running) */
+void superviseTach(int pwm) {
+  unsigned long nowMs = millis();
+  if (estimateRpmFromPwm(pwm) < TACH_LOSS_MIN_RPM || readMeasuredRpm() != 0) {
+    tachQuietSinceMs = nowMs;
+    return;
+  }
+  if (nowMs - tachQuietSinceMs < TACH_LOSS_MS) return;
+
+  tachLost = true;
+  stopJob(JOB_END_TACH);
+}
+
+unsigned long getRemainingSeconds() {
+  /* If not running, remaining is 0 */
+  if (!isRunning) return 0;
+  /* Countdown not started yet */
+  if (dipWaiting) return jobDurationSeconds;
+
+  /* Elapsed milliseconds */
+  unsigned long elapsedMs = millis() - jobStartMs;
+  /* Elapsed seconds */
+  unsigned long elapsedSec = elapsedMs / 1000UL;
+
+  /* If elapsed passed duration, remaining is 0 */
+  if (elapsedSec >= jobDurationSeconds) return 0;
+
+  return (jobDurationSeconds - elapsedSec);
+}
+
+/* Job time left in ms; all of it while the countdown waits */
+unsigned long remainingJobMs() {
+  unsigned long durationMs = jobDurationSeconds * 1000UL;
+  if (dipWaiting) return durationMs;
+
+  unsigned long elapsedMs = millis() - jobStartMs;
+  return elapsedMs < durationMs ? durationMs - elapsedMs : 0;
+}
+
+/* Power loss (from loop(), for the ADC interrupt): step and time left
+   of the running job, commit last. Unchanged bytes cost a read only. */
+void checkpointWrite() {
+  resume.step = jobStep;
+  resume.remainingMs = remainingJobMs();
+  resume.commit = RESUME_COMMIT;
+
+  const byte *p = (const byte *)&resume;
+  const byte commitAt = (byte)((const byte *)&resume.commit - p);
+  for (byte i = 0; i < commitAt; i++) {
+    EEPROM.update(RESUME_ADDR + i, p[i]);
+  }
+  EEPROM.update(RESUME_ADDR + commitAt, RESUME_COMMIT);
+  eeprom_busy_wait();
+
+  /* Latency from the first low reading to the commit in EEPROM; lost if
+     the hold-up runs out */
+  unsigned long writeUs = micros() - powerLowUs;
+  resume.writeUs = writeUs > 0xFFFFUL ? 0xFFFF : (uint16_t)writeUs;
+  EEPROM.put(RESUME_ADDR + commitAt + 1, resume.writeUs);
+}
+
+/* Called from the ADC interrupt: shed load now, checkpoint from loop().
+   The scan keeps running, to see whether the supply recovers */
+void powerLost() {
+  writeFanPwm(0);
+  dispenseValve(false);
+  dispenseEnterPhase(DISPENSE_IDLE, 0);
+  checkpointDue = true;
+}
+
+/* Bandgap reading of the last pass (ADC interrupt) */
+void superviseSupply(unsigned int raw) {
+  if (powerFailRaw == 0) return;
+
+  if (powerState == POWER_OK) {
+    if (raw < powerFailRaw) {
+      powerLowPasses = 0;
+      return;
+    }
+    if (powerLowPasses == 0) powerLowUs = micros();
+    if (++powerLowPasses < POWER_FAIL_PASSES) return;
+
+    powerState = POWER_LOST;
+    powerLost();
+  } else if (powerState == POWER_LOST && raw <= powerRecoverRaw) {
+    powerState = POWER_BACK;
+  }
+}
+
+/* Vacuum reading of the last pass (ADC interrupt) */
+void superviseVacuum(unsigned int raw) {
+  if (!vacuumOk) {
+    if (raw >= VACUUM_ON_RAW && raw < VACUUM_FAULT_RAW) vacuumOk = true;
+    return;
+  }
+  if (raw >= VACUUM_OFF_RAW && raw < VACUUM_FAULT_RAW) return;
+
+  vacuumOk = false;
+  if (!isRunning) return;
+
+  /* Wafer no longer held: fan and valve off now */
+  vacuumTripped = true;
+  writeFanPwm(0);
+  dispenseValve(false);
+  dispenseEnterPhase(DISPENSE_IDLE, 0);
+}
+
+ISR(ADC_vect) {
+  byte slot = adcSlot;
+  unsigned int raw = ADC;
+  adcRaw[slot] = raw;
+
+  /* Next channel, AVcc reference */
+  byte next = slot + 1 < ADC_SCAN_N ? slot + 1 : 0;
+  adcSlot = next;
+  ADMUX = _BV(REFS0) | adcScan[next];
+  ADCSRA |= _BV(ADSC);
+
+  if (slot == ADC_SLOT_VACUUM) {
+    superviseVacuum(raw);
+  } else if (slot == ADC_SLOT_BANDGAP) {
+    superviseSupply(raw);
+  }
+}
+
+void setupAdc() {
+  /* clk/128 (125 kHz), interrupt per conversion */
+  adcSlot = 0;
+  ADMUX = _BV(REFS0) | adcScan[0];
+  ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+  ADCSRA |= _BV(ADSC);
+}
+
+/* Limits from the power-up reading; the scan must have run a while */
+void setupSupply() {
+  unsigned long raw = readAdc(ADC_SLOT_BANDGAP);
+  if (raw < POWER_MIN_RAW || raw > POWER_MAX_RAW) return;
+
+  unsigned int failRaw = (unsigned int)(raw * 1000UL / (1000UL - POWER_FAIL_PERMILLE));
+  unsigned int recoverRaw = (unsigned int)(raw * 1000UL / (1000UL - POWER_RECOVER_PERMILLE));
+  noInterrupts();
+  powerFailRaw = failRaw;
+  powerRecoverRaw = recoverRaw;
+  interrupts();
+}
+
+/* Checkpoint worth offering: committed, and the job still exists */
+bool resumeValid() {
+  if (resume.commit != RESUME_COMMIT) return false;
+  if (resume.remainingMs == 0 || resume.remainingMs > resume.durationSec * 1000UL) return false;
+
+  if (resume.mode == JOB_RECIPE) {
+    return recipeValid() && resume.recipeId == recipeData.id && resume.step < recipeData.count;
+  }
+  return resume.mode == JOB_MANUAL || resume.mode == JOB_TRAJ;
+}
+
+void loadResume() {
+  EEPROM.get(RESUME_ADDR, resume);
+  resumeOffered = resumeValid();
+}
+
+/* The operator answered the offer: the checkpoint is used up */
+void dropResume() {
+  resumeOffered = false;
+  resume.commit = RESUME_NONE;
+  persistTouch(&resume.commit, 1);
+}
+
+/* Restart the checkpointed job where it was cut */
+void resumeJob() {
+  /* Keep the offer until the job can actually start */
+  if (!interlocksOk()) return;
+
+  unsigned long remainingMs = resume.remainingMs;
+  recipeMode = resume.mode == JOB_RECIPE;
+  trajMode = resume.mode == JOB_TRAJ;
+  if (resume.mode == JOB_MANUAL) durationSeconds = resume.durationSec;
+  dropResume();
+
+  startJob();
+  if (!isRunning) return;
+
+  /* Cut before the countdown started: run it from the top */
+  unsigned long durationMs = jobDurationSeconds * 1000UL;
+  if (remainingMs >= durationMs) return;
+
+  /* Job clock back to where the checkpoint left it */
+  unsigned long elapsedMs = durationMs - remainingMs;
+  unsigned long nowMs = millis();
+  dipWaiting = false;
+  jobStartMs = nowMs - elapsedMs;
+
+  if (recipeMode) {
+    /* Step the cut fell in, and how far into it */
+    cancelDispense();
+    unsigned long intoMs = elapsedMs;
+    byte step = 0;
+    while (step + 1 < recipeData.count && intoMs >= stepMs(step)) {
+      intoMs -= stepMs(step);
+      step++;
+    }
+    jobStep = step;
+    stepStartMs = nowMs - intoMs;
+
+    /* Its dispense only if that is still ahead */
+    const RecipeStep &s = recipeData.steps[step];
+    if (s.dispenseUs != DISPENSE_NONE && s.dispenseUs / 1000UL > intoMs) {
+      armDispense(s.dispenseUs - intoMs * 1000UL, s.dispenseMs);
+    }
+  }
+
+  /* serviceTrajectory() catches up on the ticks */
+  if (trajMode) trajTickMs = nowMs - elapsedMs;
+}
+
+/* Checkpoint the job the ADC interrupt saw the supply fail under
+   (called first thing in loop(), the write takes milliseconds) */
+void serviceCheckpoint() {
+  if (!checkpointDue) return;
+  checkpointDue = false;
+  if (isRunning) checkpointWrite();
+}
+
+/* Supply dipped and came back without a reset: the job was cut, stop it
+   and offer the checkpoint */
+void servicePower() {
+  if (powerState != POWER_BACK) return;
+
+  if (isRunning) stopJob(JOB_END_POWER);
+  resumeOffered = resumeValid();
+
+  noInterrupts();
+  powerState = POWER_OK;
+  interrupts();
+}
+
+#if USE_LCD
+/* Value in tenths as d.d */
+void lcdPrintDeci(int v) {
+  if (v < 0) {
+    lcd.print("-");
+    v = -v;
+  }
+  lcd.print(v / 10);
+  lcd.print(".");
+  lcd.print(v % 10);
+}
+
+/* Diagnostics: motor temperature and PWM cap, vacuum reading, spin-up tau */
+void updateDiagLcd() {
+  lcd.setCursor(0, 0);
+  lcd.print("TMP ");
+  lcdPrintDeci(tempDeciC);
+  lcd.print("C");
+  if (tempFault) {
+    lcd.print(" NTC?");
+  } else if (tempMaxPwm < 255) {
+    lcd.print(" MAX");
+    lcd.print((tempMaxPwm * 100) / 255);
+    lcd.print("%");
+  }
+  lcd.print("       ");
+
+  lcd.setCursor(0, 1);
+  lcd.print("VAC ");
+  lcd.print(readAdc(ADC_SLOT_VACUUM));
+  lcd.print(" TAU ");
+  lcd.print(inertiaTauMs);
+  lcd.print("       ");
+}
+
+/* Vibration now and over the last job; bus and stack health */
+void updateVibLcd() {
+  lcd.setCursor(0, 0);
+  if (mpuState == MPU_OFF) {
+    lcd.print("VIB --");
+  } else {
+    lcd.print("VIB ");
+    lcd.print(vibLiveMg);
+    lcd.print(" JOB ");
+    lcd.print(vibJobRmsMg);
+    lcd.print("mg");
+  }
+  lcd.print("        ");
+
+  /* I2C errors / FIFO overflows, stack never used */
+  lcd.setCursor(0, 1);
+  lcd.print("I2C ");
+  lcd.print(i2cErrors);
+  lcd.print("/");
+  lcd.print(mpuOverflows);
+  lcd.print(" STK ");
+  lcd.print(stackFree);
+  lcd.print("      ");
+}
+
+/* Jobs done / aborted; utilisation, jobs in the last hour, spin hours */
+void updateProdLcd() {
+  lcd.setCursor(0, 0);
+  lcd.print("OK ");
+  lcd.print(prod.jobsDone);
+  lcd.print(" AB ");
+  lcd.print(prod.jobsAborted);
+  lcd.print("        ");
+
+  lcd.setCursor(0, 1);
+  lcd.print(prodUtilPermille / 10);
+  lcd.print("% ");
+  lcd.print(prodJobsPerHour);
+  lcd.print("/h ");
+  lcd.print(prod.spinSec / 3600UL);
+  lcd.print("h");
+  lcd.print("        ");
+}
+
+void updateLcd(int pwm, unsigned long remainingSec) {
+  if (lcdPage == LCD_PAGE_PROD) {
+    updateProdLcd();
+    return;
+  }
+  if (lcdPage == LCD_PAGE_DIAG) {
+    updateDiagLcd();
+    return;
+  }
+  if (lcdPage == LCD_PAGE_VIB) {
+    updateVibLcd();
+    return;
+  }
+
+  int percent = (pwm * 100) / 255;
+  int rpmEst = estimateRpmFromPwm(pwm);
+
+  /* Line 1: speed */
+  lcd.setCursor(0, 0);
+  lcd.print("SPD ");
+
+  if (percent < 100) lcd.print(" ");
+  if (percent < 10)  lcd.print(" ");
+  lcd.print(percent);
+  lcd.print("% ");
+
+  /* RPM field */
+  if (rpmEst < 1000) lcd.print(" ");
+  if (rpmEst < 100)  lcd.print(" ");
+  if (rpmEst < 10)   lcd.print(" ");
+  lcd.print(rpmEst);
+  lcd.print("R");
+
+  /* Line 2: duration */
+  lcd.setCursor(0, 1);
+  if (!isRunning && resumeOffered) {
+    /* Job cut by a power loss */
+    lcd.print("RESUME? ");
+    lcd.print((resume.remainingMs + 999UL) / 1000UL);
+    lcd.print("s #/*");
+    lcd.print("   ");
+  } else if (!isRunning && trajMode) {
+    lcd.print("TRAJ ");
+    lcd.print((trajLengthMs() + 999UL) / 1000UL);
+    lcd.print("s");
+    lcd.print("         ");
+  } else if (!isRunning && recipeMode) {
+    lcd.print("RECIPE ");
+    lcd.print(recipeData.count);
+    lcd.print("st");
+    if (dipMode) lcd.print(" DIP");
+    lcd.print("     ");
+  } else if (!isRunning) {
+    lcd.print("T ");
+    lcd.print(durationSeconds);
+    lcd.print("s");
+    if (dipMode) lcd.print(" DIP");
+    lcd.print("           ");
+
+    /* Fan has drifted away from the calibration */
+    if (driftWarn) {
+      lcd.setCursor(11, 1);
+      lcd.print("RECAL");
+    }
+  } else if (dipWaiting) {
+    /* Waiting for the dip, or for '#' after the timeout */
+    lcd.print(dipTimedOut ? "PRESS # " : "DIP?    ");
+    lcd.print(remainingSec);
+    lcd.print("s");
+    lcd.print("       ");
+  } else {
+    lcd.print("RUN ");
+    if (recipeMode) {
+      lcd.print(jobStep + 1);
+      lcd.print("/");
+      lcd.print(recipeData.count);
+      lcd.print(" ");
+    }
+    lcd.print(remainingSec);
+    lcd.print("s left");
+    lcd.print("       ");
+  }
+
+  /* Why a job will not start (or why the last one stopped): takes the
+     corner over RECAL/DIP */
+  if (!isRunning && !resumeOffered) {
+    const char *interlock = 0;
+    if (!vacuumOk || vacuumTripped) {
+      interlock = "NOVAC";
+    } else if (tempFault) {
+      interlock = "NTC? ";
+    } else if (tempTripped) {
+      interlock = "HOT  ";
+    } else if (tachLost) {
+      interlock = "TACH?";
+    }
+    if (interlock) {
+      lcd.setCursor(11, 1);
+      lcd.print(interlock);
+    }
+  }
+}
+#endif
+
+#if USE_KEYPAD
+void handleKey(char key) {
+  /* While running: allow abort */
+  if (isRunning) {
+    /* D aborts */
+    if (key == 'D') {
+      stopJob(JOB_END_KEY);
+    } else if (key == '#' && dipWaiting) {
+      /* Manual start while waiting for the dip */
+      startCountdown();
+    } else if (key == '*') {
+#if USE_LCD
+      /* Next LCD page */
+      lcdPage = (lcdPage + 1) % LCD_PAGE_COUNT;
+#endif
+    }
+    return;
+  }
+
+  /* Resume offer: '#' resumes, '*' drops it */
+  if (resumeOffered) {
+    if (key == '#') {
+      resumeJob();
+    } else if (key == '*') {
+      dropResume();
     }
     return;
   }
@@ -241,21 +3933,659 @@ void handleKeypad() {
   } else if (key == '#') {
     /* Start */
     startJob();
+  } else if (key == 'A') {
+    /* Manual / recipe */
+    recipeMode = !recipeMode;
+    trajMode = false;
+  } else if (key == 'B') {
+    /* Manual / trajectory */
+    trajMode = !trajMode;
+    recipeMode = false;
+  } else if (key == 'C') {
+    /* Dip trigger on / off */
+    dipMode = !dipMode;
+  } else if (key == 'D') {
+#if USE_LCD
+    /* Next LCD page */
+    lcdPage = (lcdPage + 1) % LCD_PAGE_COUNT;
+#endif
+  }
+}
+
+void handleKeypad() {
+  /* Every key that went down in this scan (non-blocking). getKey()
+     only reports the first key in the list, so one stuck key would
+     hide all the others, D included */
+  if (!keypad.getKeys()) return;
+  for (byte i = 0; i < LIST_MAX; i++) {
+    if (keypad.key[i].stateChanged && keypad.key[i].kstate == PRESSED) {
+      handleKey(keypad.key[i].kchar);
+    }
+  }
+}
+#endif
+
+#if USE_TELEMETRY
+#if USE_TELEMETRY_DELTA
+/* Unsigned LEB128 into buf; returns the bytes written (at most 5) */
+byte telemetryVarint(byte *buf, unsigned long v) {
+  byte n = 0;
+  while (v >= 0x80) {
+    buf[n++] = (byte)(v | 0x80);
+    v >>= 7;
+  }
+  buf[n++] = (byte)v;
+  return n;
+}
+
+/* Zigzag: small changes of either sign become small varints */
+unsigned long telemetryZigzag(unsigned long d) {
+  return (d << 1) ^ (unsigned long)((long)d >> 31);
+}
+
+/* A keyframe, a frame of what moved, or nothing */
+void sendTelemetryFrame(const long *v) {
+  bool key = telemetryKeyIn == 0;
+  byte frame[TELEMETRY_LINE_MAX];
+  byte n = 2;
+  frame[n++] = key ? TELEMETRY_KEY_FLAG : 0;
+
+  unsigned int mask = 0;
+  for (byte i = 0; i < TELEMETRY_FIELDS; i++) {
+    unsigned long d = (unsigned long)v[i] - (unsigned long)telemetrySent[i];
+    unsigned long mag = (long)d < 0 ? 0UL - d : d;
+    if (key || i == 0 || mag > pgm_read_word(&telemetryDeadband[i])) mask |= 1U << i;
+  }
+  if (mask == 1) return;
+
+  n += telemetryVarint(frame + n, mask);
+  for (byte i = 0; i < TELEMETRY_FIELDS; i++) {
+    if (!(mask & (1U << i))) continue;
+    unsigned long d = key ? (unsigned long)v[i] : (unsigned long)v[i] - (unsigned long)telemetrySent[i];
+    n += telemetryVarint(frame + n, telemetryZigzag(d));
+    telemetrySent[i] = v[i];
+  }
+
+  frame[0] = TELEMETRY_SYNC;
+  frame[1] = n - 2;
+  byte sum = 0;
+  for (byte i = 1; i < n; i++) sum += frame[i];
+  frame[n++] = sum;
+  Serial.write(frame, n);
+  if (key) telemetryKeyIn = TELEMETRY_KEY_TICKS;
+}
+#endif
+
+/* One line (or frame) per TELEMETRY_MS, or none if the TX buffer is
+   short of room */
+void serviceTelemetry(int pwm) {
+  unsigned long nowMs = millis();
+  if (nowMs - telemetryLastMs < TELEMETRY_MS) return;
+  telemetryLastMs = nowMs;
+#if USE_TELEMETRY_DELTA
+  if (telemetryKeyIn) telemetryKeyIn--;
+#endif
+
+  if (Serial.availableForWrite() < TELEMETRY_LINE_MAX) {
+    telemetrySkipped++;
+    return;
+  }
+
+  long v[TELEMETRY_FIELDS] = {
+    (long)nowMs, isRunning ? 1 : 0, jobStep, pwm, readMeasuredRpm(), (long)getRemainingSeconds(),
+    tempDeciC, tempMaxPwm, (long)vibLiveMg, (long)stackFree, (long)telemetrySkipped
+  };
+#if USE_TELEMETRY_DELTA
+  sendTelemetryFrame(v);
+#else
+  Serial.print((unsigned long)v[0]);
+  for (byte i = 1; i < TELEMETRY_FIELDS; i++) {
+    Serial.print(',');
+    Serial.print(v[i]);
+  }
+  Serial.println();
+#endif
+}
+
+/* C done aborted spinSec idleSec util(permille) jobs/h */
+void printProdCounters() {
+  Serial.print(F("C "));
+  Serial.print(prod.jobsDone);
+  Serial.print(' ');
+  Serial.print(prod.jobsAborted);
+  Serial.print(' ');
+  Serial.print(prod.spinSec);
+  Serial.print(' ');
+  Serial.print(prod.idleSec);
+  Serial.print(' ');
+  Serial.print(prodUtilPermille);
+  Serial.print(' ');
+  Serial.println(prodJobsPerHour);
+}
+
+/* 'H' starts a history dump, 'C' asks for the production counters;
+   lines go out as the TX buffer has room */
+void serviceQueries() {
+  if (Serial.available()) {
+    int c = Serial.read();
+    if (c == 'H' && historyDumpPos == HISTORY_DUMP_IDLE) historyDumpPos = HISTORY_DUMP_HEADER;
+    if (c == 'C') prodQueryPending = true;
+  }
+
+  if (prodQueryPending && Serial.availableForWrite() >= HISTORY_LINE_MAX) {
+    printProdCounters();
+    prodQueryPending = false;
+  }
+
+  while (historyDumpPos != HISTORY_DUMP_IDLE && Serial.availableForWrite() >= HISTORY_LINE_MAX) {
+    if (historyDumpPos == HISTORY_DUMP_HEADER) {
+      Serial.print(F("H# "));
+      Serial.print(historyCount);
+      Serial.print(' ');
+      Serial.print(HISTORY_SLOTS);
+      Serial.print(' ');
+      Serial.print(historyDropped);
+      Serial.print(' ');
+      Serial.println(persist.boots);
+      historyDumpPos = 0;
+      continue;
+    }
+    if (historyDumpPos >= historyCount) {
+      Serial.println(F("H."));
+      historyDumpPos = HISTORY_DUMP_IDLE;
+      return;
+    }
+
+    HistoryRecord r;
+    if (!historyRead((byte)historyDumpPos, r)) return;
+    Serial.print(F("H "));
+    Serial.print(r.boot);
+    Serial.print(' ');
+    Serial.print(r.startSec);
+    Serial.print(' ');
+    Serial.print(r.end >> 4);
+    Serial.print(' ');
+    Serial.print(r.recipeId);
+    Serial.print(' ');
+    if (r.runSec == HISTORY_RUN_OPEN) {
+      Serial.print('-');
+    } else {
+      Serial.print(r.runSec);
+    }
+    Serial.print(' ');
+    Serial.print(r.end & 0x0F);
+    Serial.print(' ');
+    Serial.print((unsigned int)r.errMean << HISTORY_ERR_SHIFT);
+    Serial.print(' ');
+    Serial.println((unsigned int)r.errMax << HISTORY_ERR_SHIFT);
+    historyDumpPos++;
+  }
+}
+#endif
+
+#if USE_PROFILER
+#if defined(__AVR__)
+extern "C" void profileSample() __asm__("__vector_profile_sample") __attribute__((signal, used));
+
+/* The return address on the stack is the interrupted PC. Save it
+   without touching SREG and jump to profileSample(), which then runs as
+   the interrupt proper */
+ISR(TIMER1_COMPB_vect, ISR_NAKED) {
+  asm volatile(
+      "push r29\n\t"
+      "push r30\n\t"
+      "push r31\n\t"
+      "in r30, __SP_L__\n\t"
+      "in r31, __SP_H__\n\t"
+      /* SP+1..3 are the three pushes, then PC high and low */
+      "ldd r29, Z+4\n\t"
+      "ldd r30, Z+5\n\t"
+      "sts profilePc, r30\n\t"
+      "sts profilePc+1, r29\n\t"
+      "pop r31\n\t"
+      "pop r30\n\t"
+      "pop r29\n\t"
+      "jmp __vector_profile_sample\n\t");
+}
+#endif
+
+void profileSample() {
+  /* Byte address, as the ELF has it */
+  unsigned int bin = (profilePc << 1) >> profileShift;
+  if (bin < PROFILE_BINS) {
+    if (profileBins[bin] != 0xFFFF) profileBins[bin]++;
+  } else {
+    profileOutside++;
+  }
+
+  /* Next sample somewhere else in the PWM period (x^8+x^6+x^5+x^4+1) */
+  byte l = profileLfsr;
+  l = (l >> 1) ^ ((l & 1) ? 0xB8 : 0);
+  profileLfsr = l;
+  OCR1B = l;
+}
+
+void setupProfile() {
+  /* Smallest bins that still reach the end of the program */
+  extern char _etext[];
+  unsigned int textEnd = (unsigned int)(uintptr_t)_etext;
+  while ((textEnd >> profileShift) >= PROFILE_BINS) profileShift++;
+
+  profileLastDumpMs = millis();
+  OCR1B = profileLfsr;
+  TIMSK1 |= _BV(OCIE1B);
+}
+
+/* Print and clear the bins, as the TX buffer has room (called from
+   loop()) */
+void serviceProfile() {
+  if (profileDumpBin < 0) {
+    unsigned long nowMs = millis();
+    if (nowMs - profileLastDumpMs < PROFILE_DUMP_MS) return;
+    if (Serial.availableForWrite() < PROFILE_LINE_MAX) return;
+    profileLastDumpMs = nowMs;
+
+    noInterrupts();
+    unsigned int outside = profileOutside;
+    profileOutside = 0;
+    interrupts();
+
+    Serial.print(F("P# "));
+    Serial.print(profileShift);
+    Serial.print(' ');
+    Serial.print(PROFILE_BINS);
+    Serial.print(' ');
+    Serial.print(nowMs);
+    Serial.print(' ');
+    Serial.print(outside);
+    Serial.print(' ');
+    Serial.print(loopUsMean);
+    Serial.print(' ');
+    Serial.println(loopUsMax);
+    profileDumpBin = 0;
+    return;
+  }
+
+  while (profileDumpBin < PROFILE_BINS && Serial.availableForWrite() >= PROFILE_LINE_MAX) {
+    noInterrupts();
+    unsigned int count = profileBins[profileDumpBin];
+    profileBins[profileDumpBin] = 0;
+    interrupts();
+
+    if (count) {
+      Serial.print(F("P "));
+      Serial.print(profileDumpBin);
+      Serial.print(' ');
+      Serial.println(count);
+    }
+    profileDumpBin++;
+  }
+  if (profileDumpBin >= PROFILE_BINS && Serial.availableForWrite() >= PROFILE_LINE_MAX) {
+    Serial.println(F("P."));
+    profileDumpBin = -1;
+  }
+}
+#endif
+
+#if USE_MODBUS
+unsigned int modbusCrcUpdate(unsigned int crc, byte b) {
+  return (crc >> 8) ^ pgm_read_word(&modbusCrcTable[(crc ^ b) & 0xFF]);
+}
+
+unsigned int modbusReadReg(const ModbusReg *table, unsigned int index) {
+  ModbusReg reg;
+  memcpy_P(&reg, &table[index], sizeof(reg));
+
+  if (reg.size == 1) return *(volatile byte *)reg.ptr;
+  return *(volatile unsigned int *)reg.ptr;
+}
+
+/* Any of count holding registers from index a job setting, while a job
+   runs (ISR context) */
+bool modbusSettingsBusy(unsigned int index, unsigned int count) {
+  return isRunning && index < MODBUS_HOLD_DURATION + MODBUS_SETTING_WORDS &&
+         index + count > MODBUS_HOLD_DURATION;
+}
+
+bool modbusWriteReg(unsigned int index, unsigned int value) {
+  ModbusReg reg;
+  memcpy_P(&reg, &modbusHoldingRegs[index], sizeof(reg));
+  if (value > reg.maxValue) return false;
+
+  if (index >= MODBUS_HOLD_DURATION && index < MODBUS_HOLD_DURATION + MODBUS_SETTING_WORDS) {
+    /* Job setting: staged for loop() */
+    byte i = index - MODBUS_HOLD_DURATION;
+    modbusSettings[i] = value;
+    modbusSettingsPending |= (byte)(1 << i);
+  } else if (reg.size == 1) {
+    *(volatile byte *)reg.ptr = (byte)value;
+  } else {
+    *(volatile unsigned int *)reg.ptr = value;
+  }
+  return true;
+}
+
+/* Recipe image window: byte 2n is the high byte of word n */
+unsigned int modbusReadRecipe(unsigned int word) {
+  const byte *img = (const byte *)&recipeData;
+  unsigned int i = word * 2;
+  unsigned int v = (unsigned int)img[i] << 8;
+  if (i + 1 < sizeof(RecipeData)) v |= img[i + 1];
+  return v;
+}
+
+void modbusWriteRecipe(unsigned int word, unsigned int value) {
+  byte *img = (byte *)&recipeData;
+  unsigned int i = word * 2;
+  img[i] = (byte)(value >> 8);
+  if (i + 1 < sizeof(RecipeData)) img[i + 1] = (byte)(value & 0xFF);
+}
+
+/* Re-arm the T3.5 alarm (ISR context) */
+void modbusArmT35() {
+  unsigned int ticks = MODBUS_T35_TICKS;
+  /* First chunk, remainder loaded by the compare ISR */
+  byte first = ticks > 255U ? (byte)(ticks / 2U) : (byte)ticks;
+
+  modbusT35Left = ticks - first;
+  OCR2B = (byte)(TCNT2 + first);
+  TIFR2 = _BV(OCF2B);
+  TIMSK2 |= _BV(OCIE2B);
+}
+
+/* Start sending modbusLen bytes of modbusBuf with CRC appended */
+void modbusSend() {
+  unsigned int crc = 0xFFFF;
+  for (byte i = 0; i < modbusLen; i++) crc = modbusCrcUpdate(crc, modbusBuf[i]);
+  modbusBuf[modbusLen++] = (byte)(crc & 0xFF);
+  modbusBuf[modbusLen++] = (byte)(crc >> 8);
+
+  modbusTxBusy = true;
+  modbusTxPos = 0;
+  UCSR0B |= _BV(UDRIE0);
+}
+
+void modbusException(byte code) {
+  modbusBuf[1] |= 0x80;
+  modbusBuf[2] = code;
+  modbusLen = 3;
+}
+
+/* Handle the request in modbusBuf (CRC checked and taken off modbusLen),
+   build the reply */
+void modbusHandleFrame() {
+  byte fn = modbusBuf[1];
+  unsigned int addr = ((unsigned int)modbusBuf[2] << 8) | modbusBuf[3];
+  unsigned int count = ((unsigned int)modbusBuf[4] << 8) | modbusBuf[5];
+
+  if ((fn == 0x03 || fn == 0x10) && addr >= MODBUS_RECIPE_BASE) {
+    /* Recipe image window; the reply (read) or the request (write) must
+       fit modbusBuf, which is smaller than the image */
+    addr -= MODBUS_RECIPE_BASE;
+    if (count == 0 || count > (fn == 0x03 ? (MODBUS_BUF_SIZE - 5) / 2 : (MODBUS_BUF_SIZE - 9) / 2)) {
+      modbusException(MODBUS_EX_VALUE);
+      return;
+    }
+    if (addr + count > MODBUS_RECIPE_WORDS) {
+      modbusException(MODBUS_EX_ADDRESS);
+      return;
+    }
+
+    if (fn == 0x03) {
+      if (modbusLen != 6) {
+        modbusException(MODBUS_EX_VALUE);
+        return;
+      }
+      modbusBuf[2] = (byte)(count * 2);
+      for (unsigned int i = 0; i < count; i++) {
+        unsigned int v = modbusReadRecipe(addr + i);
+        modbusBuf[3 + i * 2] = (byte)(v >> 8);
+        modbusBuf[4 + i * 2] = (byte)(v & 0xFF);
+      }
+      modbusLen = 3 + count * 2;
+      return;
+    }
+
+    /* The running recipe must not change under the executor */
+    if (isRunning) {
+      modbusException(MODBUS_EX_BUSY);
+      return;
+    }
+    if (modbusBuf[6] != count * 2 || modbusLen != 7 + count * 2) {
+      modbusException(MODBUS_EX_VALUE);
+      return;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+      modbusWriteRecipe(addr + i, ((unsigned int)modbusBuf[7 + i * 2] << 8) | modbusBuf[8 + i * 2]);
+    }
+    modbusLen = 6;
+  } else if (fn == 0x04 && addr >= MODBUS_HISTORY_BASE) {
+    /* Job history window */
+    addr -= MODBUS_HISTORY_BASE;
+    if (modbusLen != 6 || count == 0 || count > (MODBUS_BUF_SIZE - 5) / 2) {
+      modbusException(MODBUS_EX_VALUE);
+      return;
+    }
+    if (addr + count > historyCount * MODBUS_HISTORY_WORDS) {
+      modbusException(MODBUS_EX_ADDRESS);
+      return;
+    }
+
+    modbusBuf[2] = (byte)(count * 2);
+    HistoryRecord r;
+    for (unsigned int i = 0; i < count; i++) {
+      unsigned int word = addr + i;
+      /* EEPROM busy with a write: try again */
+      if ((i == 0 || word % MODBUS_HISTORY_WORDS == 0) && !historyRead(word / MODBUS_HISTORY_WORDS, r)) {
+        modbusException(MODBUS_EX_BUSY);
+        return;
+      }
+      const byte *b = (const byte *)&r + (word % MODBUS_HISTORY_WORDS) * 2;
+      modbusBuf[3 + i * 2] = b[0];
+      modbusBuf[4 + i * 2] = b[1];
+    }
+    modbusLen = 3 + count * 2;
+  } else if (fn == 0x03 || fn == 0x04) {
+    /* Read holding / input registers */
+    const ModbusReg *table = fn == 0x03 ? modbusHoldingRegs : modbusInputRegs;
+    byte tableCount = fn == 0x03 ? MODBUS_HOLDING_COUNT : MODBUS_INPUT_COUNT;
+
+    if (modbusLen != 6 || count == 0 || count > (MODBUS_BUF_SIZE - 5) / 2) {
+      modbusException(MODBUS_EX_VALUE);
+      return;
+    }
+    if (addr + count > tableCount) {
+      modbusException(MODBUS_EX_ADDRESS);
+      return;
+    }
+
+    modbusBuf[2] = (byte)(count * 2);
+    for (unsigned int i = 0; i < count; i++) {
+      unsigned int v = modbusReadReg(table, addr + i);
+      modbusBuf[3 + i * 2] = (byte)(v >> 8);
+      modbusBuf[4 + i * 2] = (byte)(v & 0xFF);
+    }
+    modbusLen = 3 + count * 2;
+  } else if (fn == 0x06) {
+    /* Write single register; reply echoes the request */
+    if (modbusLen != 6) {
+      modbusException(MODBUS_EX_VALUE);
+      return;
+    }
+    if (addr >= MODBUS_HOLDING_COUNT) {
+      modbusException(MODBUS_EX_ADDRESS);
+      return;
+    }
+    if (modbusSettingsBusy(addr, 1)) {
+      modbusException(MODBUS_EX_BUSY);
+      return;
+    }
+    if (!modbusWriteReg(addr, count)) {
+      modbusException(MODBUS_EX_VALUE);
+      return;
+    }
+    modbusLen = 6;
+  } else if (fn == 0x10) {
+    /* Write multiple registers */
+    byte bytes = modbusBuf[6];
+    if (count == 0 || count > (MODBUS_BUF_SIZE - 9) / 2 || bytes != count * 2 || modbusLen != 7 + bytes) {
+      modbusException(MODBUS_EX_VALUE);
+      return;
+    }
+    if (addr + count > MODBUS_HOLDING_COUNT) {
+      modbusException(MODBUS_EX_ADDRESS);
+      return;
+    }
+    if (modbusSettingsBusy(addr, count)) {
+      modbusException(MODBUS_EX_BUSY);
+      return;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+      unsigned int v = ((unsigned int)modbusBuf[7 + i * 2] << 8) | modbusBuf[8 + i * 2];
+      if (!modbusWriteReg(addr + i, v)) {
+        modbusException(MODBUS_EX_VALUE);
+        return;
+      }
+    }
+    modbusLen = 6;
   } else {
-    /* Ignore A/B/C/D when not running */
+    modbusException(MODBUS_EX_FUNCTION);
+  }
+}
+
+ISR(USART_RX_vect) {
+  bool frameError = UCSR0A & (_BV(FE0) | _BV(DOR0));
+  byte b = UDR0;
+
+  /* Half duplex: ignore our own echo / anything while replying */
+  if (modbusTxBusy) return;
+
+  if (frameError || modbusLen >= MODBUS_BUF_SIZE) {
+    modbusOverrun = true;
+  } else {
+    modbusBuf[modbusLen++] = b;
+    modbusCrc = modbusCrcUpdate(modbusCrc, b);
+  }
+
+  /* Every byte restarts the silence timer */
+  modbusArmT35();
+}
+
+/* T3.5 silence: frame complete */
+ISR(TIMER2_COMPB_vect) {
+  if (modbusT35Left > 0) {
+    byte chunk = modbusT35Left > 255U ? 128 : (byte)modbusT35Left;
+    modbusT35Left -= chunk;
+    OCR2B = (byte)(OCR2B + chunk);
+    return;
+  }
+  TIMSK2 &= ~_BV(OCIE2B);
+
+  /* A frame that includes its own CRC leaves a zero remainder */
+  bool ok = !modbusOverrun && modbusLen >= 4 && modbusCrc == 0;
+  byte addr = modbusBuf[0];
+
+  if (!ok) {
+    modbusErrorCount++;
+  } else if (addr == MODBUS_ADDR || addr == 0) {
+    modbusFrameCount++;
+    modbusLen -= 2;
+    modbusHandleFrame();
+
+    /* Broadcasts are never answered */
+    if (addr == MODBUS_ADDR) {
+      modbusSend();
+      return;
+    }
+  }
+
+  /* Ready for the next request */
+  modbusLen = 0;
+  modbusCrc = 0xFFFF;
+  modbusOverrun = false;
+}
+
+ISR(USART_UDRE_vect) {
+  UDR0 = modbusBuf[modbusTxPos++];
+
+  if (modbusTxPos >= modbusLen) {
+    /* Last byte queued */
+    UCSR0B &= ~_BV(UDRIE0);
+    modbusTxBusy = false;
+    modbusLen = 0;
+    modbusCrc = 0xFFFF;
+    modbusOverrun = false;
+  }
+}
+
+void setupModbus() {
+  /* Double speed: 115200 is 2.1 % off with U2X, 3.5 % without */
+  UCSR0A = _BV(U2X0);
+  UBRR0 = (unsigned int)((F_CPU / (8UL * MODBUS_BAUD)) - 1UL);
+  /* 8N1 */
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+  UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+}
+
+/* Job settings written over Modbus, applied between jobs (loop
+   context): the duration's words together, recipe mode over trajectory
+   mode as the 'A' key does */
+void serviceModbusSettings() {
+  if (isRunning) return;
+  noInterrupts();
+  byte pending = modbusSettingsPending;
+  modbusSettingsPending = 0;
+  unsigned int v[MODBUS_SETTING_WORDS];
+  for (byte i = 0; i < MODBUS_SETTING_WORDS; i++) v[i] = modbusSettings[i];
+  interrupts();
+  if (!pending) return;
+
+  /* Words in register order: duration low, high, recipe, dip */
+  if (pending & 0x01) durationSeconds = (durationSeconds & 0xFFFF0000UL) | v[0];
+  if (pending & 0x02) durationSeconds = (durationSeconds & 0xFFFFUL) | ((unsigned long)v[1] << 16);
+  if (pending & 0x04) {
+    recipeMode = v[2] != 0;
+    if (recipeMode) trajMode = false;
+  }
+  if (pending & 0x08) dipMode = v[3] != 0;
+}
+
+/* Start / stop requested over Modbus (loop context) */
+void serviceModbusCommand() {
+  serviceModbusSettings();
+
+  byte cmd = modbusCommand;
+  if (cmd == MODBUS_CMD_NONE) return;
+  modbusCommand = MODBUS_CMD_NONE;
+
+  if (cmd == MODBUS_CMD_START && !isRunning) {
+    startJob();
+  } else if (cmd == MODBUS_CMD_STOP && isRunning) {
+    stopJob(JOB_END_REMOTE);
+  } else if (cmd == MODBUS_CMD_SAVE_RECIPE && !isRunning) {
+    if (recipeValid()) {
+      persistTouch(&recipeData, sizeof(recipeData));
+    } else {
+      /* Bad upload: back to the stored recipe */
+      loadRecipe();
+    }
   }
 }
+#endif
 
 void setup() {
   /* Fan PWM pin output */
   pinMode(fanPwmPin, OUTPUT);
 
+  /* Pots and supply, scanned in the background */
+  setupAdc();
+
   /* Start I2C */
-  Wire.begin();
+  setupI2c();
 
+#if USE_LCD
   /* Init LCD */
-  lcd.init();
-  lcd.backlight();
+  setupLcd();
 
   /* Initial screen */
   lcd.clear();
@@ -263,43 +4593,278 @@ void setup() {
   lcd.print("Spin Coater");
   lcd.setCursor(0, 1);
   lcd.print("Ready");
+  lcdFlush();
   delay(700);
   lcd.clear();
+#endif
+
+  /* Accelerometer on the same bus */
+  setupVibration();
 
   /* Start fan off */
   writeFanPwm(0);
+
+  /* Tach input */
+  setupTach();
+
+  /* Supply monitor, from the reading after the splash delay */
+  setupSupply();
+
+  /* Persistent data and drift state, job history */
+  loadPersist();
+  updateDriftWarn();
+  loadHistory();
+  loadProd();
+
+  /* Dispense valve and stored recipe */
+  setupDispense();
+  loadRecipe();
+
+  /* Job cut by a power loss: offered on the LCD */
+  loadResume();
+
+#if USE_KEYPAD
+  /* Keys already down (stuck, or leant on) are not presses: a stuck
+     '#' must not start a job at power-up */
+  keypad.getKeys();
+#endif
+
+#if USE_MODBUS
+  /* Modbus on the UART; uses Timer2 compare B, so after setupDispense() */
+  setupModbus();
+#endif
+
+#if USE_TELEMETRY
+  /* Field names, once */
+  Serial.begin(TELEMETRY_BAUD);
+  Serial.println(F("ms,run,step,pwm,rpm,left_s,temp_dC,pwm_max,vib_mg,stack_free,skipped"));
+#endif
+
+#if USE_LCD_MIRROR && !USE_TELEMETRY
+  Serial.begin(LCD_MIRROR_BAUD);
+#endif
+
+#if USE_SD_LOG
+  /* Card and log file; logging stays off if either is missing */
+  setupSdLog();
+#endif
+
+#if USE_PROFILER
+  /* Sampling starts last, so setup() is not in the first dump */
+#if !USE_TELEMETRY && !USE_LCD_MIRROR
+  Serial.begin(PROFILE_BAUD);
+#endif
+  setupProfile();
+#endif
+
+#if USE_TT_SCHEDULE
+  /* The first frame starts now */
+  ttDueUs = micros();
+#endif
 }
 
-void loop() {
+/* loop() work, as the tasks the cooperative loop or the schedule runs */
+
+#if USE_KEYPAD
+/* Keys that went down */
+void taskKeypad() {
+  handleKeypad();
+}
+#endif
+
+/* What the ADC interrupt measured: supply, vacuum, motor temperature */
+void taskSensors() {
+  /* Supply dip that did not reset us */
+  servicePower();
+
+  /* Vacuum lost: the ADC interrupt has cut the fan, end the job */
+  if (vacuumTripped && isRunning) stopJob(JOB_END_VACUUM);
+
+  /* Motor temperature: PWM cap, trip */
+  serviceTemperature();
+}
+
+/* Setpoint, job sequencing and the fan output */
+void taskControl() {
+#if USE_POTS
   /* Read speed always so you can “set” it before running */
   int pwm = readPwmFromPots();
+#else
+  /* No pots: manual jobs run at a fixed speed */
+  int pwm = FIXED_PWM;
+#endif
 
-  /* Handle keypad input */
-  handleKeypad();
+  /* Remote setpoint replaces the pots */
+  noInterrupts();
+  unsigned int remotePwm = pwmOverride;
+  interrupts();
+  if (remotePwm <= 255U) pwm = (int)remotePwm;
+
+#if USE_MODBUS
+  /* Start / stop from the PLC */
+  serviceModbusCommand();
+#endif
 
   /* If running, check countdown */
   if (isRunning) {
+    /* Countdown held until the dip; recipe steps wait with it */
+    if (dipWaiting) {
+      serviceDip();
+    } else {
+      serviceRecipe();
+      serviceTrajectory();
+    }
+
+    /* The step's speed replaces the pots; a manual setpoint goes at a
+       rate the load can follow. The thermal cap is hard: a falling cap
+       is not slewed */
+    pwm = min(jobPwm(pwm), tempMaxPwm);
+    if (!recipeMode && !trajMode) pwm = min(rampLimit(pwm), tempMaxPwm);
+    sampleInertia(pwm);
+
     unsigned long remainingSec = getRemainingSeconds();
 
     /* If done, stop */
     if (remainingSec == 0) {
-      stopJob();
+      stopJob(JOB_END_DONE);
+    } else {
+      /* Hold-phase drift sampling */
+      sampleDrift(pwm);
+#if USE_SD_LOG
+      sdLogSample(pwm, readMeasuredRpm());
+#endif
     }
   }
 
+  /* Fan driven but no tach: stops the job */
+  if (isRunning) superviseTach(pwm);
+
   /* Apply PWM only while running */
   if (isRunning) {
     writeFanPwm(pwm);
   } else {
     writeFanPwm(0);
   }
+  controlPwm = pwm;
+
+  /* Live values for remote readers */
+  int rpmNow = readMeasuredRpm();
+  unsigned long remainingNow = getRemainingSeconds();
+  noInterrupts();
+  measuredRpm = rpmNow;
+  remainingSeconds = remainingNow;
+  interrupts();
+}
 
-  /* Update LCD at ~10 Hz */
+#if USE_LCD
+/* LCD page at ~10 Hz */
+void taskUi() {
   unsigned long nowMs = millis();
   if (nowMs - lastUiMs >= 100UL) {
     lastUiMs = nowMs;
 
     unsigned long remainingSec = getRemainingSeconds();
-    updateLcd(pwm, remainingSec);
+    updateLcd(controlPwm, remainingSec);
+  }
+}
+#endif
+
+/* I2C: LCD cells that changed, accelerometer FIFO, hung bus */
+void taskIo() {
+  serviceI2c();
+#if USE_LCD
+  serviceLcd();
+#endif
+  serviceVibration();
+}
+
+/* UART text: telemetry, query answers, the LCD mirror */
+void taskComm() {
+#if USE_LCD_MIRROR
+  serviceLcdMirror();
+#endif
+
+#if USE_TELEMETRY
+  serviceTelemetry(isRunning ? controlPwm : 0);
+  serviceQueries();
+#endif
+}
+
+/* Bookkeeping and background writes */
+void taskBackground() {
+  serviceUptime();
+  serviceProd();
+
+  /* Background EEPROM write-behind */
+  servicePersist();
+
+#if USE_SD_LOG
+  /* Background SD block streaming */
+  serviceSdLog();
+#endif
+
+#if USE_PROFILER
+  serviceProfile();
+#endif
+
+  /* Idle: stack high-water mark */
+  serviceStack();
+}
+
+#if !USE_TT_SCHEDULE
+/* Every task, each pass */
+void loop() {
+  serviceLoopTime();
+  serviceCheckpoint();
+#if USE_KEYPAD
+  taskKeypad();
+#endif
+  taskSensors();
+  taskControl();
+#if USE_LCD
+  taskUi();
+#endif
+  taskIo();
+  taskComm();
+  taskBackground();
+}
+#else
+/* The slot whose time has come, if any */
+void loop() {
+  /* Not held for a slot: the hold-up time is short */
+  serviceCheckpoint();
+
+  unsigned long startUs = micros();
+  if ((long)(startUs - ttDueUs) < 0) return;
+
+  unsigned long lateUs = startUs - ttDueUs;
+  if (lateUs > ttJitterMaxUs) ttJitterMaxUs = lateUs > 0xFFFFUL ? 0xFFFF : (unsigned int)lateUs;
+
+  byte tasks = pgm_read_byte(&ttSchedule[ttSlot]);
+#if USE_KEYPAD
+  if (tasks & TT_KEYPAD) taskKeypad();
+#endif
+  if (tasks & TT_SENSORS) taskSensors();
+  if (tasks & TT_CONTROL) taskControl();
+#if USE_LCD
+  if (tasks & TT_UI) taskUi();
+#endif
+  if (tasks & TT_IO) taskIo();
+  if (tasks & TT_COMM) taskComm();
+  if (tasks & TT_BACKGROUND) taskBackground();
+
+  unsigned long endUs = micros();
+  unsigned long ranUs = endUs - startUs;
+  if (ranUs > ttSlotMaxUs[ttSlot]) ttSlotMaxUs[ttSlot] = ranUs > 0xFFFFUL ? 0xFFFF : (unsigned int)ranUs;
+
+  if (endUs - ttDueUs > TT_SLOT_US) {
+    /* Overrun: the frame starts over from now instead of catching up */
+    ttOverruns++;
+    ttOverrunSlot = ttSlot;
+    ttDueUs = endUs;
+  } else {
+    ttDueUs += TT_SLOT_US;
   }
+  ttSlot = ttSlot + 1 < TT_SLOTS ? ttSlot + 1 : 0;
 }
+#endif
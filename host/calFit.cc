@@ -0,0 +1,308 @@
+/*
+  Calibration fit tool (host side)
+
+  Reads PWM/RPM samples and emits the rpmCal[] table used by
+  estimateRpmFromPwm() in fanControl.cc.
+
+  Build
+    g++ -O2 -o calFit host/calFit.cc
+
+  Usage
+    calFit [-b maxErrRpm] [-k knotStep] [-l lambda] < samples.txt
+
+  Input
+  - One sample per line: "pwm rpm" (space, tab or comma separated)
+  - Lines starting with '#' are ignored
+  - Any number of samples per PWM value; repeat readings are welcome
+
+  Method
+  - Least-squares linear spline with knots every knotStep PWM counts,
+    plus a small second-difference penalty so sparse regions stay smooth
+  - Outlier rejection: samples further than 3 robust sigmas (MAD) from
+    the fit are dropped and the fit is repeated until nothing changes
+  - Knot values are made monotone (pool adjacent violators)
+  - The firmware table is a uniform grid with a power-of-two spacing;
+    the coarsest grid whose interpolation error stays within maxErrRpm
+    is chosen, so lookup is a shift and one multiply
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+struct Sample {
+  int pwm;
+  double rpm;
+  bool used;
+};
+
+/* Fit parameters */
+static double maxErrRpm = 20.0;
+static int knotStep = 8;
+static double lambda = 0.5;
+
+/* Robust rejection threshold (robust sigmas) */
+static const double rejectSigmas = 3.0;
+/* Never reject below this residual (rpm), tach readings are quantised */
+static const double rejectFloorRpm = 15.0;
+
+static void usage() {
+  fprintf(stderr, "usage: calFit [-b maxErrRpm] [-k knotStep] [-l lambda] < samples\n");
+  exit(2);
+}
+
+static bool readSamples(std::vector<Sample> &out) {
+  char line[256];
+  while (fgets(line, sizeof(line), stdin)) {
+    /* Skip comments and blank lines */
+    char *p = line;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) continue;
+
+    /* Accept comma as a separator too */
+    for (char *c = p; *c; c++) {
+      if (*c == ',') *c = ' ';
+    }
+
+    int pwm;
+    double rpm;
+    if (sscanf(p, "%d %lf", &pwm, &rpm) != 2) {
+      fprintf(stderr, "calFit: bad line: %s", line);
+      return false;
+    }
+    if (pwm < 0 || pwm > 255 || rpm < 0) {
+      fprintf(stderr, "calFit: out of range: %s", line);
+      return false;
+    }
+    out.push_back(Sample{pwm, rpm, true});
+  }
+  return true;
+}
+
+/* Solve A x = b in place (Gaussian elimination, partial pivoting) */
+static bool solve(std::vector<double> &a, std::vector<double> &b, int n) {
+  for (int col = 0; col < n; col++) {
+    int piv = col;
+    for (int r = col + 1; r < n; r++) {
+      if (fabs(a[r * n + col]) > fabs(a[piv * n + col])) piv = r;
+    }
+    if (fabs(a[piv * n + col]) < 1e-12) return false;
+    if (piv != col) {
+      for (int c = 0; c < n; c++) std::swap(a[col * n + c], a[piv * n + c]);
+      std::swap(b[col], b[piv]);
+    }
+    for (int r = col + 1; r < n; r++) {
+      double f = a[r * n + col] / a[col * n + col];
+      if (f == 0) continue;
+      for (int c = col; c < n; c++) a[r * n + c] -= f * a[col * n + c];
+      b[r] -= f * b[col];
+    }
+  }
+  for (int r = n - 1; r >= 0; r--) {
+    double s = b[r];
+    for (int c = r + 1; c < n; c++) s -= a[r * n + c] * b[c];
+    b[r] = s / a[r * n + r];
+  }
+  return true;
+}
+
+/* Evaluate the knot spline at a PWM value */
+static double evalSpline(const std::vector<double> &knots, double pwm) {
+  int i = (int)(pwm / knotStep);
+  if (i >= (int)knots.size() - 1) i = (int)knots.size() - 2;
+  double t = (pwm - i * knotStep) / knotStep;
+  return knots[i] + (knots[i + 1] - knots[i]) * t;
+}
+
+/* Least-squares spline over the used samples */
+static bool fitSpline(const std::vector<Sample> &s, std::vector<double> &knots) {
+  int n = (int)knots.size();
+  std::vector<double> a(n * n, 0.0);
+  std::vector<double> b(n, 0.0);
+
+  /* Data term: each sample touches its two neighbouring knots */
+  for (const Sample &x : s) {
+    if (!x.used) continue;
+    int i = x.pwm / knotStep;
+    if (i >= n - 1) i = n - 2;
+    double t = (double)(x.pwm - i * knotStep) / knotStep;
+    double w0 = 1.0 - t;
+    double w1 = t;
+    a[i * n + i] += w0 * w0;
+    a[i * n + i + 1] += w0 * w1;
+    a[(i + 1) * n + i] += w0 * w1;
+    a[(i + 1) * n + i + 1] += w1 * w1;
+    b[i] += w0 * x.rpm;
+    b[i + 1] += w1 * x.rpm;
+  }
+
+  /* Smoothness term: lambda * (k[i-1] - 2 k[i] + k[i+1])^2 */
+  for (int i = 1; i < n - 1; i++) {
+    const int idx[3] = {i - 1, i, i + 1};
+    const double c[3] = {1.0, -2.0, 1.0};
+    for (int r = 0; r < 3; r++) {
+      for (int q = 0; q < 3; q++) {
+        a[idx[r] * n + idx[q]] += lambda * c[r] * c[q];
+      }
+    }
+  }
+
+  if (!solve(a, b, n)) return false;
+  knots = b;
+  return true;
+}
+
+/* Pool adjacent violators: make knot values non-decreasing */
+static void makeMonotone(std::vector<double> &k) {
+  std::vector<double> val;
+  std::vector<int> cnt;
+  for (double v : k) {
+    val.push_back(v);
+    cnt.push_back(1);
+    while (val.size() > 1 && val[val.size() - 2] > val.back()) {
+      double v1 = val.back();
+      int c1 = cnt.back();
+      val.pop_back();
+      cnt.pop_back();
+      val.back() = (val.back() * cnt.back() + v1 * c1) / (cnt.back() + c1);
+      cnt.back() += c1;
+    }
+  }
+  size_t o = 0;
+  for (size_t i = 0; i < val.size(); i++) {
+    for (int j = 0; j < cnt[i]; j++) k[o++] = val[i];
+  }
+  for (double &v : k) {
+    if (v < 0) v = 0;
+  }
+}
+
+static double median(std::vector<double> v) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  size_t m = v.size() / 2;
+  return (v.size() & 1) ? v[m] : 0.5 * (v[m - 1] + v[m]);
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+      maxErrRpm = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "-k") && i + 1 < argc) {
+      knotStep = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+      lambda = atof(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+  if (knotStep < 1 || knotStep > 64 || maxErrRpm <= 0 || lambda < 0) usage();
+
+  std::vector<Sample> samples;
+  if (!readSamples(samples)) return 1;
+  if (samples.size() < 2) {
+    fprintf(stderr, "calFit: need at least 2 samples\n");
+    return 1;
+  }
+
+  /* Knots cover 0..255 */
+  int knotCount = (255 + knotStep - 1) / knotStep + 1;
+  std::vector<double> knots(knotCount, 0.0);
+
+  /* Fit, reject, refit until the used set is stable */
+  int rejected = 0;
+  for (int iter = 0; iter < 20; iter++) {
+    if (!fitSpline(samples, knots)) {
+      fprintf(stderr, "calFit: fit is singular (too few samples?)\n");
+      return 1;
+    }
+
+    std::vector<double> absRes;
+    for (const Sample &x : samples) {
+      if (x.used) absRes.push_back(fabs(x.rpm - evalSpline(knots, x.pwm)));
+    }
+    double sigma = 1.4826 * median(absRes);
+    double limit = std::max(rejectSigmas * sigma, rejectFloorRpm);
+
+    int changed = 0;
+    for (Sample &x : samples) {
+      bool keep = fabs(x.rpm - evalSpline(knots, x.pwm)) <= limit;
+      if (keep != x.used) {
+        x.used = keep;
+        changed++;
+      }
+    }
+    if (changed == 0) break;
+  }
+  for (const Sample &x : samples) {
+    if (!x.used) rejected++;
+  }
+
+  makeMonotone(knots);
+
+  /* Smooth curve at every PWM value */
+  double curve[256];
+  for (int p = 0; p < 256; p++) curve[p] = evalSpline(knots, p);
+
+  /* Residual statistics of the final fit */
+  double sumSq = 0;
+  int used = 0;
+  for (const Sample &x : samples) {
+    if (!x.used) continue;
+    double r = x.rpm - curve[x.pwm];
+    sumSq += r * r;
+    used++;
+  }
+
+  /* Coarsest power-of-two grid within the error bound */
+  int shift = 0;
+  double tableErr = 0;
+  std::vector<int> table;
+  for (int s = 7; s >= 0; s--) {
+    int step = 1 << s;
+    int n = (256 >> s) + 1;
+    std::vector<int> t(n);
+    for (int i = 0; i < n; i++) {
+      int p = std::min(i * step, 255);
+      t[i] = (int)lround(curve[p]);
+    }
+    /* Keep the grid monotone after rounding */
+    for (int i = 1; i < n; i++) t[i] = std::max(t[i], t[i - 1]);
+
+    double worst = 0;
+    for (int p = 0; p < 256; p++) {
+      int i = p >> s;
+      int frac = p & (step - 1);
+      long y = t[i] + (((long)(t[i + 1] - t[i]) * frac) >> s);
+      worst = std::max(worst, fabs(y - curve[p]));
+    }
+    if (worst <= maxErrRpm || s == 0) {
+      shift = s;
+      table = t;
+      tableErr = worst;
+      break;
+    }
+  }
+
+  fprintf(stderr, "calFit: %d samples, %d rejected, rms %.1f rpm\n",
+          (int)samples.size(), rejected, sqrt(sumSq / std::max(used, 1)));
+  fprintf(stderr, "calFit: %d entries (shift %d), max table error %.1f rpm\n",
+          (int)table.size(), shift, tableErr);
+
+  /* Emit the firmware table */
+  printf("/* Generated by host/calFit (-b %g -k %d -l %g): %d samples, %d rejected */\n",
+         maxErrRpm, knotStep, lambda, (int)samples.size(), rejected);
+  printf("const int CAL_SHIFT = %d;\n", shift);
+  printf("const int CAL_N = %d;\n", (int)table.size());
+  printf("const int rpmCal[CAL_N] PROGMEM = {");
+  for (size_t i = 0; i < table.size(); i++) {
+    if (i % 9 == 0) printf("\n ");
+    printf(" %4d", table[i]);
+    if (i + 1 < table.size()) printf(",");
+  }
+  printf("\n};\n");
+  return 0;
+}
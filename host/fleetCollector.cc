@@ -0,0 +1,487 @@
+/*
+  Fleet collector (host side, Linux)
+
+  Polls many spin coaters over Modbus RTU (USE_MODBUS build) and writes a
+  columnar log per unit.
+
+  Build
+    g++ -O2 -pthread -o fleetCollector host/fleetCollector.cc
+
+  Usage
+    fleetCollector [-r hz] [-t seconds] [-o outdir] [-a addr] dev...
+    fleetCollector [-r hz] [-t seconds] [-o outdir] -s units
+    fleetCollector -d file.col
+
+  - dev...    serial ports, one unit each (115200 8N1)
+  - -s units  simulate that many units on pseudo-terminals instead
+  - -d file   dump a column log as CSV
+
+  Polling
+  - Every unit has at most one request in flight; all units run at once
+    from a single epoll loop, so the fleet rate is bounded by the link,
+    not by round trips added up over units
+  - Each poll reads the input register block (FC 04) defined by
+    modbusInputRegs[] in fanControl.cc
+  - A unit that misses its slot skips it (counted as overrun) instead of
+    building a backlog
+
+  Column log
+  - File <outdir>/unitN.col: blocks of up to LOG_BLOCK_ROWS rows
+  - Block: "SCB1", u16 rows, then each column as rows little-endian values
+    (time_ms as u32, registers as u16)
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+/* Input register block, order as in fanControl.cc */
+static const char *const regNames[] = {
+  "running", "dipWaiting", "step", "rpm", "remainingLo", "remainingHi",
+  "driftQ4", "driftJobs", "frames", "errors"
+};
+static const int REG_COUNT = sizeof(regNames) / sizeof(regNames[0]);
+
+static const int LOG_BLOCK_ROWS = 1024;
+/* Reply must arrive within this (T3.5 + frame time + slack) */
+static const int64_t REPLY_TIMEOUT_US = 20000;
+
+/* CRC-16/MODBUS */
+static uint16_t crcTable[256];
+
+static void initCrc() {
+  for (int i = 0; i < 256; i++) {
+    uint16_t c = (uint16_t)i;
+    for (int b = 0; b < 8; b++) c = (c & 1) ? (uint16_t)((c >> 1) ^ 0xA001) : (uint16_t)(c >> 1);
+    crcTable[i] = c;
+  }
+}
+
+static uint16_t crc16(const uint8_t *p, size_t n) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < n; i++) crc = (uint16_t)((crc >> 8) ^ crcTable[(crc ^ p[i]) & 0xFF]);
+  return crc;
+}
+
+static int64_t nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool setRaw(int fd) {
+  struct termios tio;
+  if (tcgetattr(fd, &tio) != 0) return false;
+  cfmakeraw(&tio);
+  cfsetispeed(&tio, B115200);
+  cfsetospeed(&tio, B115200);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+/* Column log writer */
+struct ColumnLog {
+  FILE *f = nullptr;
+  std::vector<uint32_t> timeMs;
+  std::vector<uint16_t> regs[REG_COUNT];
+
+  bool open(const std::string &path) {
+    f = fopen(path.c_str(), "wb");
+    return f != nullptr;
+  }
+
+  void flush() {
+    uint16_t rows = (uint16_t)timeMs.size();
+    if (!f || rows == 0) return;
+    fwrite("SCB1", 1, 4, f);
+    fwrite(&rows, sizeof(rows), 1, f);
+    fwrite(timeMs.data(), sizeof(uint32_t), rows, f);
+    for (int r = 0; r < REG_COUNT; r++) {
+      fwrite(regs[r].data(), sizeof(uint16_t), rows, f);
+      regs[r].clear();
+    }
+    timeMs.clear();
+  }
+
+  void append(uint32_t t, const uint16_t *v) {
+    timeMs.push_back(t);
+    for (int r = 0; r < REG_COUNT; r++) regs[r].push_back(v[r]);
+    if ((int)timeMs.size() >= LOG_BLOCK_ROWS) flush();
+  }
+
+  void close() {
+    flush();
+    if (f) fclose(f);
+    f = nullptr;
+  }
+};
+
+/* One polled unit */
+struct Unit {
+  std::string dev;
+  int fd = -1;
+  bool waiting = false;
+  int64_t sentUs = 0;
+  int64_t nextPollUs = 0;
+  uint8_t rx[256];
+  size_t rxLen = 0;
+  ColumnLog log;
+
+  /* Stats */
+  uint64_t polls = 0;
+  uint64_t replies = 0;
+  uint64_t timeouts = 0;
+  uint64_t badFrames = 0;
+  uint64_t overruns = 0;
+  int64_t latencySumUs = 0;
+  int64_t latencyMaxUs = 0;
+};
+
+/* ------------------------------------------------------------------ */
+/* Simulated firmware: Modbus slave on the master side of a pty       */
+
+struct SimUnit {
+  int masterFd;
+  int index;
+  volatile bool *stop;
+};
+
+static void *simThread(void *arg) {
+  SimUnit *sim = (SimUnit *)arg;
+  uint8_t buf[256];
+  size_t len = 0;
+  uint16_t frames = 0;
+  int64_t startUs = nowUs();
+
+  while (!*sim->stop) {
+    struct timespec ts = {0, 200000};
+    ssize_t n = read(sim->masterFd, buf + len, sizeof(buf) - len);
+    if (n <= 0) {
+      nanosleep(&ts, nullptr);
+      continue;
+    }
+    len += (size_t)n;
+
+    /* Requests we answer are always 8 bytes (FC 04) */
+    while (len >= 8) {
+      if (crc16(buf, 8) != 0 || buf[1] != 0x04) {
+        /* Resync: drop one byte */
+        memmove(buf, buf + 1, --len);
+        continue;
+      }
+      uint16_t addr = (uint16_t)((buf[2] << 8) | buf[3]);
+      uint16_t count = (uint16_t)((buf[4] << 8) | buf[5]);
+      uint8_t slave = buf[0];
+      memmove(buf, buf + 8, len - 8);
+      len -= 8;
+      frames++;
+
+      /* Synthetic controller: running, RPM wobbling around a setpoint */
+      double t = (nowUs() - startUs) / 1e6;
+      uint16_t regs[REG_COUNT];
+      memset(regs, 0, sizeof(regs));
+      regs[0] = 1;
+      regs[2] = (uint16_t)((int)(t / 10) % 3);
+      regs[3] = (uint16_t)(2000 + 300 * sim->index % 1000 + (int)(50 * sin(t * 6.28)));
+      regs[4] = (uint16_t)(600 - ((int)t % 600));
+      regs[7] = (uint16_t)sim->index;
+      regs[8] = frames;
+
+      uint8_t out[64];
+      size_t o = 0;
+      out[o++] = slave;
+      if (addr + count > REG_COUNT || count == 0) {
+        out[o++] = 0x84;
+        out[o++] = 0x02;
+      } else {
+        out[o++] = 0x04;
+        out[o++] = (uint8_t)(count * 2);
+        for (int i = 0; i < count; i++) {
+          out[o++] = (uint8_t)(regs[addr + i] >> 8);
+          out[o++] = (uint8_t)(regs[addr + i] & 0xFF);
+        }
+      }
+      uint16_t crc = crc16(out, o);
+      out[o++] = (uint8_t)(crc & 0xFF);
+      out[o++] = (uint8_t)(crc >> 8);
+      if (write(sim->masterFd, out, o) != (ssize_t)o) break;
+    }
+  }
+  return nullptr;
+}
+
+/* ------------------------------------------------------------------ */
+
+static void sendPoll(Unit &u, uint8_t slave, int64_t t) {
+  uint8_t req[8] = {slave, 0x04, 0, 0, 0, (uint8_t)REG_COUNT, 0, 0};
+  uint16_t crc = crc16(req, 6);
+  req[6] = (uint8_t)(crc & 0xFF);
+  req[7] = (uint8_t)(crc >> 8);
+
+  /* Stale bytes from a timed-out reply */
+  u.rxLen = 0;
+  tcflush(u.fd, TCIFLUSH);
+
+  if (write(u.fd, req, sizeof(req)) != (ssize_t)sizeof(req)) {
+    u.badFrames++;
+    return;
+  }
+  u.waiting = true;
+  u.sentUs = t;
+  u.polls++;
+}
+
+/* Expected reply length, 0 if not known yet */
+static size_t replyLength(const uint8_t *p, size_t len) {
+  if (len < 3) return 0;
+  if (p[1] & 0x80) return 5;
+  return 5 + p[2];
+}
+
+static void handleReadable(Unit &u, int64_t t0) {
+  ssize_t n = read(u.fd, u.rx + u.rxLen, sizeof(u.rx) - u.rxLen);
+  if (n <= 0) return;
+  u.rxLen += (size_t)n;
+  if (!u.waiting) {
+    /* Unsolicited bytes */
+    u.rxLen = 0;
+    return;
+  }
+
+  size_t need = replyLength(u.rx, u.rxLen);
+  if (need == 0 || u.rxLen < need) return;
+
+  int64_t t = nowUs();
+  u.waiting = false;
+
+  if (crc16(u.rx, need) != 0 || (u.rx[1] & 0x80) || u.rx[2] != REG_COUNT * 2) {
+    u.badFrames++;
+    u.rxLen = 0;
+    return;
+  }
+
+  uint16_t regs[REG_COUNT];
+  for (int i = 0; i < REG_COUNT; i++) {
+    regs[i] = (uint16_t)((u.rx[3 + i * 2] << 8) | u.rx[4 + i * 2]);
+  }
+  u.log.append((uint32_t)((t - t0) / 1000), regs);
+
+  int64_t lat = t - u.sentUs;
+  u.latencySumUs += lat;
+  if (lat > u.latencyMaxUs) u.latencyMaxUs = lat;
+  u.replies++;
+  u.rxLen = 0;
+}
+
+static int dumpLog(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return 1;
+  }
+  printf("time_ms");
+  for (int r = 0; r < REG_COUNT; r++) printf(",%s", regNames[r]);
+  printf("\n");
+
+  char magic[4];
+  uint16_t rows;
+  while (fread(magic, 1, 4, f) == 4 && fread(&rows, sizeof(rows), 1, f) == 1) {
+    if (memcmp(magic, "SCB1", 4) != 0) {
+      fprintf(stderr, "%s: bad block\n", path);
+      fclose(f);
+      return 1;
+    }
+    std::vector<uint32_t> t(rows);
+    std::vector<std::vector<uint16_t>> cols(REG_COUNT, std::vector<uint16_t>(rows));
+    bool ok = fread(t.data(), sizeof(uint32_t), rows, f) == rows;
+    for (int r = 0; ok && r < REG_COUNT; r++) {
+      ok = fread(cols[r].data(), sizeof(uint16_t), rows, f) == rows;
+    }
+    if (!ok) {
+      fprintf(stderr, "%s: truncated block\n", path);
+      break;
+    }
+    for (int i = 0; i < rows; i++) {
+      printf("%u", t[i]);
+      for (int r = 0; r < REG_COUNT; r++) printf(",%u", cols[r][i]);
+      printf("\n");
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: fleetCollector [-r hz] [-t seconds] [-o outdir] [-a addr] dev...\n"
+          "       fleetCollector [-r hz] [-t seconds] [-o outdir] -s units\n"
+          "       fleetCollector -d file.col\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  double rateHz = 100.0;
+  double seconds = 10.0;
+  std::string outDir = ".";
+  int slave = 1;
+  int simCount = 0;
+  std::vector<std::string> devs;
+
+  initCrc();
+
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if (a == "-r" && i + 1 < argc) {
+      rateHz = atof(argv[++i]);
+    } else if (a == "-t" && i + 1 < argc) {
+      seconds = atof(argv[++i]);
+    } else if (a == "-o" && i + 1 < argc) {
+      outDir = argv[++i];
+    } else if (a == "-a" && i + 1 < argc) {
+      slave = atoi(argv[++i]);
+    } else if (a == "-s" && i + 1 < argc) {
+      simCount = atoi(argv[++i]);
+    } else if (a == "-d" && i + 1 < argc) {
+      return dumpLog(argv[++i]);
+    } else if (a[0] == '-') {
+      usage();
+    } else {
+      devs.push_back(a);
+    }
+  }
+  if (rateHz <= 0 || seconds <= 0 || slave < 1 || slave > 247) usage();
+  if (devs.empty() && simCount <= 0) usage();
+
+  /* Simulated units on pseudo-terminals */
+  volatile bool simStop = false;
+  std::vector<SimUnit> sims(simCount);
+  std::vector<pthread_t> simThreads(simCount);
+  for (int i = 0; i < simCount; i++) {
+    int m = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (m < 0 || grantpt(m) != 0 || unlockpt(m) != 0) {
+      perror("posix_openpt");
+      return 1;
+    }
+    devs.push_back(ptsname(m));
+    sims[i] = SimUnit{m, i, &simStop};
+  }
+
+  mkdir(outDir.c_str(), 0755);
+
+  int ep = epoll_create1(0);
+  if (ep < 0) {
+    perror("epoll_create1");
+    return 1;
+  }
+
+  std::vector<Unit> units(devs.size());
+  for (size_t i = 0; i < devs.size(); i++) {
+    Unit &u = units[i];
+    u.dev = devs[i];
+    u.fd = open(u.dev.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (u.fd < 0 || !setRaw(u.fd)) {
+      perror(u.dev.c_str());
+      return 1;
+    }
+    std::string path = outDir + "/unit" + std::to_string(i) + ".col";
+    if (!u.log.open(path)) {
+      perror(path.c_str());
+      return 1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = (uint32_t)i;
+    epoll_ctl(ep, EPOLL_CTL_ADD, u.fd, &ev);
+  }
+
+  /* Slave ends are raw now; start the simulators */
+  for (int i = 0; i < simCount; i++) {
+    pthread_create(&simThreads[i], nullptr, simThread, &sims[i]);
+  }
+
+  int64_t periodUs = (int64_t)(1e6 / rateHz);
+  int64_t t0 = nowUs();
+  int64_t endUs = t0 + (int64_t)(seconds * 1e6);
+
+  /* Spread the first polls over one period */
+  for (size_t i = 0; i < units.size(); i++) {
+    units[i].nextPollUs = t0 + (int64_t)(periodUs * i / units.size());
+  }
+
+  struct epoll_event events[64];
+  for (;;) {
+    int64_t t = nowUs();
+    if (t >= endUs) break;
+
+    /* Timeouts and due polls; find the next deadline */
+    int64_t nextUs = endUs;
+    for (Unit &u : units) {
+      if (u.waiting && t - u.sentUs >= REPLY_TIMEOUT_US) {
+        u.waiting = false;
+        u.timeouts++;
+      }
+      if (!u.waiting && t >= u.nextPollUs) {
+        /* Missed slots are skipped, not queued */
+        while (u.nextPollUs + periodUs <= t) {
+          u.nextPollUs += periodUs;
+          u.overruns++;
+        }
+        u.nextPollUs += periodUs;
+        sendPoll(u, (uint8_t)slave, t);
+      }
+      int64_t due = u.waiting ? u.sentUs + REPLY_TIMEOUT_US : u.nextPollUs;
+      if (due < nextUs) nextUs = due;
+    }
+
+    int waitMs = (int)((nextUs - nowUs() + 999) / 1000);
+    if (waitMs < 0) waitMs = 0;
+    int n = epoll_wait(ep, events, 64, waitMs);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      handleReadable(units[events[i].data.u32], t0);
+    }
+  }
+
+  double elapsed = (nowUs() - t0) / 1e6;
+  simStop = true;
+  for (int i = 0; i < simCount; i++) pthread_join(simThreads[i], nullptr);
+
+  /* Report */
+  uint64_t totalReplies = 0;
+  printf("%-16s %8s %8s %8s %6s %6s %8s %8s %8s\n", "unit", "polls", "replies", "Hz",
+         "tmo", "bad", "overrun", "lat_us", "max_us");
+  for (Unit &u : units) {
+    u.log.close();
+    close(u.fd);
+    totalReplies += u.replies;
+    printf("%-16s %8llu %8llu %8.1f %6llu %6llu %8llu %8lld %8lld\n", u.dev.c_str(),
+           (unsigned long long)u.polls, (unsigned long long)u.replies, u.replies / elapsed,
+           (unsigned long long)u.timeouts, (unsigned long long)u.badFrames,
+           (unsigned long long)u.overruns,
+           (long long)(u.replies ? u.latencySumUs / (int64_t)u.replies : 0),
+           (long long)u.latencyMaxUs);
+  }
+  printf("sustained: %zu units x %.1f Hz = %.0f samples/s (target %.0f)\n", units.size(),
+         totalReplies / elapsed / units.size(), totalReplies / elapsed, units.size() * rateHz);
+
+  for (SimUnit &s : sims) close(s.masterFd);
+  return 0;
+}
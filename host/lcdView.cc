@@ -0,0 +1,142 @@
+/*
+  LCD mirror viewer (host side, Linux)
+
+  Shows the 16x2 screen of a USE_LCD_MIRROR build of fanControl.cc,
+  rebuilt from the changed cells it sends.
+
+  Build
+    g++ -O2 -o lcdView host/lcdView.cc
+
+  Usage
+    lcdView [-p] [dev]
+
+  - dev  serial port (115200 8N1); stdin if none, e.g. a capture
+  - -p   plain: print the screen after each update instead of redrawing
+         it in place
+
+  Input
+  - Lines "L<row><col><cells>" as sent by serviceLcdMirror(); other
+    lines (telemetry, query answers) are skipped, as is text run into
+    binary telemetry frames. Until the firmware's periodic refresh has
+    come round, cells not yet seen show as '?'.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <string>
+
+/* As in fanControl.cc */
+static const int LCD_COLS = 16;
+static const int LCD_ROWS = 2;
+
+static char screen[LCD_ROWS][LCD_COLS];
+static bool plain = false;
+static unsigned long updates = 0;
+static unsigned long skipped = 0;
+
+static void usage() {
+  fprintf(stderr, "usage: lcdView [-p] [dev]\n");
+  exit(2);
+}
+
+static bool setRaw(int fd) {
+  struct termios tio;
+  if (tcgetattr(fd, &tio) != 0) return false;
+  cfmakeraw(&tio);
+  cfsetispeed(&tio, B115200);
+  cfsetospeed(&tio, B115200);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cc[VMIN] = 1;
+  tio.c_cc[VTIME] = 0;
+  return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+/* One mirror line into the screen; false if it is not one */
+static bool apply(const std::string &line) {
+  if (line.size() < 4 || line[0] != 'L') return false;
+  int row = line[1] - '0';
+  char c = line[2];
+  int col = c >= '0' && c <= '9' ? c - '0' : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+  size_t cells = line.size() - 3;
+  if (row < 0 || row >= LCD_ROWS || col < 0 || col + cells > (size_t)LCD_COLS) return false;
+  memcpy(&screen[row][col], line.data() + 3, cells);
+  return true;
+}
+
+static void draw() {
+  if (plain) {
+    for (int r = 0; r < LCD_ROWS; r++) printf("|%.*s|\n", LCD_COLS, screen[r]);
+    printf("\n");
+    return;
+  }
+  /* Home, then the frame over the last one */
+  printf("\033[H+----------------+\n");
+  for (int r = 0; r < LCD_ROWS; r++) printf("|%.*s|\n", LCD_COLS, screen[r]);
+  printf("+----------------+\n%lu updates, %lu other lines\033[K\n", updates, skipped);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  const char *dev = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-p")) {
+      plain = true;
+    } else if (argv[i][0] == '-' || dev) {
+      usage();
+    } else {
+      dev = argv[i];
+    }
+  }
+
+  int fd = 0;
+  if (dev) {
+    fd = open(dev, O_RDONLY | O_NOCTTY);
+    if (fd < 0) {
+      perror(dev);
+      return 1;
+    }
+    if (!setRaw(fd)) {
+      fprintf(stderr, "lcdView: %s: not a serial port\n", dev);
+      return 1;
+    }
+  }
+
+  memset(screen, '?', sizeof(screen));
+  if (!plain) printf("\033[2J");
+
+  std::string line;
+  char buf[512];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    bool changed = false;
+    for (ssize_t i = 0; i < n; i++) {
+      unsigned char c = (unsigned char)buf[i];
+      if (c == '\n') {
+        if (apply(line)) {
+          updates++;
+          changed = true;
+          if (plain) draw();
+        } else if (!line.empty()) {
+          skipped++;
+        }
+        line.clear();
+      } else if (c == '\r') {
+        continue;
+      } else if (c < 0x20 || c > 0x7E) {
+        /* Binary telemetry: a mirror line can only start after it */
+        line.clear();
+      } else {
+        line += (char)c;
+      }
+    }
+    /* Once per read, so a burst is one redraw */
+    if (changed && !plain) draw();
+  }
+  if (!plain) printf("\n");
+  return 0;
+}
@@ -0,0 +1,239 @@
+/*
+  Profile symboliser (host side)
+
+  Reads the profile dumps of a USE_PROFILER build of fanControl.cc and
+  prints a flat profile by function, against the ELF the board runs.
+
+  Build
+    g++ -O2 -o profSym host/profSym.cc
+
+  Usage
+    profSym [-n top] firmware.elf < capture.txt
+
+  Input
+  - The serial capture; lines other than the profiler's are skipped, so
+    telemetry may be mixed in. Dumps are summed.
+    P# <shift> <bins> <ms> <outside> [<loop_us_mean> <loop_us_max>]
+    P <bin> <count>
+    P.
+
+  Method
+  - Functions (and other sized text symbols) come from the ELF's symbol
+    table; names are demangled.
+  - A bin is 2^shift bytes of flash. A bin that holds parts of several
+    functions gives each a share by the bytes it holds of it, so small
+    functions next to hot ones can pick up a few samples; the printed
+    bin width says how fine that is.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <cxxabi.h>
+
+struct Symbol {
+  uint32_t addr;
+  uint32_t size;
+  std::string name;
+  double samples;
+};
+
+static void usage() {
+  fprintf(stderr, "usage: profSym [-n top] firmware.elf < capture.txt\n");
+  exit(2);
+}
+
+static uint16_t get16(const std::vector<uint8_t> &f, size_t off) {
+  return (uint16_t)(f[off] | (f[off + 1] << 8));
+}
+
+static uint32_t get32(const std::vector<uint8_t> &f, size_t off) {
+  return (uint32_t)get16(f, off) | ((uint32_t)get16(f, off + 2) << 16);
+}
+
+static std::string demangle(const char *name) {
+  int status = 0;
+  char *d = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+  if (status != 0 || !d) return name;
+  std::string s = d;
+  free(d);
+  return s;
+}
+
+/* Sized FUNC and NOTYPE symbols of the text section, by address
+   (ELF32 little-endian, as avr-gcc writes it) */
+static bool readSymbols(const char *path, std::vector<Symbol> &out) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return false;
+  }
+  std::vector<uint8_t> f;
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) f.insert(f.end(), buf, buf + n);
+  fclose(fp);
+
+  if (f.size() < 52 || memcmp(f.data(), "\x7f" "ELF", 4) != 0 || f[4] != 1 || f[5] != 1) {
+    fprintf(stderr, "%s: not a 32-bit little-endian ELF\n", path);
+    return false;
+  }
+
+  uint32_t shoff = get32(f, 32);
+  uint16_t shentsize = get16(f, 46);
+  uint16_t shnum = get16(f, 48);
+  if (shoff + (size_t)shnum * shentsize > f.size()) {
+    fprintf(stderr, "%s: truncated\n", path);
+    return false;
+  }
+
+  for (uint16_t i = 0; i < shnum; i++) {
+    size_t sh = shoff + (size_t)i * shentsize;
+    /* SHT_SYMTAB */
+    if (get32(f, sh + 4) != 2) continue;
+
+    uint32_t symOff = get32(f, sh + 16);
+    uint32_t symSize = get32(f, sh + 20);
+    uint32_t link = get32(f, sh + 24);
+    uint32_t entSize = get32(f, sh + 36);
+    size_t strSh = shoff + (size_t)link * shentsize;
+    uint32_t strOff = get32(f, strSh + 16);
+    uint32_t strSize = get32(f, strSh + 20);
+    if (entSize < 16 || symOff + symSize > f.size() || strOff + strSize > f.size()) break;
+
+    for (uint32_t s = 0; s + entSize <= symSize; s += entSize) {
+      size_t e = symOff + s;
+      uint32_t nameOff = get32(f, e);
+      uint32_t value = get32(f, e + 4);
+      uint32_t size = get32(f, e + 8);
+      uint8_t type = f[e + 12] & 0x0F;
+      uint16_t shndx = get16(f, e + 14);
+      /* STT_NOTYPE or STT_FUNC, in a real section; data lives above
+         0x800000 in AVR ELFs */
+      if ((type != 0 && type != 2) || size == 0 || shndx == 0 || shndx >= 0xFF00) continue;
+      if (value >= 0x800000 || nameOff >= strSize) continue;
+
+      const char *name = (const char *)&f[strOff + nameOff];
+      out.push_back({value, size, demangle(name), 0.0});
+    }
+    break;
+  }
+
+  if (out.empty()) {
+    fprintf(stderr, "%s: no sized text symbols (stripped?)\n", path);
+    return false;
+  }
+  std::sort(out.begin(), out.end(), [](const Symbol &a, const Symbol &b) { return a.addr < b.addr; });
+  return true;
+}
+
+int main(int argc, char **argv) {
+  int top = 30;
+  const char *elfPath = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      top = atoi(argv[++i]);
+    } else if (argv[i][0] == '-') {
+      usage();
+    } else if (!elfPath) {
+      elfPath = argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (!elfPath || top <= 0) usage();
+
+  std::vector<Symbol> syms;
+  if (!readSymbols(elfPath, syms)) return 1;
+
+  /* Sum the dumps */
+  std::vector<unsigned long> bins;
+  int shift = -1;
+  int dumps = 0;
+  unsigned long outside = 0;
+  unsigned long spanMs = 0;
+  unsigned long firstMs = 0;
+  /* Loop time of the last dump that has it */
+  unsigned long loopMean = 0, loopMax = 0;
+  bool haveLoop = false;
+  char line[256];
+  while (fgets(line, sizeof(line), stdin)) {
+    int s, n;
+    unsigned long ms, out, mean, max;
+    int bin;
+    unsigned long count;
+    int fields = sscanf(line, "P# %d %d %lu %lu %lu %lu", &s, &n, &ms, &out, &mean, &max);
+    if (fields >= 4) {
+      if (shift >= 0 && s != shift) {
+        fprintf(stderr, "profSym: dumps from different builds (shift %d and %d)\n", shift, s);
+        return 1;
+      }
+      if (n <= 0 || n > 4096 || s < 0 || s > 16) continue;
+      shift = s;
+      if ((int)bins.size() < n) bins.resize(n, 0);
+      if (dumps == 0) firstMs = ms;
+      spanMs = ms - firstMs;
+      outside += out;
+      dumps++;
+      if (fields == 6) {
+        loopMean = mean;
+        loopMax = max;
+        haveLoop = true;
+      }
+    } else if (shift >= 0 && sscanf(line, "P %d %lu", &bin, &count) == 2) {
+      if (bin >= 0 && bin < (int)bins.size()) bins[bin] += count;
+    }
+  }
+  if (dumps == 0) {
+    fprintf(stderr, "profSym: no profile dumps in the input\n");
+    return 1;
+  }
+
+  /* Share each bin out by overlap */
+  double total = 0;
+  double unknown = 0;
+  uint32_t width = 1U << shift;
+  for (size_t b = 0; b < bins.size(); b++) {
+    if (!bins[b]) continue;
+    total += bins[b];
+    uint32_t lo = (uint32_t)b * width;
+    uint32_t hi = lo + width;
+
+    uint32_t covered = 0;
+    for (Symbol &sym : syms) {
+      uint32_t a = std::max(lo, sym.addr);
+      uint32_t z = std::min(hi, sym.addr + sym.size);
+      if (a < z) covered += z - a;
+    }
+    if (covered == 0) {
+      unknown += bins[b];
+      continue;
+    }
+    for (Symbol &sym : syms) {
+      uint32_t a = std::max(lo, sym.addr);
+      uint32_t z = std::min(hi, sym.addr + sym.size);
+      if (a < z) sym.samples += (double)bins[b] * (z - a) / covered;
+    }
+  }
+  total += outside;
+
+  std::sort(syms.begin(), syms.end(), [](const Symbol &a, const Symbol &b) { return a.samples > b.samples; });
+
+  printf("%d dump%s over %.1f s, %.0f samples, bin width %u bytes\n", dumps, dumps == 1 ? "" : "s",
+         spanMs / 1000.0, total, width);
+  if (haveLoop) printf("loop time %lu us mean, %lu us longest\n", loopMean, loopMax);
+  if (total == 0) return 0;
+
+  printf("  samples      %%  function\n");
+  for (int i = 0; i < top && i < (int)syms.size() && syms[i].samples > 0; i++) {
+    printf("  %7.1f  %5.1f  %s\n", syms[i].samples, 100.0 * syms[i].samples / total, syms[i].name.c_str());
+  }
+  if (unknown > 0) printf("  %7.1f  %5.1f  (no symbol)\n", unknown, 100.0 * unknown / total);
+  if (outside > 0) printf("  %7lu  %5.1f  (past the program: bootloader)\n", outside, 100.0 * outside / total);
+  return 0;
+}
@@ -0,0 +1,571 @@
+/*
+  Recipe compiler (host side)
+
+  Turns a text recipe into the RecipeData image read by fanControl.cc, so
+  the firmware only steps through integers.
+
+  Build
+    g++ -O2 -o recipeCompiler host/recipeCompiler.cc
+
+  Usage
+    recipeCompiler [-c fanControl.cc] [-o out.bin] [-x out.hex] [-p port [-a addr]] recipe.txt
+
+  - -c  firmware source to take the calibration table from
+  - -o  raw image (RecipeData, little endian)
+  - -x  Intel HEX for the EEPROM at RECIPE_ADDR (avrdude -U eeprom:w:out.hex)
+  - -p  upload over Modbus RTU (USE_MODBUS build), 115200 8N1
+
+  Recipe file
+    # comment
+    id 3                  recipe number (0..255)
+    accel 1500            fan acceleration limit, RPM/s
+    jerk 6000             corner blend limit, RPM/s^2 (optional, 0 = sharp)
+    step rpm=500 ramp=0.8 hold=5 dispense=1.25 open=150
+    step rpm=3000 ramp=2 hold=30
+
+  - rpm       target speed; must be within the calibration
+  - ramp      seconds to go from the previous step's speed (0 for the
+              first step) to this one; must respect accel, at the
+              steeper slope the firmware leaves between the blends
+  - hold      whole seconds at speed after the ramp
+  - dispense  valve open offset from the step start, seconds (optional)
+  - open      valve open time, ms (default 100)
+
+  The firmware rounds the ramp corners off with blends whose width comes
+  from jerk; a ramp too short to fit both of its blends is reported,
+  since the firmware would then exceed the limit.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+/* Must match fanControl.cc */
+static const uint8_t RECIPE_MAGIC = 0xA6;
+static const int RECIPE_ADDR = 32;
+static const int RECIPE_MAX_STEPS = 8;
+static const uint32_t DISPENSE_NONE = 0xFFFFFFFFu;
+static const int STEP_BYTES = 13;
+static const int HEADER_BYTES = 5;
+static const int IMAGE_BYTES = HEADER_BYTES + RECIPE_MAX_STEPS * STEP_BYTES;
+static const int MODBUS_RECIPE_BASE = 0x100;
+static const int MODBUS_REG_COMMAND = 5;
+static const int MODBUS_CMD_SAVE_RECIPE = 3;
+
+struct Step {
+  int line;
+  double rpm;
+  double rampSec;
+  long holdSec;
+  double dispenseSec;
+  long openMs;
+};
+
+struct Calibration {
+  int shift = -1;
+  std::vector<int> rpm;
+
+  int estimate(int pwm) const {
+    int i = pwm >> shift;
+    int frac = pwm & ((1 << shift) - 1);
+    return rpm[i] + (int)(((long)(rpm[i + 1] - rpm[i]) * frac) >> shift);
+  }
+
+  int maxRpm() const { return rpm.back(); }
+
+  /* Steepest RPM per PWM count in the table */
+  double maxSlope() const {
+    double best = 0;
+    for (size_t i = 0; i + 1 < rpm.size(); i++) {
+      best = std::max(best, (double)(rpm[i + 1] - rpm[i]) / (1 << shift));
+    }
+    return best;
+  }
+
+  /* PWM whose estimate is closest to the target */
+  int pwmFor(double target) const {
+    int best = 0;
+    for (int p = 1; p < 256; p++) {
+      if (fabs(estimate(p) - target) < fabs(estimate(best) - target)) best = p;
+    }
+    return best;
+  }
+};
+
+static bool loadCalibration(const char *path, Calibration &cal) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  std::string src;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) src.append(buf, n);
+  fclose(f);
+
+  size_t p = src.find("const int CAL_SHIFT =");
+  if (p == std::string::npos) return false;
+  cal.shift = atoi(src.c_str() + p + strlen("const int CAL_SHIFT ="));
+
+  p = src.find("rpmCal[CAL_N] PROGMEM = {");
+  if (p == std::string::npos) return false;
+  const char *c = src.c_str() + src.find('{', p) + 1;
+  while (*c && *c != '}') {
+    char *end;
+    long v = strtol(c, &end, 10);
+    if (end == c) {
+      c++;
+      continue;
+    }
+    cal.rpm.push_back((int)v);
+    c = end;
+  }
+  return cal.shift >= 0 && (int)cal.rpm.size() == (256 >> cal.shift) + 1;
+}
+
+/* All of v is a number */
+static bool parseNumber(const char *v, double &out) {
+  char *end;
+  errno = 0;
+  out = strtod(v, &end);
+  return end != v && *end == 0 && errno == 0 && std::isfinite(out);
+}
+
+/* All of v is a whole number, 0..max (larger values come back as
+   max + 1, for the range checks) */
+static bool parseWhole(const char *v, long max, long &out) {
+  double d;
+  if (!parseNumber(v, d) || d < 0 || d != floor(d)) return false;
+  out = d > max ? max + 1 : (long)d;
+  return true;
+}
+
+static bool parseRecipe(const char *path, int &id, double &accel, double &jerk,
+                        std::vector<Step> &steps) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+
+  char line[256];
+  int lineNo = 0;
+  bool ok = true;
+  while (fgets(line, sizeof(line), f)) {
+    lineNo++;
+    char *hash = strchr(line, '#');
+    if (hash) *hash = 0;
+
+    char *tok = strtok(line, " \t\r\n");
+    if (!tok) continue;
+
+    if (!strcmp(tok, "id")) {
+      char *v = strtok(nullptr, " \t\r\n");
+      id = v ? atoi(v) : -1;
+      if (id < 0 || id > 255) {
+        fprintf(stderr, "%s:%d: id must be 0..255\n", path, lineNo);
+        ok = false;
+      }
+    } else if (!strcmp(tok, "accel")) {
+      char *v = strtok(nullptr, " \t\r\n");
+      if (!v || !parseNumber(v, accel)) accel = 0;
+      if (accel <= 0) {
+        fprintf(stderr, "%s:%d: accel must be positive\n", path, lineNo);
+        ok = false;
+      }
+    } else if (!strcmp(tok, "jerk")) {
+      char *v = strtok(nullptr, " \t\r\n");
+      if (!v || !parseNumber(v, jerk)) jerk = -1;
+      if (jerk < 0) {
+        fprintf(stderr, "%s:%d: jerk must be 0 or positive\n", path, lineNo);
+        ok = false;
+      }
+    } else if (!strcmp(tok, "step")) {
+      Step s = {lineNo, -1, 0, -1, -1, 100};
+      bool valuesOk = true;
+      while ((tok = strtok(nullptr, " \t\r\n")) != nullptr) {
+        char *eq = strchr(tok, '=');
+        if (!eq) {
+          fprintf(stderr, "%s:%d: expected key=value, got '%s'\n", path, lineNo, tok);
+          ok = false;
+          continue;
+        }
+        *eq = 0;
+        const char *v = eq + 1;
+        bool valueOk = true;
+        if (!strcmp(tok, "rpm")) {
+          valueOk = parseNumber(v, s.rpm);
+        } else if (!strcmp(tok, "ramp")) {
+          valueOk = parseNumber(v, s.rampSec);
+        } else if (!strcmp(tok, "hold")) {
+          valueOk = parseWhole(v, 65535, s.holdSec);
+        } else if (!strcmp(tok, "dispense")) {
+          valueOk = parseNumber(v, s.dispenseSec);
+        } else if (!strcmp(tok, "open")) {
+          valueOk = parseWhole(v, 65535, s.openMs);
+        } else {
+          fprintf(stderr, "%s:%d: unknown key '%s'\n", path, lineNo, tok);
+          ok = false;
+          continue;
+        }
+        if (!valueOk) {
+          fprintf(stderr, "%s:%d: %s=%s is not %s\n", path, lineNo, tok, v,
+                  !strcmp(tok, "hold") ? "whole seconds" : !strcmp(tok, "open") ? "whole ms" : "a number");
+          ok = false;
+          valuesOk = false;
+        }
+      }
+      if (valuesOk && (s.rpm < 0 || s.holdSec < 0)) {
+        fprintf(stderr, "%s:%d: step needs rpm= and hold=\n", path, lineNo);
+        ok = false;
+      }
+      steps.push_back(s);
+    } else {
+      fprintf(stderr, "%s:%d: unknown directive '%s'\n", path, lineNo, tok);
+      ok = false;
+    }
+  }
+  fclose(f);
+  return ok;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)(v & 0xFF);
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, (uint16_t)(v & 0xFFFF));
+  put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static bool writeHex(const char *path, const uint8_t *img, int len) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  for (int off = 0; off < len; off += 16) {
+    int n = len - off < 16 ? len - off : 16;
+    int addr = RECIPE_ADDR + off;
+    uint8_t sum = (uint8_t)(n + (addr >> 8) + (addr & 0xFF));
+    fprintf(f, ":%02X%04X00", n, addr);
+    for (int i = 0; i < n; i++) {
+      fprintf(f, "%02X", img[off + i]);
+      sum = (uint8_t)(sum + img[off + i]);
+    }
+    fprintf(f, "%02X\n", (uint8_t)(-sum));
+  }
+  fprintf(f, ":00000001FF\n");
+  fclose(f);
+  return true;
+}
+
+/* Modbus RTU master, just enough for the upload */
+static uint16_t crc16(const uint8_t *p, size_t n) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < n; i++) {
+    crc ^= p[i];
+    for (int b = 0; b < 8; b++) crc = (crc & 1) ? (uint16_t)((crc >> 1) ^ 0xA001) : (uint16_t)(crc >> 1);
+  }
+  return crc;
+}
+
+static bool modbusTransact(int fd, std::vector<uint8_t> req, std::vector<uint8_t> &reply) {
+  uint16_t crc = crc16(req.data(), req.size());
+  req.push_back((uint8_t)(crc & 0xFF));
+  req.push_back((uint8_t)(crc >> 8));
+
+  tcflush(fd, TCIOFLUSH);
+  if (write(fd, req.data(), req.size()) != (ssize_t)req.size()) return false;
+
+  /* Reply ends with 5 ms of silence (T3.5 is 1.75 ms); give up after 500 ms */
+  reply.clear();
+  uint8_t buf[256];
+  int quietMs = 0;
+  for (int ms = 0; ms < 500; ms++) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n > 0) {
+      reply.insert(reply.end(), buf, buf + n);
+      quietMs = 0;
+    } else if (!reply.empty() && ++quietMs >= 5) {
+      break;
+    }
+    usleep(1000);
+  }
+
+  if (reply.size() < 5 || crc16(reply.data(), reply.size()) != 0) {
+    fprintf(stderr, "recipeCompiler: no valid reply\n");
+    return false;
+  }
+  if (reply[1] & 0x80) {
+    fprintf(stderr, "recipeCompiler: exception %d%s\n", reply[2],
+            reply[2] == 6 ? " (unit busy: stop the job first)" : "");
+    return false;
+  }
+  return true;
+}
+
+static bool upload(const char *port, int slave, const uint8_t *img) {
+  int fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    perror(port);
+    return false;
+  }
+  struct termios tio;
+  tcgetattr(fd, &tio);
+  cfmakeraw(&tio);
+  cfsetispeed(&tio, B115200);
+  cfsetospeed(&tio, B115200);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tcsetattr(fd, TCSANOW, &tio);
+
+  const int words = (IMAGE_BYTES + 1) / 2;
+  const int chunk = 32;
+  std::vector<uint8_t> reply;
+  bool ok = true;
+
+  /* Image, big-endian word per register */
+  for (int w = 0; ok && w < words; w += chunk) {
+    int n = words - w < chunk ? words - w : chunk;
+    int reg = MODBUS_RECIPE_BASE + w;
+    std::vector<uint8_t> req = {(uint8_t)slave, 0x10, (uint8_t)(reg >> 8), (uint8_t)reg,
+                                0, (uint8_t)n, (uint8_t)(n * 2)};
+    for (int i = 0; i < n; i++) {
+      int b = (w + i) * 2;
+      req.push_back(img[b]);
+      req.push_back(b + 1 < IMAGE_BYTES ? img[b + 1] : 0);
+    }
+    ok = modbusTransact(fd, req, reply);
+  }
+
+  /* Save */
+  if (ok) {
+    std::vector<uint8_t> req = {(uint8_t)slave, 0x06, 0, (uint8_t)MODBUS_REG_COMMAND,
+                                0, (uint8_t)MODBUS_CMD_SAVE_RECIPE};
+    ok = modbusTransact(fd, req, reply);
+  }
+
+  /* Read back: a rejected image is replaced by the stored one */
+  if (ok) {
+    usleep(100000);
+    for (int w = 0; ok && w < words; w += chunk) {
+      int n = words - w < chunk ? words - w : chunk;
+      int reg = MODBUS_RECIPE_BASE + w;
+      std::vector<uint8_t> req = {(uint8_t)slave, 0x03, (uint8_t)(reg >> 8), (uint8_t)reg,
+                                  0, (uint8_t)n};
+      ok = modbusTransact(fd, req, reply) && reply.size() == (size_t)(5 + n * 2);
+      for (int i = 0; ok && i < n * 2 && (w * 2 + i) < IMAGE_BYTES; i++) {
+        if (reply[3 + i] != img[w * 2 + i]) {
+          fprintf(stderr, "recipeCompiler: read-back mismatch at byte %d\n", w * 2 + i);
+          ok = false;
+        }
+      }
+    }
+  }
+
+  close(fd);
+  return ok;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: recipeCompiler [-c fanControl.cc] [-o out.bin] [-x out.hex] "
+          "[-p port [-a addr]] recipe.txt\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *calPath = "fanControl.cc";
+  const char *binPath = nullptr;
+  const char *hexPath = nullptr;
+  const char *port = nullptr;
+  const char *recipePath = nullptr;
+  int slave = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      calPath = argv[++i];
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      binPath = argv[++i];
+    } else if (!strcmp(argv[i], "-x") && i + 1 < argc) {
+      hexPath = argv[++i];
+    } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+      port = argv[++i];
+    } else if (!strcmp(argv[i], "-a") && i + 1 < argc) {
+      slave = atoi(argv[++i]);
+    } else if (argv[i][0] == '-' || recipePath) {
+      usage();
+    } else {
+      recipePath = argv[i];
+    }
+  }
+  if (!recipePath || slave < 1 || slave > 247) usage();
+
+  Calibration cal;
+  if (!loadCalibration(calPath, cal)) {
+    fprintf(stderr, "recipeCompiler: no calibration table in %s\n", calPath);
+    return 1;
+  }
+
+  int id = 0;
+  double accel = 1500.0;
+  double jerk = 0;
+  std::vector<Step> steps;
+  if (!parseRecipe(recipePath, id, accel, jerk, steps)) return 1;
+
+  if (steps.empty() || (int)steps.size() > RECIPE_MAX_STEPS) {
+    fprintf(stderr, "%s: need 1..%d steps\n", recipePath, RECIPE_MAX_STEPS);
+    return 1;
+  }
+
+  uint8_t img[IMAGE_BYTES];
+  memset(img, 0, sizeof(img));
+  img[0] = RECIPE_MAGIC;
+  img[1] = (uint8_t)id;
+  img[2] = (uint8_t)steps.size();
+
+  /* Jerk in PWM terms: at the steepest part of the table a PWM slope
+     change costs the most RPM, so that sets the limit */
+  long jerkQ8 = 0;
+  if (jerk > 0) {
+    jerkQ8 = lround(jerk / cal.maxSlope() * 256.0 / 1000.0);
+    jerkQ8 = std::max(1L, std::min(jerkQ8, 65535L));
+  }
+  put16(img + 3, (uint16_t)jerkQ8);
+
+  bool ok = true;
+  int prevPwm = 0;
+  double prevRpm = 0;
+  double totalSec = 0;
+
+  printf("step   rpm  pwm  est   ramp_ms  slope_q8  hold_s  dispense_us  open_ms\n");
+  for (size_t i = 0; i < steps.size(); i++) {
+    const Step &s = steps[i];
+    const char *where = recipePath;
+
+    if (s.rpm > cal.maxRpm()) {
+      fprintf(stderr, "%s:%d: rpm %.0f above calibrated maximum %d\n", where, s.line, s.rpm,
+              cal.maxRpm());
+      ok = false;
+    }
+    if (s.holdSec > 65535 || s.rampSec < 0 || s.rampSec > 65.535) {
+      fprintf(stderr, "%s:%d: hold must be <= 65535 s, ramp 0..65.535 s\n", where, s.line);
+      ok = false;
+      continue;
+    }
+
+    int pwm = cal.pwmFor(s.rpm);
+    long rampMs = lround(s.rampSec * 1000.0);
+    long slopeQ8 = rampMs > 0 ? lround((pwm - prevPwm) * 256.0 / rampMs) : 0;
+    if (slopeQ8 > 32767 || slopeQ8 < -32768) {
+      fprintf(stderr, "%s:%d: ramp too steep for the firmware\n", where, s.line);
+      ok = false;
+      continue;
+    }
+
+    double stepSec = s.rampSec + s.holdSec;
+    uint32_t dispenseUs = DISPENSE_NONE;
+    if (s.dispenseSec >= 0) {
+      if (s.dispenseSec >= stepSec) {
+        fprintf(stderr, "%s:%d: dispense at %.3f s is past the step end (%.3f s)\n", where,
+                s.line, s.dispenseSec, stepSec);
+        ok = false;
+      } else if (s.dispenseSec + s.openMs / 1000.0 > stepSec) {
+        fprintf(stderr, "%s:%d: warning: valve still open at step end\n", where, s.line);
+      }
+      if (s.openMs < 0 || s.openMs > 65535) {
+        fprintf(stderr, "%s:%d: open must be 0..65535 ms\n", where, s.line);
+        ok = false;
+      }
+      dispenseUs = (uint32_t)lround(s.dispenseSec * 1e6);
+    }
+
+    /* The blends next to holds sit inside the ramp, which the firmware
+       steepens to still end on time (same sums as planBlends()): width w
+       with holdEnds/2 w^2 - ramp w + dPwm / jerk = 0, rounded up to
+       even, at most half the ramp */
+    int holdEnds = 0;
+    long widthMs = 0;
+    if (jerkQ8 > 0 && rampMs > 0 && pwm != prevPwm) {
+      bool chainIn = i > 0 && steps[i - 1].holdSec == 0 && steps[i - 1].rampSec > 0;
+      bool chainOut = i + 1 < steps.size() && s.holdSec == 0 && steps[i + 1].rampSec > 0;
+      holdEnds = (chainIn ? 0 : 1) + (chainOut ? 0 : 1);
+      if (holdEnds > 0) {
+        unsigned long c = (unsigned long)abs(pwm - prevPwm) * 256000UL / jerkQ8;
+        unsigned long cTerm = 2UL * holdEnds * c;
+        unsigned long sq = (unsigned long)rampMs * rampMs;
+        unsigned long root = cTerm < sq ? (unsigned long)sqrt((double)(sq - cTerm)) : 0;
+        long w = ((long)(rampMs - root) + holdEnds - 1) / holdEnds;
+        long maxMs = (rampMs / 2) & ~1L;
+        if (cTerm >= sq || w > rampMs / 2) {
+          fprintf(stderr, "%s:%d: warning: ramp %.3f s too short to blend at jerk %.0f RPM/s^2\n",
+                  where, s.line, s.rampSec, jerk);
+        }
+        widthMs = std::min((w + 1) & ~1L, maxMs);
+      }
+    }
+
+    /* Ramp feasibility against the fan's acceleration, at the slope
+       between the blends */
+    double needSec = fabs(s.rpm - prevRpm) / accel;
+    double straightSec = s.rampSec - holdEnds * (widthMs / 2) / 1000.0;
+    if (straightSec + 1e-9 < needSec) {
+      if (widthMs > 0) {
+        fprintf(stderr, "%s:%d: ramp %.3f s too short for %.0f -> %.0f RPM at %.0f RPM/s with its "
+                        "blends (%.3f s at full slope, need %.3f s)\n",
+                where, s.line, s.rampSec, prevRpm, s.rpm, accel, straightSec, needSec);
+      } else {
+        fprintf(stderr, "%s:%d: ramp %.3f s too short for %.0f -> %.0f RPM at %.0f RPM/s (need %.3f s)\n",
+                where, s.line, s.rampSec, prevRpm, s.rpm, accel, needSec);
+      }
+      ok = false;
+    }
+
+    uint8_t *p = img + HEADER_BYTES + i * STEP_BYTES;
+    p[0] = (uint8_t)pwm;
+    put16(p + 1, (uint16_t)rampMs);
+    put16(p + 3, (uint16_t)(int16_t)slopeQ8);
+    put16(p + 5, (uint16_t)s.holdSec);
+    put32(p + 7, dispenseUs);
+    put16(p + 11, (uint16_t)(dispenseUs == DISPENSE_NONE ? 0 : s.openMs));
+
+    printf("%4zu %5.0f  %3d %4d  %8ld  %8ld  %6ld  %11s  %7ld\n", i + 1, s.rpm, pwm,
+           cal.estimate(pwm), rampMs, slopeQ8, s.holdSec,
+           dispenseUs == DISPENSE_NONE ? "-" : std::to_string(dispenseUs).c_str(),
+           dispenseUs == DISPENSE_NONE ? 0 : s.openMs);
+
+    prevPwm = pwm;
+    prevRpm = s.rpm;
+    totalSec += stepSec;
+  }
+  if (!ok) return 1;
+
+  printf("recipe %d: %zu steps, %.3f s, %d bytes\n", id, steps.size(), totalSec, IMAGE_BYTES);
+
+  if (binPath) {
+    FILE *f = fopen(binPath, "wb");
+    if (!f || fwrite(img, 1, sizeof(img), f) != sizeof(img)) {
+      perror(binPath);
+      return 1;
+    }
+    fclose(f);
+  }
+  if (hexPath && !writeHex(hexPath, img, IMAGE_BYTES)) return 1;
+  if (port) {
+    if (!upload(port, slave, img)) return 1;
+    printf("uploaded to %s (address %d)\n", port, slave);
+  }
+  return 0;
+}
@@ -0,0 +1,120 @@
+/*
+  Arduino core, just enough for fanControl.cc on the host (see fanSim.cc)
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+#define A7 21
+#define SDA 18
+#define SCL 19
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define LOW 0
+#define HIGH 1
+
+#define F(s) (s)
+#define bit(b) (1UL << (b))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define constrain(v, lo, hi) ((v) < (lo) ? (lo) : ((v) > (hi) ? (hi) : (v)))
+#define noInterrupts() cli()
+#define interrupts() sei()
+
+/* Stack the firmware runs on in fanSim.cc; stands in for the free RAM
+   between .bss and RAMEND */
+const unsigned int SIM_STACK_BYTES = 4096;
+extern uint8_t simStack[];
+
+/* 32 bits, as on the board; see fanSim.cc */
+uint32_t millis();
+uint32_t micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+
+inline long map(long x, long inLo, long inHi, long outLo, long outHi) {
+  return (x - inLo) * (outHi - outLo) / (inHi - inLo) + outLo;
+}
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+
+  size_t write(const uint8_t *buf, size_t n) {
+    for (size_t i = 0; i < n; i++) write(buf[i]);
+    return n;
+  }
+  size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+
+  size_t print(const char *s) { return write(s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned long v, int base = 10) {
+    char buf[34];
+    char *p = buf + sizeof(buf) - 1;
+    *p = 0;
+    do {
+      int d = (int)(v % base);
+      *--p = (char)(d < 10 ? '0' + d : 'A' + d - 10);
+      v /= base;
+    } while (v);
+    return write(p);
+  }
+  size_t print(long v, int base = 10) {
+    if (v < 0 && base == 10) return write((uint8_t)'-') + print((unsigned long)-v, base);
+    return print((unsigned long)v, base);
+  }
+  size_t print(int v, int base = 10) { return print((long)v, base); }
+  size_t print(unsigned int v, int base = 10) { return print((unsigned long)v, base); }
+
+  size_t println() { return write("\r\n"); }
+  template <class T> size_t println(T v) { return print(v) + println(); }
+  template <class T> size_t println(T v, int base) { return print(v, base) + println(); }
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() {}
+};
+
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long baud);
+  void end() {}
+  size_t write(uint8_t c) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int peek() override;
+  int availableForWrite() { return 63; }
+  operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,40 @@
+/*
+  EEPROM backed by simEeprom[] in fanSim.cc. A write keeps the EEPROM
+  busy for 3.4 ms; writing while busy waits (simulated time runs on, as
+  in avr-libc's busy loop), and below the brown-out level writes are lost.
+*/
+#pragma once
+
+#include <Arduino.h>
+
+const int SIM_EEPROM_BYTES = 1024;
+extern uint8_t simEeprom[SIM_EEPROM_BYTES];
+extern unsigned long simEepromWrites;
+/* When each byte was last written (us since power-up) */
+extern unsigned long long simEepromWrittenUs[SIM_EEPROM_BYTES];
+void simEepromWrite(int addr, uint8_t v);
+bool simEepromReady();
+void simEepromBusyWait();
+
+struct EEPROMClass {
+  uint8_t read(int addr) { return simEeprom[addr]; }
+  void write(int addr, uint8_t v) { simEepromWrite(addr, v); }
+  void update(int addr, uint8_t v) {
+    if (simEeprom[addr] != v) write(addr, v);
+  }
+  template <class T> T &get(int addr, T &t) {
+    memcpy(&t, simEeprom + addr, sizeof(T));
+    return t;
+  }
+  template <class T> const T &put(int addr, const T &t) {
+    const uint8_t *p = (const uint8_t *)&t;
+    for (size_t i = 0; i < sizeof(T); i++) update(addr + (int)i, p[i]);
+    return t;
+  }
+  uint16_t length() { return SIM_EEPROM_BYTES; }
+};
+
+extern EEPROMClass EEPROM;
+
+#define eeprom_is_ready() simEepromReady()
+#define eeprom_busy_wait() simEepromBusyWait()
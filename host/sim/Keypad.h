@@ -0,0 +1,40 @@
+/*
+  Keypad fed by the scenario (simPressKey() and simHeldKeys in fanSim.cc),
+  with the library's key list: a key is PRESSED in the scan that first
+  sees it down and RELEASED in the one that sees it up. Keys not in the
+  keymap (rows the build does not scan) never go down.
+*/
+#pragma once
+
+#include <Arduino.h>
+
+#define makeKeymap(x) ((char *)x)
+#define LIST_MAX 10
+#define NO_KEY '\0'
+
+typedef enum { IDLE, PRESSED, HOLD, RELEASED } KeyState;
+
+class Key {
+ public:
+  char kchar = NO_KEY;
+  int kcode = -1;
+  KeyState kstate = IDLE;
+  boolean stateChanged = false;
+};
+
+class Keypad {
+ public:
+  Keypad(char *map, byte *, byte *, byte rows, byte cols) : map(map), keyCount(rows * cols) {}
+  bool getKeys();
+  bool wired(char c) const { return c != NO_KEY && memchr(map, c, keyCount) != nullptr; }
+  char getKey() {
+    if (getKeys() && key[0].stateChanged && key[0].kstate == PRESSED) return key[0].kchar;
+    return NO_KEY;
+  }
+
+  Key key[LIST_MAX];
+
+ private:
+  const char *map;
+  size_t keyCount;
+};
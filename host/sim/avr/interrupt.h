@@ -0,0 +1,23 @@
+/*
+  Vectors are plain functions on the host; fanSim.cc calls them when the
+  simulated peripheral fires. Weak, so a build without a handler links.
+*/
+#pragma once
+
+extern "C" {
+void PCINT0_vect(void) __attribute__((weak));
+void TIMER2_COMPA_vect(void) __attribute__((weak));
+void TIMER2_COMPB_vect(void) __attribute__((weak));
+void USART_RX_vect(void) __attribute__((weak));
+void USART_UDRE_vect(void) __attribute__((weak));
+void ADC_vect(void) __attribute__((weak));
+void TWI_vect(void) __attribute__((weak));
+}
+
+#define ISR(vector, ...) extern "C" void vector(void)
+#define ISR_NAKED
+
+/* The simulator never preempts loop(), so these only track the flag */
+extern bool simInterruptsOn;
+#define cli() (simInterruptsOn = false)
+#define sei() (simInterruptsOn = true)
@@ -0,0 +1,105 @@
+/*
+  ATmega328P registers used by fanControl.cc, as plain memory. fanSim.cc
+  plays the peripherals behind them.
+*/
+#pragma once
+
+#include <stdint.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+#define _BV(b) (1 << (b))
+
+#define SIM_REG8(r) extern volatile uint8_t r;
+#define SIM_REG16(r) extern volatile uint16_t r;
+
+SIM_REG8(SREG) SIM_REG8(MCUSR) SIM_REG16(SP)
+SIM_REG8(PINB) SIM_REG8(PORTB) SIM_REG8(DDRB)
+SIM_REG8(PINC) SIM_REG8(PORTC) SIM_REG8(DDRC)
+SIM_REG8(PIND) SIM_REG8(PORTD) SIM_REG8(DDRD)
+SIM_REG8(PCICR) SIM_REG8(PCMSK0)
+SIM_REG8(TCCR1A) SIM_REG8(TCCR1B) SIM_REG16(TCNT1) SIM_REG16(OCR1A) SIM_REG8(TIMSK1)
+SIM_REG8(TCCR2A) SIM_REG8(TCCR2B) SIM_REG8(TCNT2) SIM_REG8(OCR2A) SIM_REG8(OCR2B)
+SIM_REG8(TIMSK2) SIM_REG8(TIFR2) SIM_REG8(ASSR) SIM_REG8(GTCCR)
+SIM_REG8(ADMUX) SIM_REG8(ADCSRA) SIM_REG8(ADCSRB) SIM_REG16(ADC) SIM_REG8(DIDR0)
+SIM_REG8(UCSR0A) SIM_REG8(UCSR0B) SIM_REG8(UCSR0C) SIM_REG8(UDR0) SIM_REG16(UBRR0)
+SIM_REG8(SPCR) SIM_REG8(SPSR) SIM_REG8(SPDR)
+SIM_REG8(EECR)
+SIM_REG8(TWBR) SIM_REG8(TWSR) SIM_REG8(TWDR)
+
+/* TWCR: writing TWINT starts the next bus action, so writes go to the
+   TWI model in fanSim.cc */
+struct SimTwcr {
+  volatile uint8_t value;
+  SimTwcr &operator=(uint8_t v);
+  operator uint8_t() const { return value; }
+};
+extern SimTwcr TWCR;
+
+/* Port B */
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+
+/* Pin change */
+#define PCIE0 0
+#define PCINT0 0
+
+/* Timer2 */
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define TOIE2 0
+#define OCIE2A 1
+#define OCIE2B 2
+#define TOV2 0
+#define OCF2A 1
+#define OCF2B 2
+
+/* ADC */
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+#define MUX0 0
+#define ADLAR 5
+#define REFS0 6
+#define REFS1 7
+
+/* USART0 */
+#define MPCM0 0
+#define U2X0 1
+#define DOR0 3
+#define FE0 4
+#define UDRE0 5
+#define TXC0 6
+#define RXC0 7
+#define UCSZ00 1
+#define UCSZ01 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+
+/* TWI */
+#define TWIE 0
+#define TWEN 2
+#define TWSTO 4
+#define TWSTA 5
+#define TWEA 6
+#define TWINT 7
+
+/* EEPROM */
+#define EERE 0
+#define EEPE 1
+#define EEMPE 2
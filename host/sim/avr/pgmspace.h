@@ -0,0 +1,34 @@
+/*
+  Flash is ordinary memory on the host
+*/
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define memcpy_P memcpy
+
+inline uint8_t simReadFlash8(const void *p) {
+  uint8_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint16_t simReadFlash16(const void *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t simReadFlash32(const void *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+#define pgm_read_byte(p) simReadFlash8(p)
+#define pgm_read_word(p) simReadFlash16(p)
+#define pgm_read_dword(p) simReadFlash32(p)
+#define pgm_read_ptr(p) (*(void *const *)(p))
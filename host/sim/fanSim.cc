@@ -0,0 +1,2678 @@
+/*
+  Host simulator
+
+  Builds fanControl.cc unchanged against the headers in this directory
+  and runs it against simulated hardware: Timer2 (compare A/B), the ADC
+  and the supply behind the bandgap, the tach edges and the NTC of a
+  fan model, the TWI with the LCD (HD44780 behind a PCF8574, decoded
+  from the bus bytes) and an MPU6050 on the rotor frame, the keypad and
+  the EEPROM (with its write time). loop() runs
+  in zero simulated time, every SIM_LOOP_US; interrupts fire at their
+  own tick in between.
+
+  The firmware is built with a 32-bit long, as on the AVR, so millis()
+  and micros() wrap where the board's do. int is still 32 bits, so
+  16-bit overflow is not checked here; timing and sequencing are.
+
+  Build
+    g++ -O2 -Wl,-z,now -I host/sim -o fanSim host/sim/fanSim.cc
+
+  Other configurations build the same way with their options, e.g.
+  -DUSE_MODBUS=1 for the modbus scenario, or -DUSE_LCD=0 -DUSE_KEYPAD=0
+  -DUSE_POTS=0 -DUSE_MODBUS=1 for the headless PLC unit.
+
+  Usage
+    fanSim blend [recipe.bin]
+    fanSim inertia
+    fanSim powerfail
+    fanSim vacuum
+    fanSim thermal
+    fanSim vibration
+    fanSim faults
+    fanSim soak [jobs]
+    fanSim history
+    fanSim modbus      (built with -DUSE_MODBUS=1)
+
+  Scenarios
+  - blend   runs a recipe (built in, or an image from recipeCompiler -o)
+            twice, with its jerk limit and with sharp corners, and checks
+            the PWM at the fan output: on the planned path to within its
+            rounding, holds at the exact PWM for their whole time, no
+            jumps; and the plan: slope changes within the limit, chained
+            steps never stop at the boundary. Reports the fan tracking
+            error of both runs.
+  - inertia runs a manual job for fan models of different inertia and
+            compares the firmware's spin-up estimate of tau with the model,
+            and reports the ramp limit it chose and the peak lag.
+  - powerfail cuts the supply during a recipe, for several hold-up times,
+            and reports how long detection and the checkpoint write took
+            against the time left before the brown-out reset. Powers up
+            again from the EEPROM left behind and checks that a committed
+            checkpoint resumes the right step with the right time left,
+            and that a torn one is not offered. Also checks that a dip
+            the unit survives stops the job and offers the resume.
+  - vacuum  checks that a job does not start without chuck vacuum, and
+            that losing it mid-job cuts the fan and the valve within a
+            pass of the ADC scan, stops the job and shows NOVAC.
+  - thermal runs a long full-speed job on a motor that would overheat
+            at full PWM, and checks that the derating holds it under the
+            trip; then on one that overheats even at the derated PWM,
+            and checks the trip, the refused start while hot and the
+            start once it has cooled.
+  - vibration runs jobs for two rotor imbalances at two speeds and checks
+            the firmware's job RMS against the model's, that every FIFO
+            sample was read once with no overflow or bus error, and that
+            the LCD glass (rebuilt from the bus) matches the frame. Then
+            stalls loop() past the FIFO's depth and checks the overflow is
+            seen and recovered. Reports the LCD's bus traffic.
+  - faults  injects faults into a running job (or at power-up): I2C
+            NACKs and a slave holding SDA (until the firmware clocks it
+            free), stuck keys, tach dropout, the vacuum and NTC inputs at
+            either ADC rail, and a job across the millis() wrap. Reports the time from the fault to PWM 0 and from
+            clearing it to running again (for the bus: to the LCD and the
+            accelerometer back in step), against per-case limits.
+  - soak    warps the clock over the idle between jobs. Runs 3 s jobs
+            started at every phase of a millis() wrap and of a
+            micros()-only one, then a year of jobs (500 by default, one
+            across each millis() wrap), checking the countdown every
+            millisecond against the 64-bit clock, the LCD refresh and
+            that a stopped fan reads 0 RPM after the idle. Jobs are timed
+            from the keypad scan that took the '#', which must come
+            within a scan period of the tap (under USE_TT_SCHEDULE, the
+            slots between TT_KEYPAD ones). Reports the
+            job length error and its sum over the year. Then checks the
+            countdown arithmetic alone over millions of random jobs.
+  - history runs a job to each end (one on a worn fan) and cuts the
+            power on an open one, then wraps the ring over a second
+            power-up and powers up on it again. Checks the firmware's
+            records and ring position against the expected ones and
+            the EEPROM slots, and the production counters after each
+            power-up against the jobs run and their stored copy.
+  - modbus  reads the recipe window over the UART: the largest read a
+            reply can hold, the rest of the image, then all of it at
+            once, which does not fit the frame buffer and must be
+            refused. Writes the largest request back unchanged and reads
+            again. Checks every reply's bytes and CRC. Then writes the
+            job settings: taken while idle (recipe mode clearing
+            trajectory mode, both duration words with the start),
+            refused as busy while the job runs. Last, the save command
+            on images with a bad step, no steps and a good one. Needs a
+            Modbus build.
+
+  A scenario that taps a key the build does not scan (a UART build has
+  keypad rows 3-4 only), or needs the LCD or the pots the build leaves
+  out (USE_LCD, USE_POTS), says so and exits with status 2.
+
+  Every run also checks that the firmware left SIM_STACK_MARGIN of its
+  stack unused.
+
+  Exit status is 0 when every check passed.
+*/
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <Keypad.h>
+
+/* The firmware's long is 32 bits, as on the AVR, so its millis() and
+   micros() arithmetic wraps where the board's does. The headers above
+   keep the host's. */
+#define long int
+#include "../../fanControl.cc"
+#undef long
+
+/* Simulated peripherals */
+volatile uint8_t SREG, MCUSR;
+volatile uint16_t SP;
+volatile uint8_t PINB, PORTB, DDRB, PINC, PORTC, DDRC, PIND, PORTD, DDRD;
+volatile uint8_t PCICR, PCMSK0;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t TCNT1, OCR1A;
+volatile uint8_t TCCR2A, TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2, TIFR2, ASSR, GTCCR;
+volatile uint8_t ADMUX, ADCSRA, ADCSRB, DIDR0;
+volatile uint16_t ADC;
+volatile uint8_t UCSR0A, UCSR0B, UCSR0C, UDR0;
+volatile uint16_t UBRR0;
+volatile uint8_t SPCR, SPSR, SPDR;
+volatile uint8_t EECR;
+volatile uint8_t TWBR, TWSR, TWDR;
+SimTwcr TWCR;
+
+bool simInterruptsOn = true;
+
+uint8_t simEeprom[SIM_EEPROM_BYTES];
+unsigned long simEepromWrites = 0;
+unsigned long long simEepromWrittenUs[SIM_EEPROM_BYTES];
+EEPROMClass EEPROM;
+HardwareSerial Serial;
+
+/* Simulation step sizes */
+const unsigned long SIM_TICK_US = 4;
+const unsigned long SIM_LOOP_US = 500;
+
+/* ADC at clk/128: 13 ADC clocks, 104 us */
+const int SIM_ADC_TICKS = 26;
+/* EEPROM byte write time */
+const unsigned long SIM_EEPROM_WRITE_US = 3400;
+/* Brown-out reset level (BODLEVEL 2.7 V) */
+const double SIM_BOD_V = 2.7;
+
+/* Fan model: first order lag plus an acceleration limit (RPM/s) */
+double simFanTauS = 0.25;
+double simFanAccel = 2500.0;
+/* Speed against the calibration (a worn fan runs slow) */
+double simFanWear = 1.0;
+
+/* Motor temperature: first order towards ambient plus a rise that
+   grows with the PWM; the NTC is 10k B 3950 under a 10k pull-up */
+double simAmbientC = 25.0;
+double simFullPwmRiseC = 20.0;
+double simThermalTauS = 60.0;
+double simMotorC = 25.0;
+
+/* Time since power-up */
+unsigned long long simUs = 0;
+
+/* Chuck vacuum sensor at -80 kPa unless a scenario changes it */
+const int SIM_VACUUM_HELD_RAW = 758;
+
+/* Pin state seen by the fan model */
+int simPwm = 0;
+/* Last time the fan output went from on to off */
+unsigned long long simPwmOffUs = 0;
+int simAdc[8] = {0, 0, 0, SIM_VACUUM_HELD_RAW};
+double simRpm = 0;
+/* Tach edges due, fractional; one edge per quarter revolution */
+double simTachPhase = 0;
+
+/* Supply: 5 V unless the scenario sets a profile */
+double simVcc = 5.0;
+double (*simSupply)() = nullptr;
+/* Fell below SIM_BOD_V: the MCU is held in reset from here on */
+bool simBrownedOut = false;
+
+int simAdcTicksLeft = 0;
+
+/* Injected faults: ADC channels stuck at a reading (-1 = none), tach
+   signal lost, no I2C slave answering, a slave holding the bus */
+int simAdcForce[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+bool simTachCut = false;
+bool simI2cNack = false;
+bool simI2cHang = false;
+/* After the hang: the slave is left in the middle of a byte and holds
+   SDA until it has seen this many more SCL pulses */
+const int SIM_I2C_HELD_BITS = 7;
+int simI2cHeldBits = 0;
+
+/* EEPROM write in progress */
+unsigned long long simEepromBusyUntilUs = 0;
+int simEepromPendingAddr = -1;
+uint8_t simEepromPendingValue = 0;
+
+/* One pending key, taken by the next loop() pass */
+char simKey = 0;
+/* Keypad scans so far: a tap lasts until one has seen it down and the
+   next one up, however often the firmware scans */
+unsigned long simKeyScans = 0;
+/* When the last tap was taken by a scan */
+unsigned long long simKeyTapUs = 0;
+/* Keys held down (stuck), on top of the tap */
+char simHeldKeys[LIST_MAX + 1] = "";
+
+/* UART at 115200 8N1, a byte per 10 bit times: bytes still to arrive
+   at the firmware, and the bytes it has sent */
+const int SIM_UART_BYTE_TICKS = 22;
+std::vector<uint8_t> simUartIn;
+size_t simUartInPos = 0;
+std::vector<uint8_t> simUartOut;
+int simUartRxTicks = 0;
+int simUartTxTicks = 0;
+
+/* Called every simulated millisecond, for the scenario's probes */
+void (*simOnMs)() = nullptr;
+
+uint32_t millis() {
+  return (uint32_t)(simUs / 1000ULL);
+}
+
+uint32_t micros() {
+  return (uint32_t)simUs;
+}
+
+void simAdvance(unsigned long us);
+
+void delay(unsigned long ms) {
+  simAdvance(ms * 1000UL);
+}
+
+void delayMicroseconds(unsigned int us) {
+  simAdvance(us);
+}
+
+/* Port C pin pulled low by the firmware (output, driven low) */
+bool simPinCLow(uint8_t pin) {
+  return (DDRC & _BV(pin - A0)) && !(PORTC & _BV(pin - A0));
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin < A0 || pin > A5) return;
+  bool sclWasLow = simPinCLow(SCL);
+  uint8_t b = _BV(pin - A0);
+  if (mode == OUTPUT) {
+    DDRC |= b;
+  } else {
+    DDRC &= ~b;
+    if (mode == INPUT_PULLUP) PORTC |= b;
+    else PORTC &= ~b;
+  }
+
+  /* SCL let go with the TWI off: a clock for the slave holding SDA */
+  if (sclWasLow && !simPinCLow(SCL) && !(TWCR.value & _BV(TWEN)) && !simI2cHang && simI2cHeldBits > 0) {
+    simI2cHeldBits--;
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin >= 8 && pin < 14) {
+    if (value) PORTB |= _BV(pin - 8);
+    else PORTB &= ~_BV(pin - 8);
+  } else if (pin >= A0 && pin <= A5) {
+    if (value) PORTC |= _BV(pin - A0);
+    else PORTC &= ~_BV(pin - A0);
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  if (pin >= 8 && pin < 14) return (PINB >> (pin - 8)) & 1;
+  if (pin == SDA) return simI2cHang || simI2cHeldBits > 0 || simPinCLow(SDA) ? LOW : HIGH;
+  return HIGH;
+}
+
+int analogRead(uint8_t pin) {
+  if (pin >= A0) pin -= A0;
+  return pin < 8 ? simAdc[pin] : 0;
+}
+
+void analogWrite(uint8_t pin, int value) {
+  if (pin != fanPwmPin) return;
+  if (simPwm != 0 && value == 0) simPwmOffUs = simUs;
+  simPwm = value;
+}
+
+/* Scan: keys down are the held ones plus a pending tap */
+bool Keypad::getKeys() {
+  char down[LIST_MAX + 2];
+  size_t n = strlen(simHeldKeys);
+  memcpy(down, simHeldKeys, n);
+  down[n] = simKey;
+  down[n + 1] = 0;
+  if (simKey) simKeyTapUs = simUs;
+  simKey = 0;
+  simKeyScans++;
+
+  bool activity = false;
+  for (Key &k : key) {
+    k.stateChanged = false;
+    if (k.kchar == NO_KEY) continue;
+    if (k.kstate == RELEASED) {
+      k.kchar = NO_KEY;
+      k.kstate = IDLE;
+      k.stateChanged = true;
+      activity = true;
+    } else if (!strchr(down, k.kchar)) {
+      k.kstate = RELEASED;
+      k.stateChanged = true;
+      activity = true;
+    }
+  }
+
+  /* New keys take the first free slot */
+  for (const char *c = down; *c; c++) {
+    if (!wired(*c)) continue;
+    bool listed = false;
+    for (Key &k : key) listed = listed || (k.kchar == *c);
+    if (listed) continue;
+    for (Key &k : key) {
+      if (k.kchar != NO_KEY) continue;
+      k.kchar = *c;
+      k.kstate = PRESSED;
+      k.stateChanged = true;
+      activity = true;
+      break;
+    }
+  }
+  return activity;
+}
+
+void HardwareSerial::begin(unsigned long) {}
+
+size_t HardwareSerial::write(uint8_t c) {
+  putchar(c);
+  return 1;
+}
+
+int HardwareSerial::available() {
+  return 0;
+}
+
+int HardwareSerial::read() {
+  return -1;
+}
+
+int HardwareSerial::peek() {
+  return -1;
+}
+
+bool simEepromReady() {
+  return simUs >= simEepromBusyUntilUs;
+}
+
+void simEepromBusyWait() {
+  if (!simEepromReady()) simAdvance((unsigned long)(simEepromBusyUntilUs - simUs));
+}
+
+/* Wait out a write in progress, then start this one */
+void simEepromWrite(int addr, uint8_t v) {
+  simEepromBusyWait();
+  if (simBrownedOut) return;
+
+  simEepromPendingAddr = addr;
+  simEepromPendingValue = v;
+  simEepromBusyUntilUs = simUs + SIM_EEPROM_WRITE_US;
+  simEepromWrites++;
+}
+
+/* A write lands when it completes, and only if the supply held */
+void simEepromTick() {
+  if (simEepromPendingAddr < 0 || !simEepromReady()) return;
+  if (!simBrownedOut) {
+    simEeprom[simEepromPendingAddr] = simEepromPendingValue;
+    simEepromWrittenUs[simEepromPendingAddr] = simUs;
+  }
+  simEepromPendingAddr = -1;
+}
+
+/* Vectors the build has no handler for are null (weak) */
+void simInterrupt(void (*vector)()) {
+  if (vector) vector();
+}
+
+/* Timer2 at clk/64: one count per 4 us */
+void simTimer2Tick() {
+  if (!(TCCR2B & _BV(CS22))) return;
+
+  TCNT2 = (uint8_t)(TCNT2 + 1);
+  if (TCNT2 == OCR2A && (TIMSK2 & _BV(OCIE2A))) simInterrupt(TIMER2_COMPA_vect);
+  if (TCNT2 == OCR2B && (TIMSK2 & _BV(OCIE2B))) simInterrupt(TIMER2_COMPB_vect);
+}
+
+/* Conversion started with ADSC; the bandgap reads 1.1 V against Vcc */
+void simAdcTick() {
+  if (!(ADCSRA & _BV(ADEN)) || !(ADCSRA & _BV(ADSC))) return;
+  if (simAdcTicksLeft == 0) {
+    simAdcTicksLeft = SIM_ADC_TICKS;
+    return;
+  }
+  if (--simAdcTicksLeft > 0) return;
+
+  int ch = ADMUX & 0x0F;
+  if (ch == 14) {
+    ADC = simVcc > 1.1 ? (uint16_t)lround(1.1 * 1024.0 / simVcc) : 1023;
+  } else {
+    ADC = ch < 8 ? (uint16_t)(simAdcForce[ch] >= 0 ? simAdcForce[ch] : simAdc[ch]) : 0;
+  }
+  ADCSRA &= ~_BV(ADSC);
+  if (ADCSRA & _BV(ADIE)) simInterrupt(ADC_vect);
+}
+
+/* Receive the next byte, and take the next one the firmware sends from
+   its data-register-empty interrupt */
+void simUartTick() {
+  if (simUartRxTicks > 0) {
+    simUartRxTicks--;
+  } else if (simUartInPos < simUartIn.size() && (UCSR0B & _BV(RXEN0))) {
+    UDR0 = simUartIn[simUartInPos++];
+    simUartRxTicks = SIM_UART_BYTE_TICKS;
+    if (UCSR0B & _BV(RXCIE0)) simInterrupt(USART_RX_vect);
+  }
+
+  if (simUartTxTicks > 0) {
+    simUartTxTicks--;
+  } else if (UCSR0B & _BV(UDRIE0)) {
+    simInterrupt(USART_UDRE_vect);
+    simUartOut.push_back((uint8_t)UDR0);
+    simUartTxTicks = SIM_UART_BYTE_TICKS;
+  }
+}
+
+void simSupplyTick() {
+  if (simSupply) simVcc = simSupply();
+  if (simVcc < SIM_BOD_V) simBrownedOut = true;
+}
+
+/*
+  I2C: the TWI master, and the two slaves on the bus
+*/
+
+/* Bus devices: the LCD's port expander and the accelerometer */
+const int SIM_LCD_ADDR = 0x27;
+const int SIM_MPU_ADDR = 0x68;
+/* A byte and its ACK at TWBR's rate, and a START or STOP */
+int simTwiByteTicks() {
+  unsigned long hz = F_CPU / (16UL + 2UL * TWBR);
+  return (int)(9 * 1000000UL / hz / SIM_TICK_US) + 1;
+}
+const int SIM_TWI_START_TICKS = 3;
+
+/* Bus action in progress: ticks to go and the status it ends with */
+int simTwiTicksLeft = 0;
+uint8_t simTwiStatus = 0;
+/* Bus held by the master, and what the next byte is */
+bool simTwiOwned = false;
+enum { SIM_TWI_ADDR, SIM_TWI_WRITE, SIM_TWI_READ } simTwiPhase = SIM_TWI_ADDR;
+int simTwiSlave = -1;
+/* Bytes on the wire, by slave */
+unsigned long simTwiLcdBytes = 0;
+unsigned long simTwiMpuBytes = 0;
+
+/* HD44780 behind the PCF8574: what the glass shows */
+char simLcdText[2][17];
+bool simLcd4Bit = false;
+bool simLcdHaveHigh = false;
+uint8_t simLcdHigh = 0;
+uint8_t simLcdAddr = 0;
+uint8_t simLcdPort = 0;
+
+/* MPU6050: registers, FIFO, and the vibration of an imbalanced rotor
+   (simVibG at 3000 RPM, growing with the square of the speed) */
+uint8_t simMpuReg[128];
+uint8_t simMpuPtr = 0;
+uint8_t simMpuFifo[1024];
+int simMpuFifoHead = 0;
+int simMpuFifoCount = 0;
+bool simMpuFifoOverflow = false;
+unsigned int simMpuCountLatch = 0;
+double simVibG = 0.05;
+double simShaftRev = 0;
+double simMpuSampleDue = 0;
+/* Samples taken, and their mean square (mg^2), while a job runs */
+unsigned long simVibSamples = 0;
+double simVibSumSq = 0;
+
+void simLcdInstruction(uint8_t v) {
+  if (v == 0x01) {
+    memset(simLcdText, ' ', sizeof(simLcdText));
+    simLcdText[0][16] = 0;
+    simLcdText[1][16] = 0;
+    simLcdAddr = 0;
+  } else if (v & 0x80) {
+    simLcdAddr = v & 0x7F;
+  } else if ((v & 0xE0) == 0x20) {
+    simLcd4Bit = !(v & 0x10);
+    simLcdHaveHigh = false;
+  }
+}
+
+void simLcdData(uint8_t v) {
+  int row = simLcdAddr >= 0x40 ? 1 : 0;
+  int col = simLcdAddr - (row ? 0x40 : 0);
+  if (col < 16) simLcdText[row][col] = (char)v;
+  simLcdAddr++;
+}
+
+/* Port write: D4..D7 latched on EN falling */
+void simLcdPortWrite(uint8_t v) {
+  bool fall = (simLcdPort & 0x04) && !(v & 0x04);
+  simLcdPort = v;
+  if (!fall) return;
+
+  uint8_t nibble = v & 0xF0;
+  bool rs = v & 0x01;
+  if (!simLcd4Bit) {
+    /* 8-bit mode, low data lines not wired: low nibble reads 0 */
+    if (!rs) simLcdInstruction(nibble);
+    return;
+  }
+  if (!simLcdHaveHigh) {
+    simLcdHigh = nibble;
+    simLcdHaveHigh = true;
+    return;
+  }
+  simLcdHaveHigh = false;
+  uint8_t b = simLcdHigh | (nibble >> 4);
+  if (rs) {
+    simLcdData(b);
+  } else {
+    simLcdInstruction(b);
+  }
+}
+
+void simMpuReset() {
+  memset(simMpuReg, 0, sizeof(simMpuReg));
+  /* Asleep at power-up */
+  simMpuReg[0x6B] = 0x40;
+  simMpuReg[0x75] = 0x68;
+  simMpuFifoCount = 0;
+  simMpuFifoOverflow = false;
+}
+
+void simMpuFifoPush(uint8_t b) {
+  if (simMpuFifoCount == (int)sizeof(simMpuFifo)) {
+    /* Full: the oldest byte goes */
+    simMpuFifoHead = (simMpuFifoHead + 1) % (int)sizeof(simMpuFifo);
+    simMpuFifoCount--;
+    simMpuFifoOverflow = true;
+  }
+  simMpuFifo[(simMpuFifoHead + simMpuFifoCount) % (int)sizeof(simMpuFifo)] = b;
+  simMpuFifoCount++;
+}
+
+void simMpuWrite(uint8_t reg, uint8_t v) {
+  if (reg == 0x6A && (v & 0x04)) {
+    /* FIFO_RESET, self-clearing */
+    simMpuFifoCount = 0;
+    simMpuFifoOverflow = false;
+    v &= ~0x04;
+  }
+  simMpuReg[reg & 0x7F] = v;
+}
+
+uint8_t simMpuRead() {
+  uint8_t reg = simMpuPtr;
+  if (reg == 0x74) {
+    /* FIFO_R_W pops and does not advance */
+    if (simMpuFifoCount == 0) return 0;
+    uint8_t b = simMpuFifo[simMpuFifoHead];
+    simMpuFifoHead = (simMpuFifoHead + 1) % (int)sizeof(simMpuFifo);
+    simMpuFifoCount--;
+    return b;
+  }
+  simMpuPtr = (simMpuPtr + 1) & 0x7F;
+  /* The count is latched when its high byte is read */
+  if (reg == 0x72) {
+    simMpuCountLatch = simMpuFifoCount;
+    return simMpuCountLatch >> 8;
+  }
+  if (reg == 0x73) return simMpuCountLatch & 0xFF;
+  return simMpuReg[reg & 0x7F];
+}
+
+/* Shaft angle every tick, a sample every sample period */
+void simMpuTick() {
+  simShaftRev += simRpm / 60e6 * SIM_TICK_US;
+  simShaftRev -= floor(simShaftRev);
+
+  bool awake = !(simMpuReg[0x6B] & 0x40);
+  if (!awake) return;
+
+  int cfg = simMpuReg[0x1A] & 7;
+  double rateHz = (cfg == 0 || cfg == 7 ? 8000.0 : 1000.0) / (1 + simMpuReg[0x19]);
+  simMpuSampleDue += rateHz * SIM_TICK_US * 1e-6;
+  if (simMpuSampleDue < 1.0) return;
+  simMpuSampleDue -= 1.0;
+
+  /* Counts per g at the configured range */
+  double k = 16384.0 / (1 << ((simMpuReg[0x1C] >> 3) & 3));
+  double a = simVibG * (simRpm / 3000.0) * (simRpm / 3000.0);
+  double g[3] = { a * cos(2 * M_PI * simShaftRev), a * sin(2 * M_PI * simShaftRev), 1.0 };
+
+  if (isRunning) {
+    simVibSamples++;
+    simVibSumSq += a * a * 1e6;
+  }
+
+  bool fifoOn = (simMpuReg[0x6A] & 0x40) && (simMpuReg[0x23] & 0x08);
+  if (!fifoOn) return;
+  for (int i = 0; i < 3; i++) {
+    long c = lround(g[i] * k);
+    if (c > 32767) c = 32767;
+    if (c < -32768) c = -32768;
+    simMpuFifoPush((uint8_t)((uint16_t)c >> 8));
+    simMpuFifoPush((uint8_t)c);
+  }
+}
+
+/* Slave ACK for its address */
+bool simI2cStart(int addr, bool read) {
+  simTwiSlave = -1;
+  if (simI2cNack) return false;
+  if (addr == SIM_LCD_ADDR && !read) simTwiSlave = addr;
+  if (addr == SIM_MPU_ADDR) simTwiSlave = addr;
+  if (simTwiSlave == SIM_MPU_ADDR && !read) simMpuPtr = 0xFF;
+  return simTwiSlave >= 0;
+}
+
+bool simI2cWrite(uint8_t v) {
+  if (simTwiSlave == SIM_LCD_ADDR) {
+    simTwiLcdBytes++;
+    simLcdPortWrite(v);
+  } else if (simTwiSlave == SIM_MPU_ADDR) {
+    simTwiMpuBytes++;
+    /* First byte is the register, the rest write from there on */
+    if (simMpuPtr == 0xFF) {
+      simMpuPtr = v & 0x7F;
+    } else {
+      simMpuWrite(simMpuPtr, v);
+      simMpuPtr = (simMpuPtr + 1) & 0x7F;
+    }
+  }
+  return true;
+}
+
+uint8_t simI2cRead() {
+  simTwiMpuBytes++;
+  return simTwiSlave == SIM_MPU_ADDR ? simMpuRead() : 0xFF;
+}
+
+void simTwiStart(uint8_t status, int ticks) {
+  simTwiStatus = status;
+  simTwiTicksLeft = ticks;
+}
+
+/* Firmware wrote TWCR: act on it if TWINT was written */
+SimTwcr &SimTwcr::operator=(uint8_t v) {
+  if (!(v & _BV(TWEN))) {
+    /* TWI off: bus released, nothing in progress */
+    value = v;
+    simTwiOwned = false;
+    simTwiTicksLeft = 0;
+    return *this;
+  }
+  if (!(v & _BV(TWINT))) {
+    value = (v & ~_BV(TWINT)) | (value & _BV(TWINT));
+    return *this;
+  }
+
+  value = v & ~_BV(TWINT);
+  if (v & _BV(TWSTO)) {
+    /* STOP goes out at once */
+    simTwiOwned = false;
+    simTwiSlave = -1;
+    value &= ~_BV(TWSTO);
+  }
+  if (v & _BV(TWSTA)) {
+    simTwiStart(simTwiOwned ? 0x10 : 0x08, SIM_TWI_START_TICKS);
+    simTwiOwned = true;
+    simTwiPhase = SIM_TWI_ADDR;
+  } else if (simTwiOwned && simTwiPhase == SIM_TWI_ADDR) {
+    bool read = TWDR & 1;
+    bool ack = simI2cStart(TWDR >> 1, read);
+    simTwiPhase = read ? SIM_TWI_READ : SIM_TWI_WRITE;
+    simTwiStart(read ? (ack ? 0x40 : 0x48) : (ack ? 0x18 : 0x20), simTwiByteTicks());
+  } else if (simTwiOwned && simTwiPhase == SIM_TWI_WRITE) {
+    simTwiStart(simI2cWrite(TWDR) ? 0x28 : 0x30, simTwiByteTicks());
+  } else if (simTwiOwned && simTwiPhase == SIM_TWI_READ) {
+    TWDR = simI2cRead();
+    simTwiStart((v & _BV(TWEA)) ? 0x50 : 0x58, simTwiByteTicks());
+  }
+  return *this;
+}
+
+/* Bus action done: TWINT up, interrupt if enabled */
+void simTwiTick() {
+  /* Held bus: the action in progress never ends */
+  if (simI2cHang || simI2cHeldBits > 0) return;
+  if (simTwiTicksLeft == 0 || --simTwiTicksLeft > 0) return;
+  TWSR = (TWSR & 0x07) | simTwiStatus;
+  TWCR.value |= _BV(TWINT);
+  if (TWCR.value & _BV(TWIE)) simInterrupt(TWI_vect);
+}
+
+/* Motor temperature and the NTC reading, once per millisecond */
+void simThermalStep() {
+  double target = simAmbientC + simFullPwmRiseC * simPwm / 255.0;
+  simMotorC += (target - simMotorC) * 0.001 / simThermalTauS;
+
+  double ntcOhm = 10000.0 * exp(3950.0 * (1.0 / (simMotorC + 273.15) - 1.0 / 298.15));
+  simAdc[ntcPin - A0] = (int)lround(1023.0 * ntcOhm / (ntcOhm + 10000.0));
+}
+
+/* Fan speed, once per millisecond */
+void simFanStep() {
+  double target = estimateRpmFromPwm(simPwm) * simFanWear;
+  double dt = 0.001;
+  double d = (target - simRpm) * dt / simFanTauS;
+  double limit = simFanAccel * dt;
+
+  if (d > limit) d = limit;
+  if (d < -limit) d = -limit;
+  simRpm += d;
+}
+
+/* Tach: two pulses per revolution, so an edge per quarter turn. Edges
+   follow the shaft angle, so a period measures the mean speed over it. */
+void simTachStep() {
+  simTachPhase += simRpm * TACH_PULSES_PER_REV * 2 / 60e6 * SIM_TICK_US;
+  if (simTachPhase < 1.0) return;
+  simTachPhase -= 1.0;
+  if (simTachCut) return;
+
+  PINB ^= _BV(PB0);
+  if ((PCICR & _BV(PCIE0)) && (PCMSK0 & _BV(PCINT0))) simInterrupt(PCINT0_vect);
+}
+
+void simAdvance(unsigned long us) {
+  for (unsigned long t = 0; t < us; t += SIM_TICK_US) {
+    simUs += SIM_TICK_US;
+    simSupplyTick();
+    simEepromTick();
+    simTimer2Tick();
+    simTachStep();
+    simAdcTick();
+    simTwiTick();
+    simMpuTick();
+    simUartTick();
+    if (simUs % 1000ULL == 0) {
+      simFanStep();
+      simThermalStep();
+      if (simOnMs) simOnMs();
+    }
+  }
+}
+
+/*
+  The firmware (setup(), loop() and the interrupts they run into) runs
+  on simStack, painted at power-up the way the AVR's free RAM is, in a
+  context of its own; scenario code stays on the process stack. Host
+  frames are not AVR frames, so the margin checked after every run
+  catches runaway depth (recursion, large locals), not the AVR figure.
+  Lazy symbol binding would put the dynamic linker's 3 KB on this stack
+  at the first call of each library function: build with -z now.
+*/
+alignas(16) uint8_t simStack[SIM_STACK_BYTES];
+ucontext_t simMainCtx;
+ucontext_t simFwCtx;
+unsigned long long simFwEndUs = 0;
+/* Stack the firmware must leave unused after every run; it uses about
+   350 bytes here */
+const unsigned int SIM_STACK_MARGIN = 3072;
+
+void simFirmwareMain() {
+  setup();
+  for (;;) {
+    swapcontext(&simFwCtx, &simMainCtx);
+    while (simUs < simFwEndUs) {
+      loop();
+      simAdvance(SIM_LOOP_US);
+    }
+  }
+}
+
+/* Run loop() for a while */
+void simRun(unsigned long ms) {
+  simFwEndUs = simUs + ms * 1000ULL;
+  swapcontext(&simMainCtx, &simFwCtx);
+}
+
+/* Bytes of simStack the firmware never reached */
+unsigned int simStackFree() {
+  unsigned int n = 0;
+  while (n < SIM_STACK_BYTES && simStack[n] == STACK_PAINT) n++;
+  return n;
+}
+
+/* Time warp: us (a multiple of SIM_TICK_US) pass with the fan off and
+   at rest, in one step. Nothing runs meanwhile, so loop() sees one long
+   gap; let it idle past TACH_TIMEOUT_US first, as the board would have.
+   The motor cools as it would have. */
+void simWarp(unsigned long long us) {
+  simUs += us;
+  simRpm = 0;
+  simTachPhase = 0;
+  simMotorC = simAmbientC + (simMotorC - simAmbientC) * exp(-(us / 1e6) / simThermalTauS);
+  simThermalStep();
+}
+
+/* EEPROM contents as a hex line, for the next power-up (child) */
+void simWriteEeprom(FILE *out) {
+  for (int i = 0; i < SIM_EEPROM_BYTES; i++) fprintf(out, "%02x", simEeprom[i]);
+  fprintf(out, "\n");
+}
+
+/* And back (parent) */
+bool simReadEeprom(FILE *in, uint8_t *eeprom) {
+  for (int i = 0; i < SIM_EEPROM_BYTES; i++) {
+    unsigned int b;
+    if (fscanf(in, "%2x", &b) != 1) return false;
+    eeprom[i] = (uint8_t)b;
+  }
+  return true;
+}
+
+/* Every key in needed is on the build's keypad; if not, says so for
+   scenario */
+bool simNeedKeys(const char *scenario, const char *needed) {
+#if USE_KEYPAD
+  for (const char *c = needed; *c; c++) {
+    if (!keypad.wired(*c)) {
+      fprintf(stderr, "fanSim: the %s scenario needs the %c key, which this build does not scan\n", scenario, *c);
+      return false;
+    }
+  }
+  return true;
+#else
+  (void)needed;
+  fprintf(stderr, "fanSim: the %s scenario needs the keypad, which this build leaves out\n", scenario);
+  return false;
+#endif
+}
+
+/* The build has the LCD the scenario reads back; if not, says so */
+bool simNeedLcd(const char *scenario) {
+#if USE_LCD
+  (void)scenario;
+  return true;
+#else
+  fprintf(stderr, "fanSim: the %s scenario reads the LCD, which this build leaves out\n", scenario);
+  return false;
+#endif
+}
+
+/* The build has the speed pots the scenario sets; if not, says so */
+bool simNeedPots(const char *scenario) {
+#if USE_POTS
+  (void)scenario;
+  return true;
+#else
+  fprintf(stderr, "fanSim: the %s scenario sets the speed pots, which this build leaves out\n", scenario);
+  return false;
+#endif
+}
+
+/* Speed pots, raw ADC; without them manual jobs run at FIXED_PWM */
+void simSetPots(int coarse, int fine) {
+#if USE_POTS
+  simAdc[potCoarsePin - A0] = coarse;
+  simAdc[potFinePin - A0] = fine;
+#else
+  (void)coarse;
+  (void)fine;
+#endif
+}
+
+/* Key tap: down for one keypad scan, up for the next */
+void simPressKey(char key) {
+  simKey = key;
+  unsigned long scans = simKeyScans;
+  do {
+    simRun(1);
+  } while (simKeyScans - scans < 2);
+}
+
+/*
+  Power-up with the given EEPROM contents, then run(arg, out) in a child
+  process so every run starts from the firmware's initial globals. The
+  child's output comes back through a temporary file.
+*/
+bool simPowerUp(const uint8_t *eeprom, void (*run)(void *arg, FILE *out), void *arg, FILE **result) {
+  FILE *out = tmpfile();
+  if (!out) return false;
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if (pid < 0) return false;
+  if (pid == 0) {
+    memcpy(simEeprom, eeprom, sizeof(simEeprom));
+    simThermalStep();
+    simMpuReset();
+
+    memset(simStack, STACK_PAINT, sizeof(simStack));
+    getcontext(&simFwCtx);
+    simFwCtx.uc_stack.ss_sp = simStack;
+    simFwCtx.uc_stack.ss_size = sizeof(simStack);
+    simFwCtx.uc_link = nullptr;
+    makecontext(&simFwCtx, simFirmwareMain, 0);
+    swapcontext(&simMainCtx, &simFwCtx);
+
+    run(arg, out);
+    fflush(out);
+
+    /* The firmware's own scan, run to the end, must see the same */
+    unsigned int stackLeft = simStackFree();
+    do {
+      serviceStack();
+    } while (stackScanPos != stackLow);
+    if (stackFree != stackLeft) {
+      fprintf(stderr, "fanSim: firmware stack scan says %u bytes free, %u are  FAIL\n", stackFree, stackLeft);
+      _exit(1);
+    }
+    if (stackLeft < SIM_STACK_MARGIN) {
+      fprintf(stderr, "fanSim: firmware used %u of %u stack bytes, margin is %u (built without -z now?)  FAIL\n",
+              SIM_STACK_BYTES - stackLeft, SIM_STACK_BYTES, SIM_STACK_MARGIN);
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fclose(out);
+    return false;
+  }
+  rewind(out);
+  *result = out;
+  return true;
+}
+
+/*
+  blend scenario
+*/
+
+/* Per-ms trace of a recipe run */
+struct BlendTrace {
+  std::vector<long> pwmQ8;
+  std::vector<int> outPwm;
+  std::vector<double> lagRpm;
+  std::vector<bool> inHold;
+};
+
+/* Per ms while the job runs: planned setpoint (Q8), PWM at the fan
+   output, fan error (rpm), hold phase; kept, not printed, as the probe
+   runs on the firmware's stack */
+BlendTrace blendProbeTrace;
+
+void blendProbe() {
+  if (!isRunning || dipWaiting) return;
+
+  unsigned long intoMs = millis() - stepStartMs;
+  bool hold = recipeData.steps[jobStep].holdSec > 0 && intoMs >= recipeData.steps[jobStep].rampMs;
+  blendProbeTrace.pwmQ8.push_back(stepPwmQ8(jobStep, intoMs));
+  blendProbeTrace.outPwm.push_back(simPwm);
+  blendProbeTrace.lagRpm.push_back(fabs(estimateRpmFromPwm(simPwm) - readMeasuredRpm()));
+  blendProbeTrace.inHold.push_back(hold);
+}
+
+/* Child: one line per ms of the job */
+void blendJob(void *, FILE *out) {
+  /* Room for a minute, so the probe never allocates */
+  blendProbeTrace.pwmQ8.reserve(60000);
+  blendProbeTrace.outPwm.reserve(60000);
+  blendProbeTrace.lagRpm.reserve(60000);
+  blendProbeTrace.inHold.reserve(60000);
+  simOnMs = blendProbe;
+  simPressKey('A');
+  simPressKey('#');
+  while (isRunning) simRun(10);
+
+  const BlendTrace &tr = blendProbeTrace;
+  for (size_t i = 0; i < tr.pwmQ8.size(); i++) {
+    fprintf(out, "%ld %d %.1f %d\n", tr.pwmQ8[i], tr.outPwm[i], tr.lagRpm[i], tr.inHold[i] ? 1 : 0);
+  }
+}
+
+/* Example recipe: wet spread, two chained ramps up, spin, spin down */
+void blendDefaultRecipe(RecipeData &r) {
+  memset(&r, 0, sizeof(r));
+  r.magic = RECIPE_MAGIC;
+  r.id = 1;
+  r.count = 4;
+  r.jerkQ8 = 86;
+
+  const uint8_t pwm[] = {60, 117, 187, 0};
+  const uint16_t rampMs[] = {1000, 1000, 1200, 2500};
+  const uint16_t holdSec[] = {2, 0, 5, 0};
+  int prev = 0;
+  for (byte k = 0; k < r.count; k++) {
+    RecipeStep &s = r.steps[k];
+    s.pwm = pwm[k];
+    s.rampMs = rampMs[k];
+    s.rampQ8 = (int16_t)lround((pwm[k] - prev) * 256.0 / rampMs[k]);
+    s.holdSec = holdSec[k];
+    s.dispenseUs = DISPENSE_NONE;
+    prev = pwm[k];
+  }
+  r.steps[0].dispenseUs = 1000000UL;
+  r.steps[0].dispenseMs = 150;
+}
+
+bool blendRun(const RecipeData &r, BlendTrace &tr) {
+  uint8_t eeprom[SIM_EEPROM_BYTES];
+  memset(eeprom, 0xFF, sizeof(eeprom));
+  memcpy(eeprom + RECIPE_ADDR, &r, sizeof(r));
+
+  FILE *in;
+  if (!simPowerUp(eeprom, blendJob, nullptr, &in)) return false;
+
+  long pwmQ8;
+  int outPwm;
+  double lag;
+  int hold;
+  while (fscanf(in, "%ld %d %lf %d", &pwmQ8, &outPwm, &lag, &hold) == 4) {
+    tr.pwmQ8.push_back(pwmQ8);
+    tr.outPwm.push_back(outPwm);
+    tr.lagRpm.push_back(lag);
+    tr.inHold.push_back(hold != 0);
+  }
+  fclose(in);
+  return !tr.pwmQ8.empty();
+}
+
+int scenarioBlend(const char *imagePath) {
+  if (!simNeedKeys("blend", "A#")) return 2;
+
+  RecipeData r;
+  if (imagePath) {
+    FILE *f = fopen(imagePath, "rb");
+    if (!f || fread(&r, 1, sizeof(r), f) != sizeof(r)) {
+      fprintf(stderr, "fanSim: cannot read %s (%u byte recipe image)\n", imagePath,
+              (unsigned)sizeof(r));
+      return 2;
+    }
+    fclose(f);
+    if (r.magic != RECIPE_MAGIC || r.count == 0 || r.count > RECIPE_MAX_STEPS) {
+      fprintf(stderr, "fanSim: %s is not a recipe image\n", imagePath);
+      return 2;
+    }
+  } else {
+    blendDefaultRecipe(r);
+  }
+
+  BlendTrace blended;
+  RecipeData sharp = r;
+  sharp.jerkQ8 = 0;
+  BlendTrace corners;
+  if (!blendRun(r, blended) || !blendRun(sharp, corners)) {
+    fprintf(stderr, "fanSim: recipe did not run\n");
+    return 1;
+  }
+
+  /* Same plan as the firmware made, for the slope limits below */
+  recipeData = r;
+  planBlends();
+
+  const std::vector<long> &p = blended.pwmQ8;
+  const std::vector<int> &o = blended.outPwm;
+  int failures = 0;
+
+  /* Job length and step schedule do not move */
+  unsigned long totalMs = 0;
+  for (byte k = 0; k < r.count; k++) totalMs += stepMs(k);
+  printf("job: %lu ms traced, %lu ms of steps\n", (unsigned long)p.size(), totalMs);
+  if (p.size() < totalMs) {
+    printf("  FAIL: job ended before the last step\n");
+    failures++;
+  }
+
+  /* Fan output follows the plan, rounded to whole PWM counts; the loop()
+     pass that wrote it may be up to a millisecond of plan behind */
+  long steepest = 0;
+  for (byte k = 0; k < r.count; k++) steepest = max(steepest, (labs(stepBlend[k].slopeQ16) + 255) >> 8);
+  long offQ8 = 0;
+  unsigned long offAt = 0;
+  for (size_t t = 0; t < o.size() && t < totalMs; t++) {
+    long d = labs((long)o[t] * 256L - p[t]);
+    if (d > offQ8) {
+      offQ8 = d;
+      offAt = t;
+    }
+  }
+  bool followOk = offQ8 <= 128 + steepest;
+  printf("output: off the plan by up to %.2f pwm at %lu ms (%.2f)%s\n", offQ8 / 256.0, offAt,
+         (128 + steepest) / 256.0, followOk ? "" : "  FAIL");
+  if (!followOk) failures++;
+
+  /* Holds: exact PWM at the output for the whole hold, and only inside
+     the step */
+  unsigned long stepStart = 0;
+  for (byte k = 0; k < r.count; k++) {
+    const RecipeStep &s = r.steps[k];
+    unsigned long holdStart = stepStart + s.rampMs;
+    unsigned long holdEnd = stepStart + stepMs(k);
+    if (s.holdSec > 0) {
+      unsigned long atSpeed = 0;
+      for (unsigned long t = holdStart; t < holdEnd && t < o.size(); t++) {
+        if (o[t] == s.pwm) atSpeed++;
+      }
+      bool ok = atSpeed == holdEnd - holdStart;
+      printf("step %u: hold %lu/%lu ms at pwm %u%s\n", k + 1, atSpeed, holdEnd - holdStart,
+             s.pwm, ok ? "" : "  FAIL");
+      if (!ok) failures++;
+    } else if (k + 1 < r.count && stepChained(k) && holdEnd >= 5 && holdEnd + 5 < p.size()) {
+      /* Chained boundary: the plan still moving (slower than the
+         output's PWM step, here) */
+      long slope = p[holdEnd + 5] - p[holdEnd - 5];
+      bool ok = slope != 0;
+      printf("step %u: chained into step %u, slope %.3f pwm/ms at the boundary%s\n", k + 1, k + 2,
+             slope / 2560.0, ok ? "" : "  FAIL");
+      if (!ok) failures++;
+    }
+    stepStart = holdEnd;
+  }
+
+  /* Slope changes of the plan (at the output they are below the PWM
+     step): second difference at 10 ms spacing within the limit. The
+     samples are rounded down to Q8 counts, a few counts of noise. */
+  if (r.jerkQ8 > 0) {
+    const long spacing = 10;
+    double limit = r.jerkQ8 * spacing * spacing / 1000.0 + 4.0;
+    double worst = 0;
+    unsigned long worstAt = 0;
+    for (size_t t = spacing; t + spacing < p.size() && t + spacing < totalMs; t++) {
+      double d2 = fabs((double)p[t + spacing] - 2.0 * p[t] + p[t - spacing]);
+      if (d2 > worst) {
+        worst = d2;
+        worstAt = t;
+      }
+    }
+    bool ok = worst <= limit;
+    printf("jerk: worst %.1f, limit %.1f (Q8 per %ld ms^2) at %lu ms%s\n", worst, limit,
+           spacing, worstAt, ok ? "" : "  FAIL");
+    if (!ok) failures++;
+  }
+
+  /* No jumps: one ms of output never moves more than the steepest slope
+     allows, give or take a count of rounding */
+  long jump = 0;
+  for (size_t t = 1; t < o.size(); t++) jump = max(jump, (long)abs(o[t] - o[t - 1]));
+  long jumpLimit = (steepest + 255) / 256 + 1;
+  bool ok = r.steps[0].rampMs == 0 || jump <= jumpLimit;
+  printf("continuity: largest 1 ms output step %ld pwm, limit %ld%s\n", jump, jumpLimit, ok ? "" : "  FAIL");
+  if (!ok) failures++;
+
+  /* Fan tracking, blended vs sharp: overall, and once at a hold (the fan
+     still catching up with the ramp) */
+  const BlendTrace *runs[2] = {&blended, &corners};
+  double peak[2] = {0, 0}, peakHold[2] = {0, 0};
+  for (int i = 0; i < 2; i++) {
+    for (size_t t = 0; t < runs[i]->lagRpm.size(); t++) {
+      peak[i] = max(peak[i], runs[i]->lagRpm[t]);
+      if (runs[i]->inHold[t]) peakHold[i] = max(peakHold[i], runs[i]->lagRpm[t]);
+    }
+  }
+  printf("tracking: peak error %.0f rpm blended, %.0f rpm sharp corners\n", peak[0], peak[1]);
+  printf("          in holds %.0f rpm blended, %.0f rpm sharp corners\n", peakHold[0], peakHold[1]);
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+/*
+  inertia scenario
+*/
+
+/* Peak lag of the fan behind the output during the run (rpm) */
+double inertiaPeakLag = 0;
+
+void inertiaProbe() {
+  if (!isRunning) return;
+  inertiaPeakLag = max(inertiaPeakLag, estimateRpmFromPwm(simPwm) - simRpm);
+}
+
+/* Manual job at PWM 160 for 4 s */
+void inertiaJob(void *, FILE *out) {
+  simSetPots(682, 0);
+  simOnMs = inertiaProbe;
+  simPressKey('4');
+  simPressKey('#');
+  while (isRunning) simRun(10);
+
+  fprintf(out, "%d %u %u %.0f\n", inertiaState, inertiaTauMs, rampRpmPerS, inertiaPeakLag);
+}
+
+int scenarioInertia() {
+  if (!simNeedKeys("inertia", "4#") || !simNeedPots("inertia")) return 2;
+
+  /* Pure first order, so the model's tau is the right answer */
+  simFanAccel = 1e9;
+
+  uint8_t eeprom[SIM_EEPROM_BYTES];
+  memset(eeprom, 0xFF, sizeof(eeprom));
+
+  /* Below about 100 ms the window spans only a few tach periods and the
+     estimate errs high, i.e. towards a gentler ramp */
+  const double taus[] = {0.1, 0.25, 0.5, 1.0, 2.0};
+  int failures = 0;
+  printf("model tau  estimate   ramp limit   peak lag\n");
+  for (double tau : taus) {
+    simFanTauS = tau;
+    FILE *in;
+    int state;
+    unsigned int tauMs, rampRate;
+    double lag;
+    if (!simPowerUp(eeprom, inertiaJob, nullptr, &in) ||
+        fscanf(in, "%d %u %u %lf", &state, &tauMs, &rampRate, &lag) != 4) {
+      fprintf(stderr, "fanSim: job did not run\n");
+      return 1;
+    }
+    fclose(in);
+
+    /* Tach quantisation and the 10 ms sampling: within 15 % */
+    double err = state == INERTIA_DONE ? fabs(tauMs / 1000.0 - tau) / tau : 1.0;
+    bool ok = err <= 0.15;
+    printf("%6.0f ms  %6u ms  %6u rpm/s  %5.0f rpm%s\n", tau * 1000, tauMs, rampRate, lag,
+           ok ? "" : "  FAIL");
+    if (!ok) failures++;
+  }
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+/*
+  powerfail scenario
+*/
+
+/* Supply profile: linear fall from simCutUs, simFallMs from 5 V to the
+   brown-out level; or a dip to simDipV for simDipMs that recovers */
+unsigned long long simCutUs = 0;
+double simFallMs = 0;
+double simDipV = 0;
+double simDipMs = 0;
+
+double powerFallSupply() {
+  if (simUs < simCutUs) return 5.0;
+  double ms = (simUs - simCutUs) / 1000.0;
+  if (simFallMs > 0) return max(0.0, 5.0 - ms * (5.0 - SIM_BOD_V) / simFallMs);
+  return ms < simDipMs ? simDipV : 5.0;
+}
+
+/* Recipe mode, cut 4.5 s in (step 3 of the example recipe) */
+const unsigned long POWER_CUT_AT_MS = 4500;
+
+/* First ms with the supply monitor tripped and the fan still driven */
+unsigned long long powerFanOnUs = 0;
+
+void powerProbe() {
+  if (powerState != POWER_OK && simPwm != 0 && powerFanOnUs == 0) powerFanOnUs = simUs;
+}
+
+/* Run to the cut; returns the time left on the job there */
+unsigned long powerRunToCut() {
+  simPressKey('A');
+  simPressKey('#');
+  while (millis() - jobStartMs < POWER_CUT_AT_MS) simRun(1);
+
+  simCutUs = simUs;
+  simSupply = powerFallSupply;
+  simOnMs = powerProbe;
+  return remainingJobMs();
+}
+
+/* Child: job, cut, run until the brown-out; report and leave the EEPROM */
+void powerFailJob(void *, FILE *out) {
+  unsigned long remainingMs = powerRunToCut();
+  byte step = jobStep;
+  while (!simBrownedOut) simRun(1);
+
+  const int commitAddr = RESUME_ADDR + (int)offsetof(ResumeData, commit);
+  unsigned long long committedUs = simEepromWrittenUs[commitAddr];
+  fprintf(out, "%u %lu %.3f %.3f %.3f %u %d\n", step, remainingMs,
+          ((unsigned long)(powerLowUs - (uint32_t)simCutUs)) / 1000.0,
+          committedUs > simCutUs ? (committedUs - simCutUs) / 1000.0 : -1.0,
+          (simUs - simCutUs) / 1000.0, resume.writeUs, powerFanOnUs != 0);
+  simWriteEeprom(out);
+}
+
+/* Child: power-up on a left-behind EEPROM; accept the offer if there is
+   one and run the job out */
+void powerResumeJob(void *, FILE *out) {
+  simRun(50);
+  bool offered = resumeOffered && !strncmp(simLcdText[1], "RESUME?", 7);
+  unsigned long savedMs = resume.remainingMs;
+  if (!offered) {
+    fprintf(out, "0 0 0 0\n");
+    return;
+  }
+
+  simPressKey('#');
+  byte step = jobStep;
+  unsigned long long startUs = simUs;
+  while (isRunning) simRun(1);
+  fprintf(out, "1 %u %lu %.0f\n", step, savedMs, (simUs - startUs) / 1000.0);
+}
+
+/* Child: a dip the unit rides through */
+void powerDipJob(void *, FILE *out) {
+  unsigned long remainingMs = powerRunToCut();
+  byte step = jobStep;
+  simRun(200);
+  fprintf(out, "%d %d %u %u %lu %lu %d\n", isRunning, resumeOffered,
+          step, resume.step, remainingMs, (unsigned long)resume.remainingMs,
+          !strncmp(simLcdText[1], "RESUME?", 7));
+}
+
+int scenarioPowerFail() {
+  if (!simNeedKeys("powerfail", "A#") || !simNeedLcd("powerfail")) return 2;
+
+  RecipeData r;
+  blendDefaultRecipe(r);
+  uint8_t eeprom[SIM_EEPROM_BYTES];
+  memset(eeprom, 0xFF, sizeof(eeprom));
+  memcpy(eeprom + RECIPE_ADDR, &r, sizeof(r));
+
+  /* Hold-up from 5 V to the brown-out level; the checkpoint must make it
+     from 30 ms up */
+  const double falls[] = {200, 100, 50, 30, 20, 10};
+  const double needFallMs = 30;
+  int failures = 0;
+
+  printf("hold-up  detect  commit  reset   margin  fw latency  resume\n");
+  for (double fall : falls) {
+    simFallMs = fall;
+    FILE *in;
+    unsigned int step, fwUs;
+    unsigned long remainingMs;
+    double detectMs, commitMs, resetMs;
+    int fanOn;
+    uint8_t left[SIM_EEPROM_BYTES];
+    if (!simPowerUp(eeprom, powerFailJob, nullptr, &in) ||
+        fscanf(in, "%u %lu %lf %lf %lf %u %d", &step, &remainingMs, &detectMs, &commitMs, &resetMs,
+               &fwUs, &fanOn) != 7 ||
+        !simReadEeprom(in, left)) {
+      fprintf(stderr, "fanSim: power-fail run did not complete\n");
+      return 1;
+    }
+    fclose(in);
+
+    int offered;
+    unsigned int resumedStep;
+    unsigned long savedMs;
+    double ranMs;
+    if (!simPowerUp(left, powerResumeJob, nullptr, &in) ||
+        fscanf(in, "%d %u %lu %lf", &offered, &resumedStep, &savedMs, &ranMs) != 4) {
+      fprintf(stderr, "fanSim: power-up after the cut did not complete\n");
+      return 1;
+    }
+    fclose(in);
+
+    bool committed = commitMs >= 0;
+    char result[64];
+    bool ok = !fanOn;
+    if (committed) {
+      /* Time left as at detection, give or take the loop() pass that
+         writes it; the resumed job runs exactly that */
+      bool right = offered && resumedStep == step && savedMs <= remainingMs &&
+                   remainingMs - savedMs <= detectMs + 1 + SIM_LOOP_US / 1000.0 &&
+                   fabs(ranMs - savedMs) <= 5;
+      if (right) {
+        snprintf(result, sizeof(result), "step %u, %lu ms", resumedStep + 1, savedMs);
+      } else {
+        snprintf(result, sizeof(result), "step %u, %lu ms (expected step %u, ~%lu ms)",
+                 resumedStep + 1, savedMs, step + 1, remainingMs);
+      }
+      ok = ok && right;
+    } else {
+      /* Torn checkpoint: nothing offered */
+      snprintf(result, sizeof(result), offered ? "offered a torn checkpoint" : "none (not committed)");
+      ok = ok && !offered && fall < needFallMs;
+    }
+    char commitText[16] = "    -";
+    if (committed) snprintf(commitText, sizeof(commitText), "%5.1f", commitMs);
+    char marginText[16] = "     -";
+    if (committed) snprintf(marginText, sizeof(marginText), "%6.1f", resetMs - commitMs);
+    printf("%4.0f ms  %5.1f  %s   %5.1f  %s  %7.1f ms  %s%s%s\n", fall, detectMs, commitText,
+           resetMs, marginText, committed ? fwUs / 1000.0 : 0.0, result,
+           fanOn ? ", fan still on" : "", ok ? "" : "  FAIL");
+    if (!ok) failures++;
+  }
+
+  /* Dip to 4.3 V for 10 ms: no reset, job stopped, resume offered */
+  simFallMs = 0;
+  simDipV = 4.3;
+  simDipMs = 10;
+  FILE *in;
+  int running, offered, lcdOffer;
+  unsigned int step, savedStep;
+  unsigned long remainingMs, savedMs;
+  if (!simPowerUp(eeprom, powerDipJob, nullptr, &in) ||
+      fscanf(in, "%d %d %u %u %lu %lu %d", &running, &offered, &step, &savedStep, &remainingMs,
+             &savedMs, &lcdOffer) != 7) {
+    fprintf(stderr, "fanSim: dip run did not complete\n");
+    return 1;
+  }
+  fclose(in);
+  bool ok = !running && offered && lcdOffer && savedStep == step && savedMs <= remainingMs &&
+            remainingMs - savedMs <= 5;
+  printf("dip to %.1f V for %.0f ms: job %s, resume %s at step %u, %lu ms%s\n", simDipV, simDipMs,
+         running ? "still running" : "stopped", offered ? "offered" : "not offered", savedStep + 1,
+         savedMs, ok ? "" : "  FAIL");
+  if (!ok) failures++;
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+/*
+  vacuum scenario
+*/
+
+/* Valve state while the job runs, and when it last closed */
+bool vacuumValveOpen = false;
+unsigned long long vacuumValveClosedUs = 0;
+
+void vacuumProbeValve() {
+  bool open = (PORTB & _BV(PB2)) != 0;
+  if (vacuumValveOpen && !open) vacuumValveClosedUs = simUs;
+  vacuumValveOpen = open;
+}
+
+/* Child: start without vacuum, then with it; drop it 1.1 s in, while the
+   example recipe's first dispense is open */
+void vacuumJob(void *, FILE *out) {
+  simAdc[vacuumPin - A0] = 100;
+  simRun(10);
+  simPressKey('A');
+  simPressKey('#');
+  bool refused = !isRunning;
+  simRun(150);
+  bool shown = !strncmp(simLcdText[1] + 11, "NOVAC", 5);
+
+  simAdc[vacuumPin - A0] = SIM_VACUUM_HELD_RAW;
+  simRun(10);
+  simPressKey('#');
+  bool started = isRunning;
+  while (isRunning && millis() - jobStartMs < 1100) simRun(1);
+
+  /* Lose it between two loop() passes, tracking the valve per tick */
+  simOnMs = vacuumProbeValve;
+  vacuumProbeValve();
+  bool valveWasOpen = vacuumValveOpen;
+  unsigned long long dropUs = simUs;
+  simAdc[vacuumPin - A0] = 100;
+  while (simPwm != 0 && simUs - dropUs < 100000ULL) simAdvance(SIM_TICK_US);
+  unsigned long long cutUs = simPwm == 0 ? simPwmOffUs : 0;
+  bool valveShut = !(PORTB & _BV(PB2));
+  simRun(200);
+  bool stopped = !isRunning;
+  bool tripShown = !strncmp(simLcdText[1] + 11, "NOVAC", 5);
+
+  /* Vacuum back: NOVAC stays until the next start, which clears it */
+  simAdc[vacuumPin - A0] = SIM_VACUUM_HELD_RAW;
+  simRun(200);
+  bool stillShown = !strncmp(simLcdText[1] + 11, "NOVAC", 5);
+  simPressKey('#');
+  bool restarted = isRunning;
+
+  fprintf(out, "%d %d %d %d %lld %d %d %d %d %d\n", refused, shown, started, valveWasOpen,
+          cutUs ? (long long)(cutUs - dropUs) : -1LL, valveShut, stopped, tripShown,
+          stillShown, restarted);
+}
+
+int scenarioVacuum() {
+  if (!simNeedKeys("vacuum", "A#") || !simNeedLcd("vacuum")) return 2;
+
+  RecipeData r;
+  blendDefaultRecipe(r);
+  /* Dispense 1 s into the first step, open for 300 ms */
+  r.steps[0].dispenseMs = 300;
+  uint8_t eeprom[SIM_EEPROM_BYTES];
+  memset(eeprom, 0xFF, sizeof(eeprom));
+  memcpy(eeprom + RECIPE_ADDR, &r, sizeof(r));
+
+  FILE *in;
+  int refused, shown, started, valveWasOpen, valveShut, stopped, tripShown, stillShown, restarted;
+  long long cutUs;
+  if (!simPowerUp(eeprom, vacuumJob, nullptr, &in) ||
+      fscanf(in, "%d %d %d %d %lld %d %d %d %d %d", &refused, &shown, &started, &valveWasOpen,
+             &cutUs, &valveShut, &stopped, &tripShown, &stillShown, &restarted) != 10) {
+    fprintf(stderr, "fanSim: vacuum run did not complete\n");
+    return 1;
+  }
+  fclose(in);
+
+  /* A scan pass, plus the conversion in progress when the input dropped */
+  const long long passUs = (long long)(ADC_SCAN_N + 1) * SIM_ADC_TICKS * SIM_TICK_US;
+  int failures = 0;
+  auto check = [&failures](bool ok, const char *what) {
+    printf("%s%s\n", what, ok ? "" : "  FAIL");
+    if (!ok) failures++;
+  };
+
+  check(refused && shown, "no vacuum: start refused, NOVAC shown");
+  check(started, "vacuum up: job started");
+  printf("vacuum lost at 1.1 s: fan off after %lld us (limit %lld us)\n", cutUs, passUs);
+  check(cutUs >= 0 && cutUs <= passUs, "fan cut within a pass of the scan");
+  check(valveWasOpen && valveShut, "dispense valve closed with it");
+  check(stopped && tripShown, "job stopped, NOVAC shown");
+  check(stillShown && restarted, "NOVAC kept until the next start, which runs");
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+/*
+  thermal scenario
+*/
+
+/* Hottest motor and lowest PWM cap seen */
+double thermalPeakC = 0;
+int thermalMinCap = 255;
+/* Fan driven above the cap (checked per ms, past the 100 ms sample) */
+bool thermalOverCap = false;
+
+void thermalProbe() {
+  thermalPeakC = max(thermalPeakC, simMotorC);
+  thermalMinCap = min(thermalMinCap, tempMaxPwm);
+  if (simPwm > tempMaxPwm) thermalOverCap = true;
+}
+
+/* Child: full-speed manual job, 300 s; report the thermal course */
+void thermalJob(void *, FILE *out) {
+  simSetPots(1023, 1023);
+  simOnMs = thermalProbe;
+  simPressKey('3');
+  simPressKey('0');
+  simPressKey('0');
+  simPressKey('#');
+  unsigned long long startUs = simUs;
+  while (isRunning) simRun(100);
+  double ranS = (simUs - startUs) / 1e6;
+  double stopC = simMotorC;
+  bool hotShown = false;
+
+  /* Hot: '#' refused until it has cooled under the reset level */
+  simRun(200);
+  hotShown = !strncmp(simLcdText[1] + 11, "HOT", 3);
+  simPressKey('#');
+  bool refused = !isRunning;
+  unsigned long long coolStartUs = simUs;
+  while (tempTripped && simUs - coolStartUs < 120000000ULL) simRun(100);
+  double coolS = (simUs - coolStartUs) / 1e6;
+  simPressKey('#');
+  bool restarted = isRunning;
+
+  fprintf(out, "%.1f %.1f %.1f %d %d %d %d %d %.1f %d\n", ranS, thermalPeakC, stopC,
+          thermalMinCap, thermalOverCap, hotShown, refused, tempDeciC, coolS, restarted);
+}
+
+int scenarioThermal() {
+  if (!simNeedKeys("thermal", "30#") || !simNeedLcd("thermal")) return 2;
+
+  uint8_t eeprom[SIM_EEPROM_BYTES];
+  memset(eeprom, 0xFF, sizeof(eeprom));
+  simThermalTauS = 20.0;
+
+  /* Full PWM would reach 25 + rise; derated, the first settles under the
+     trip, the second cannot */
+  const double rises[] = {90.0, 150.0};
+  int failures = 0;
+  for (double rise : rises) {
+    simFullPwmRiseC = rise;
+    FILE *in;
+    double ranS, peakC, stopC, coolS;
+    int minCap, overCap, hotShown, refused, tempDC, restarted;
+    if (!simPowerUp(eeprom, thermalJob, nullptr, &in) ||
+        fscanf(in, "%lf %lf %lf %d %d %d %d %d %lf %d", &ranS, &peakC, &stopC, &minCap, &overCap,
+               &hotShown, &refused, &tempDC, &coolS, &restarted) != 10) {
+      fprintf(stderr, "fanSim: thermal run did not complete\n");
+      return 1;
+    }
+    fclose(in);
+
+    bool tripped = ranS < 299.0;
+    printf("motor %.0f C at full PWM: peak %.1f C, PWM cap down to %d, ", 25.0 + rise, peakC, minCap);
+    bool ok = !overCap;
+    if (rise < 100.0) {
+      /* Derating alone keeps it under the trip */
+      ok = ok && !tripped && peakC < TEMP_TRIP_DC / 10.0 && minCap < 255;
+      printf("ran the full %.0f s%s\n", ranS, ok ? "" : "  FAIL");
+    } else {
+      /* Trip near the limit, refused while hot, runs again once cool */
+      ok = ok && tripped && fabs(stopC - TEMP_TRIP_DC / 10.0) < 2.0 && hotShown && refused &&
+           restarted;
+      printf("tripped at %.0f s, %.1f C; %s while hot, restart after %.1f s at %d.%d C%s\n", ranS,
+             stopC, refused ? "refused" : "STARTED", coolS, tempDC / 10, tempDC % 10,
+             ok ? "" : "  FAIL");
+    }
+    if (overCap) printf("  fan driven above the PWM cap  FAIL\n");
+    if (!ok) failures++;
+  }
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+/*
+  vibration scenario
+*/
+
+/* Child: manual job at the pots' PWM for 20 s, then a stalled loop();
+   report the firmware's vibration figures against the model's */
+void vibrationJob(void *arg, FILE *out) {
+  int pot = *(int *)arg;
+  simSetPots(pot, pot);
+  simRun(500);
+
+  simPressKey('2');
+  simPressKey('0');
+  simPressKey('#');
+  unsigned long long startUs = simUs;
+  unsigned long lcdBytes = simTwiLcdBytes;
+  while (isRunning) simRun(100);
+  double lcdBytesPerS = (simTwiLcdBytes - lcdBytes) / ((simUs - startUs) / 1e6);
+  double modelMg = simVibSamples ? sqrt(simVibSumSq / simVibSamples) : 0;
+  unsigned int overflowsInJob = mpuOverflows;
+
+  /* Vibration page, as the glass shows it */
+  simPressKey('D');
+  simPressKey('D');
+  simRun(300);
+  unsigned int shownMg = 0;
+  bool shown = sscanf(simLcdText[0], "VIB %*u JOB %umg", &shownMg) == 1;
+#if USE_LCD
+  bool glassMatches = !memcmp(simLcdText[0], lcd.text[0], 16) && !memcmp(simLcdText[1], lcd.text[1], 16);
+#else
+  bool glassMatches = false;
+#endif
+
+  /* loop() held up past the FIFO's 0.68 s: overflow seen and recovered */
+  simAdvance(1200000UL);
+  simRun(500);
+  bool recovered = mpuOverflows == overflowsInJob + 1 && simMpuFifoCount < 200;
+
+  fprintf(out, "%u %.1f %lu %lu %u %u %.0f %d %u %d %d\n", vibJobRmsMg, modelMg, (unsigned long)vibJobSamples,
+          simVibSamples, overflowsInJob, i2cErrors, lcdBytesPerS, shown, shownMg, glassMatches,
+          recovered);
+}
+
+int scenarioVibration() {
+  if (!simNeedKeys("vibration", "20#D") || !simNeedLcd("vibration") || !simNeedPots("vibration")) return 2;
+
+  uint8_t eeprom[SIM_EEPROM_BYTES];
+  memset(eeprom, 0xFF, sizeof(eeprom));
+
+  /* Rotor imbalance (g at 3000 RPM) and pot setting */
+  const double imbalances[] = {0.02, 0.2};
+  const int pots[] = {600, 1023};
+  int failures = 0;
+  printf("imbalance  pot   job RMS   model   samples fw/model  LCD bus\n");
+  for (double g : imbalances) {
+    for (int pot : pots) {
+      simVibG = g;
+      FILE *in;
+      unsigned int rmsMg, overflows, errors, shownMg;
+      double modelMg, lcdBytesPerS;
+      unsigned long fwSamples, simSamples;
+      int shown, glassMatches, recovered;
+      if (!simPowerUp(eeprom, vibrationJob, (void *)&pot, &in) ||
+          fscanf(in, "%u %lf %lu %lu %u %u %lf %d %u %d %d", &rmsMg, &modelMg, &fwSamples,
+                 &simSamples, &overflows, &errors, &lcdBytesPerS, &shown, &shownMg,
+                 &glassMatches, &recovered) != 11) {
+        fprintf(stderr, "fanSim: vibration run did not complete\n");
+        return 1;
+      }
+      fclose(in);
+
+      /* Within 5 % (plus 2 mg of truncation); every sample read once,
+         give or take a poll at each end of the job */
+      bool ok = fabs(rmsMg - modelMg) <= 2.0 + 0.05 * modelMg &&
+                labs((long)fwSamples - (long)simSamples) <= 25 && overflows == 0 &&
+                errors == 0 && shown && shownMg == rmsMg && glassMatches && recovered;
+      printf("  %.2f g  %5d  %5u mg  %5.0f mg  %6lu/%-6lu  %5.0f B/s%s\n", g, pot, rmsMg,
+             modelMg, fwSamples, simSamples, lcdBytesPerS, ok ? "" : "  FAIL");
+      if (overflows || errors) printf("  FIFO overflows %u, I2C errors %u  FAIL\n", overflows, errors);
+      if (!shown || shownMg != rmsMg || !glassMatches) printf("  LCD glass does not match the frame  FAIL\n");
+      if (!recovered) printf("  FIFO overflow after a stall not recovered  FAIL\n");
+      if (!ok) failures++;
+    }
+  }
+  /* Whole frame every refresh: 2 rows of address + 16 cells, 4 bytes each */
+  printf("full repaint would be %d B/s\n", 2 * (4 + 16 * 4) * 10);
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+/*
+  faults scenario
+*/
+
+/* A fault injected FAULT_AT_MS into a 30 s manual job (or present from
+   power-up) and cleared holdMs later. Faults the fan must stop for are
+   timed from injection (or from tapKey, tapped tapAtMs in) to PWM 0,
+   then from clearing to running again, with '#' tapped every 100 ms.
+   Bus faults must leave the job alone; they are timed from clearing to
+   the LCD glass matching the frame and accelerometer samples coming in
+   again. */
+const unsigned long FAULT_AT_MS = 3000;
+
+struct FaultCase {
+  const char *name;
+  void (*inject)(bool on);
+  unsigned long holdMs;
+  bool atPowerUp;
+  bool stopsJob;
+  char tapKey;
+  unsigned long tapAtMs;
+  double safeLimitMs;
+  double recoverLimitMs;
+};
+
+/* Lowest PWM seen while the fault was on, the job running */
+int faultMinPwm = 255;
+bool faultOn = false;
+
+void faultProbe() {
+  if (faultOn && isRunning) faultMinPwm = min(faultMinPwm, simPwm);
+}
+
+bool faultRunning() {
+  return isRunning && !dipWaiting && readMeasuredRpm() > 0;
+}
+
+bool faultBusInStep() {
+#if USE_LCD
+  return !lcd.dirty[0] && !lcd.dirty[1] && !memcmp(simLcdText[0], lcd.text[0], LCD_COLS) &&
+         !memcmp(simLcdText[1], lcd.text[1], LCD_COLS);
+#else
+  return false;
+#endif
+}
+
+/* Child: one line, "safeMs recoverMs minPwm spunAtPowerUp"; -1 for
+   never */
+void faultJob(void *arg, FILE *out) {
+  const FaultCase &c = *(const FaultCase *)arg;
+  simOnMs = faultProbe;
+  simSetPots(700, 512);
+
+  double safeMs = -1;
+  bool spun = false;
+  unsigned long long injectUs = simUs;
+  if (c.atPowerUp) {
+    /* Already on: nothing may start */
+    faultOn = true;
+    for (unsigned long t = 0; t < c.holdMs; t++) {
+      simRun(1);
+      spun = spun || simPwm > 0;
+    }
+  } else {
+    simPressKey('3');
+    simPressKey('0');
+    simPressKey('#');
+    simRun(FAULT_AT_MS);
+
+    injectUs = simUs;
+    faultOn = true;
+    c.inject(true);
+    unsigned long long tapUs = 0;
+    for (unsigned long t = 0; t < c.holdMs; t++) {
+      if (c.tapKey && t == c.tapAtMs) {
+        simKey = c.tapKey;
+        tapUs = simUs;
+      }
+      simRun(1);
+      if (c.stopsJob && safeMs < 0 && simPwm == 0) {
+        safeMs = (simPwmOffUs - (tapUs ? tapUs : injectUs)) / 1000.0;
+      }
+    }
+  }
+
+  c.inject(false);
+  faultOn = false;
+  unsigned long long clearUs = simUs;
+  if (c.atPowerUp) {
+    simPressKey('3');
+    simPressKey('0');
+  }
+  unsigned long samplesAtClear = vibJobSamples;
+  double recoverMs = -1;
+  for (unsigned long t = 0; t < 10000 && recoverMs < 0; t++) {
+    if (c.stopsJob || c.atPowerUp) {
+      if (!isRunning && t % 100 == 0) simKey = '#';
+      simRun(1);
+      if (faultRunning()) recoverMs = (simUs - clearUs) / 1000.0;
+    } else {
+      simRun(1);
+      if (faultBusInStep() && vibJobSamples > samplesAtClear) recoverMs = (simUs - clearUs) / 1000.0;
+    }
+  }
+
+  fprintf(out, "%.3f %.1f %d %d\n", safeMs, recoverMs, faultMinPwm, spun);
+}
+
+/* Child: a 10 s job across the millis() wrap; "durationMs minPwm" */
+void faultRolloverJob(void *, FILE *out) {
+  simOnMs = faultProbe;
+  simSetPots(700, 512);
+  while (millis() < 0xFFFFFFFFUL - 5000UL) simRun(1);
+
+  simPressKey('1');
+  simPressKey('0');
+  simPressKey('#');
+  unsigned long long startUs = simUs;
+  simRun(200);
+  /* Past spin-up, every ms must drive the fan */
+  faultOn = true;
+  while (isRunning && simUs - startUs < 30000000ULL) simRun(1);
+  faultOn = false;
+
+  fprintf(out, "%.1f %d\n", (simUs - startUs) / 1000.0, faultMinPwm);
+}
+
+void faultVacuumOpen(bool on) {
+  simAdcForce[vacuumPin - A0] = on ? 0 : -1;
+}
+
+void faultVacuumShorted(bool on) {
+  simAdcForce[vacuumPin - A0] = on ? 1023 : -1;
+}
+
+void faultNtcOpen(bool on) {
+  simAdcForce[ntcPin - A0] = on ? 1023 : -1;
+}
+
+void faultNtcShorted(bool on) {
+  simAdcForce[ntcPin - A0] = on ? 0 : -1;
+}
+
+void faultTach(bool on) {
+  simTachCut = on;
+}
+
+void faultI2cNack(bool on) {
+  simI2cNack = on;
+}
+
+/* Slave holding SDA; once the fault ends it still does until clocked
+   free, which only the firmware's bus clear does */
+void faultI2cHang(bool on) {
+  simI2cHang = on;
+  if (!on) simI2cHeldBits = SIM_I2C_HELD_BITS;
+}
+
+void faultKeyD(bool on) {
+  strcpy(simHeldKeys, on ? "D" : "");
+}
+
+void faultKey5(bool on) {
+  strcpy(simHeldKeys, on ? "5" : "");
+}
+
+void faultKeyHash(bool on) {
+  strcpy(simHeldKeys, on ? "#" : "");
+}
+
+int scenarioFaults() {
+  if (!simNeedKeys("faults", "0135#D") || !simNeedLcd("faults")) return 2;
+
+  uint8_t eeprom[SIM_EEPROM_BYTES];
+  memset(eeprom, 0xFF, sizeof(eeprom));
+
+  const FaultCase cases[] = {
+      {"I2C: no ACK for 300 ms", faultI2cNack, 300, false, false, 0, 0, 0, 100},
+      {"I2C: bus held for 300 ms", faultI2cHang, 300, false, false, 0, 0, 0, 100},
+      {"key D stuck", faultKeyD, 2000, false, true, 0, 0, 2, 1000},
+      {"key 5 stuck, then D", faultKey5, 2000, false, true, 'D', 500, 2, 1000},
+      {"key # stuck at power-up", faultKeyHash, 2000, true, true, 0, 0, 0, 1000},
+      {"tach lost", faultTach, 3000, false, true, 0, 0, 2000, 1000},
+      {"vacuum sensor open (0)", faultVacuumOpen, 1000, false, true, 0, 0, 1, 1000},
+      {"vacuum sensor shorted (1023)", faultVacuumShorted, 1000, false, true, 0, 0, 1, 1000},
+      {"NTC open (1023)", faultNtcOpen, 2000, false, true, 0, 0, 1000, 2000},
+      {"NTC shorted (0)", faultNtcShorted, 2000, false, true, 0, 0, 1000, 2000},
+  };
+
+  int failures = 0;
+  printf("fault                           safe (limit)        recover (limit)\n");
+  for (const FaultCase &c : cases) {
+    if (c.atPowerUp) c.inject(true);
+    FILE *in;
+    bool ran = simPowerUp(eeprom, faultJob, (void *)&c, &in);
+    if (c.atPowerUp) c.inject(false);
+
+    double safeMs, recoverMs;
+    int minPwm, spun;
+    if (!ran || fscanf(in, "%lf %lf %d %d", &safeMs, &recoverMs, &minPwm, &spun) != 4) {
+      fprintf(stderr, "fanSim: fault run did not complete (%s)\n", c.name);
+      return 1;
+    }
+    fclose(in);
+
+    char safe[32];
+    bool ok = recoverMs >= 0 && recoverMs <= c.recoverLimitMs;
+    if (c.atPowerUp) {
+      snprintf(safe, sizeof(safe), "%s", spun ? "SPUN" : "held off");
+      ok = ok && !spun;
+    } else if (c.stopsJob) {
+      snprintf(safe, sizeof(safe), "%.3f ms (%.0f)", safeMs, c.safeLimitMs);
+      ok = ok && safeMs >= 0 && safeMs <= c.safeLimitMs;
+    } else {
+      /* The job must not notice */
+      snprintf(safe, sizeof(safe), "%s", minPwm > 0 ? "job unaffected" : "FAN CUT");
+      ok = ok && minPwm > 0;
+    }
+    printf("  %-30s%-20s%8.1f ms (%.0f)%s\n", c.name, safe, recoverMs, c.recoverLimitMs, ok ? "" : "  FAIL");
+    if (!ok) failures++;
+  }
+
+  /* Power up 8 s before the millis() wrap; the job straddles it */
+  simUs = (0x100000000ULL - 8000ULL) * 1000ULL;
+  FILE *in;
+  double durationMs;
+  int minPwm;
+  bool ran = simPowerUp(eeprom, faultRolloverJob, nullptr, &in);
+  simUs = 0;
+  if (!ran || fscanf(in, "%lf %d", &durationMs, &minPwm) != 2) {
+    fprintf(stderr, "fanSim: rollover run did not complete\n");
+    return 1;
+  }
+  fclose(in);
+  bool ok = fabs(durationMs - 10000.0) <= 2.0 && minPwm > 0;
+  printf("  %-30s%-20s%8.1f ms job for 10 s%s\n", "millis() wrap mid-job", minPwm > 0 ? "job unaffected" : "FAN CUT",
+         durationMs, ok ? "" : "  FAIL");
+  if (!ok) failures++;
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+/*
+  soak scenario
+*/
+
+const unsigned long long SIM_MS_WRAP_US = 0x100000000ULL * 1000ULL;
+const unsigned long long SIM_US_WRAP_US = 0x100000000ULL;
+const unsigned long long SIM_YEAR_US = 365ULL * 86400ULL * 1000000ULL;
+
+/* Job under test: the '#' tap, the keypad scan that took it (the
+   start) and length; countdown and UI cadence checked against them
+   every millisecond */
+bool soakInJob = false;
+unsigned long long soakPressUs = 0;
+unsigned long long soakStartUs = 0;
+unsigned long long soakKeyWaitMaxUs = 0;
+unsigned long soakDurS = 0;
+unsigned long soakCountdownErrors = 0;
+unsigned long soakLastUiMs = 0;
+unsigned long long soakUiChangeUs = 0;
+unsigned long long soakUiGapMaxUs = 0;
+
+void soakProbe() {
+  if (!soakInJob || !isRunning) return;
+  soakStartUs = simKeyTapUs;
+
+  /* Elapsed from the 64-bit clock, in the firmware's millis() steps */
+  unsigned long long elapsedMs = simUs / 1000ULL - soakStartUs / 1000ULL;
+  unsigned long long durMs = soakDurS * 1000ULL;
+  unsigned long wantSec = elapsedMs >= durMs ? 0 : soakDurS - (unsigned long)(elapsedMs / 1000ULL);
+  unsigned long wantMs = elapsedMs >= durMs ? 0 : (unsigned long)(durMs - elapsedMs);
+  if (getRemainingSeconds() != wantSec || remainingJobMs() != wantMs) soakCountdownErrors++;
+
+#if USE_LCD
+  if (lastUiMs != soakLastUiMs) {
+    soakUiGapMaxUs = max(soakUiGapMaxUs, simUs - soakUiChangeUs);
+    soakLastUiMs = lastUiMs;
+    soakUiChangeUs = simUs;
+  }
+#endif
+}
+
+/* Manual job of durS (1..9) seconds from now, run to the end and idled
+   until the fan has stopped; its length in ms, the scan that took the
+   '#' to PWM off */
+double soakJob(unsigned long durS) {
+  simPressKey('*');
+  simPressKey((char)('0' + durS));
+  soakPressUs = simUs;
+  soakStartUs = simUs;
+  soakDurS = durS;
+#if USE_LCD
+  soakLastUiMs = lastUiMs;
+#endif
+  soakUiChangeUs = simUs;
+  soakInJob = true;
+  simPressKey('#');
+  while (isRunning && simUs - soakPressUs < (durS + 2) * 1000000ULL) simRun(1);
+  soakInJob = false;
+  soakKeyWaitMaxUs = max(soakKeyWaitMaxUs, soakStartUs - soakPressUs);
+  double lengthMs = (simPwmOffUs - soakStartUs) / 1000.0;
+
+  while (simRpm >= 1.0) simRun(10);
+  simRun(TACH_TIMEOUT_US / 1000UL + 100);
+  return lengthMs;
+}
+
+/* Warp to at (a tick boundary), after the job's idle */
+void soakWarpTo(unsigned long long at) {
+  at -= at % SIM_TICK_US;
+  if (at > simUs) simWarp(at - simUs);
+}
+
+/* Firmware reports the stopped fan as stopped */
+unsigned long soakStaleRpm = 0;
+
+void soakCheckStopped() {
+  simRun(1);
+  if (readMeasuredRpm() != 0) soakStaleRpm++;
+}
+
+struct SoakStats {
+  unsigned long jobs;
+  double minErrMs;
+  double maxErrMs;
+  double sumErrMs;
+
+  void add(double errMs) {
+    minErrMs = jobs ? min(minErrMs, errMs) : errMs;
+    maxErrMs = jobs ? max(maxErrMs, errMs) : errMs;
+    sumErrMs += errMs;
+    jobs++;
+  }
+};
+
+void soakReport(FILE *out, const SoakStats &st) {
+  fprintf(out, "%lu %.3f %.3f %.3f %lu %.1f %lu %.1f\n", st.jobs, st.minErrMs, st.maxErrMs, st.sumErrMs,
+          soakCountdownErrors, soakUiGapMaxUs / 1000.0, soakStaleRpm, soakKeyWaitMaxUs / 1000.0);
+}
+
+#if !USE_TT_SCHEDULE
+/* Every task runs every pass */
+const byte TT_KEYPAD = 0x01;
+const byte TT_UI = 0x08;
+#endif
+
+/* Longest a task can keep something waiting: a loop() pass, and under
+   USE_TT_SCHEDULE the longest run of slots without it (ttTask one of
+   TT_KEYPAD, TT_UI, ...) */
+double soakTaskWaitMs(byte ttTask) {
+  double waitMs = SIM_LOOP_US / 1000.0;
+#if USE_TT_SCHEDULE
+  byte gap = 0, maxGap = 0;
+  for (byte i = 0; i < 2 * TT_SLOTS; i++) {
+    gap = (pgm_read_byte(&ttSchedule[i % TT_SLOTS]) & ttTask) ? 0 : gap + 1;
+    maxGap = max(maxGap, gap);
+  }
+  waitMs += (maxGap + 1) * TT_SLOT_US / 1000.0;
+#else
+  (void)ttTask;
+#endif
+  return waitMs;
+}
+
+/* Child: 3 s jobs started at every phase of a millis() wrap (micros()
+   wraps there too), then of a micros()-only wrap. Each start lands the
+   last tach edge of the job before just behind the new micros(). */
+void soakWrapJob(void *, FILE *out) {
+  simOnMs = soakProbe;
+  simSetPots(700, 512);
+  simRun(500);
+
+  SoakStats st = {};
+  const unsigned long durS = 3;
+  const unsigned long long wraps[] = {SIM_US_WRAP_US * 3, SIM_MS_WRAP_US, SIM_US_WRAP_US * 1003 + SIM_MS_WRAP_US};
+  for (unsigned long long wrapUs : wraps) {
+    for (unsigned long long beforeUs = 0; beforeUs <= durS * 1000000ULL + 500000ULL; beforeUs += 97004ULL) {
+      unsigned long long at = wrapUs - beforeUs;
+      /* Whole wraps of micros() since the last edge, plus a little */
+      unsigned long long sinceEdge = (uint32_t)((uint32_t)at - tachLastUs);
+      if (sinceEdge > TACH_TIMEOUT_US / 2) at -= sinceEdge - TACH_TIMEOUT_US / 2;
+      if (at <= simUs) at += SIM_US_WRAP_US;
+      soakWarpTo(at);
+      soakCheckStopped();
+      soakWarpTo(wrapUs - beforeUs);
+      st.add(soakJob(durS) - durS * 1000.0);
+    }
+  }
+  soakReport(out, st);
+}
+
+/* Child: a year of jobs (1 to 9 s), the idle between them warped, one
+   across each millis() wrap */
+void soakYearJob(void *arg, FILE *out) {
+  unsigned long jobs = *(unsigned long *)arg;
+  simOnMs = soakProbe;
+  simSetPots(700, 512);
+  simRun(500);
+
+  SoakStats st = {};
+  uint32_t lfsr = 0xACE1u;
+  unsigned long long gapUs = SIM_YEAR_US / jobs;
+  unsigned long long nextWrapUs = SIM_MS_WRAP_US;
+  for (unsigned long i = 0; i < jobs && simUs < SIM_YEAR_US; i++) {
+    lfsr = lfsr * 1664525u + 1013904223u;
+    unsigned long durS = 1 + (lfsr >> 8) % 9;
+    /* Half to one and a half gaps, at any microsecond */
+    unsigned long long at = simUs + gapUs / 2 + (unsigned long long)((lfsr >> 4) % 1000) * (gapUs / 1000) +
+                            (lfsr % 1000);
+    if (at + durS * 1000000ULL > nextWrapUs) {
+      at = nextWrapUs - (lfsr % (durS * 1000000ULL));
+      nextWrapUs += SIM_MS_WRAP_US;
+    }
+    soakWarpTo(at);
+    soakCheckStopped();
+    st.add(soakJob(durS) - durS * 1000.0);
+  }
+  soakReport(out, st);
+}
+
+/* Child: millions of countdowns, straight through getRemainingSeconds()
+   and remainingJobMs(): random starts (half of them within a job of a
+   millis() wrap), durations and times into the job, against the 64-bit
+   clock. The firmware is not running meanwhile. */
+void soakCountdownJob(void *arg, FILE *out) {
+  unsigned long cycles = *(unsigned long *)arg;
+  unsigned long long savedUs = simUs;
+  uint64_t x = 0x9E3779B97F4A7C15ULL;
+  unsigned long errors = 0;
+  for (unsigned long i = 0; i < cycles; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    unsigned long durS = 1 + (unsigned long)(x % 86400ULL);
+    unsigned long long durMs = durS * 1000ULL;
+    unsigned long long startMs = (x >> 20) % (SIM_YEAR_US / 1000ULL);
+    if (i & 1) startMs = (startMs / 0x100000000ULL + 1) * 0x100000000ULL - (x >> 3) % durMs;
+    unsigned long long intoMs = (x >> 11) % (durMs + 2000ULL);
+
+    isRunning = true;
+    dipWaiting = false;
+    jobDurationSeconds = durS;
+    jobStartMs = (uint32_t)startMs;
+    simUs = (startMs + intoMs) * 1000ULL + (x >> 40) % 1000ULL;
+
+    unsigned long wantSec = intoMs >= durMs ? 0 : durS - (unsigned long)(intoMs / 1000ULL);
+    unsigned long wantMs = intoMs >= durMs ? 0 : (unsigned long)(durMs - intoMs);
+    if (getRemainingSeconds() != wantSec || remainingJobMs() != wantMs) errors++;
+  }
+  isRunning = false;
+  simUs = savedUs;
+  fprintf(out, "%lu\n", errors);
+}
+
+int scenarioSoak(unsigned long yearJobs) {
+  if (!simNeedKeys("soak", "*0123456789#")) return 2;
+
+  uint8_t eeprom[SIM_EEPROM_BYTES];
+  memset(eeprom, 0xFF, sizeof(eeprom));
+  int failures = 0;
+
+  /* Full loop() jobs */
+  struct {
+    const char *name;
+    void (*run)(void *, FILE *);
+  } runs[] = {{"across the wraps", soakWrapJob}, {"a year", soakYearJob}};
+  for (auto &r : runs) {
+    FILE *in;
+    unsigned long jobs, countdownErrors, staleRpm;
+    double minErrMs, maxErrMs, sumErrMs, uiGapMs, keyWaitMs;
+    if (!simPowerUp(eeprom, r.run, &yearJobs, &in) ||
+        fscanf(in, "%lu %lf %lf %lf %lu %lf %lu %lf", &jobs, &minErrMs, &maxErrMs, &sumErrMs, &countdownErrors,
+               &uiGapMs, &staleRpm, &keyWaitMs) != 8) {
+      fprintf(stderr, "fanSim: soak run did not complete (%s)\n", r.name);
+      return 1;
+    }
+    fclose(in);
+
+    /* Ends on the first loop() pass once millis() has moved on by the
+       duration: up to a millisecond short, a pass late. Starts on the
+       keypad scan after the '#'; the LCD refreshes on the first UI pass
+       100 ms on */
+    double keyWaitLimitMs = soakTaskWaitMs(TT_KEYPAD);
+    bool ok = jobs > 0 && minErrMs > -1.0 && maxErrMs <= SIM_LOOP_US / 1000.0 && !countdownErrors &&
+              uiGapMs <= 100.0 + soakTaskWaitMs(TT_UI) && !staleRpm && keyWaitMs <= keyWaitLimitMs;
+    printf("%s: %lu jobs, length error %+.3f to %+.3f ms, mean %+.3f ms, %+.1f ms in all;\n"
+           "  countdown %lu wrong, LCD refresh gap up to %.1f ms, %lu stale RPM after idle,\n"
+           "  '#' to start up to %.1f ms (%.1f)%s\n",
+           r.name, jobs, minErrMs, maxErrMs, sumErrMs / jobs, sumErrMs, countdownErrors, uiGapMs, staleRpm,
+           keyWaitMs, keyWaitLimitMs, ok ? "" : "  FAIL");
+    if (!ok) failures++;
+  }
+
+  /* Countdown arithmetic alone */
+  unsigned long cycles = 4000000UL;
+  FILE *in;
+  unsigned long errors;
+  if (!simPowerUp(eeprom, soakCountdownJob, &cycles, &in) || fscanf(in, "%lu", &errors) != 1) {
+    fprintf(stderr, "fanSim: countdown run did not complete\n");
+    return 1;
+  }
+  fclose(in);
+  printf("countdown: %lu of %lu cycles wrong%s\n", errors, cycles, errors ? "  FAIL" : "");
+  if (errors) failures++;
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+/*
+  history scenario
+*/
+
+/* Jobs run by the second power-up: enough to wrap the ring */
+const unsigned int HIST_WRAP_JOBS = HISTORY_SLOTS + 6;
+
+/* Manual job of durS seconds */
+void histStart(unsigned long durS) {
+  simPressKey('*');
+  simPressKey((char)('0' + durS));
+  simPressKey('#');
+}
+
+void histRunOut() {
+  while (isRunning) simRun(10);
+  simRun(200);
+}
+
+/* Child: power-up phase (1 to 3) on the EEPROM given; reports the
+   firmware's ring position, its production counters, its reading of
+   every record, then the EEPROM */
+void histJob(void *arg, FILE *out) {
+  int phase = *(int *)arg;
+  simSetPots(700, 512);
+  unsigned int wornErr = 0;
+  fprintf(out, "%u %u ", historyCount, historyNext);
+  simRun(500);
+
+  if (phase == 1) {
+    /* One of each end, then a cut with the job's record open; the first
+       on a fan 10 % slow */
+    simFanWear = 0.9;
+    histStart(6);
+    simRun(5000);
+    wornErr = (unsigned int)lround(estimateRpmFromPwm(simPwm) * (1.0 - simFanWear));
+    histRunOut();
+    simFanWear = 1.0;
+    histStart(5);
+    simRun(1000);
+    simPressKey('D');
+    histRunOut();
+    histStart(5);
+    simRun(1000);
+    simAdc[vacuumPin - A0] = 100;
+    histRunOut();
+    simAdc[vacuumPin - A0] = SIM_VACUUM_HELD_RAW;
+    simRun(500);
+    simPressKey('A');
+    simPressKey('#');
+    simRun(2000);
+    simPressKey('D');
+    histRunOut();
+    simPressKey('A');
+    histStart(3);
+    simRun(500);
+  } else if (phase == 2) {
+    histStart(1);
+    histRunOut();
+    for (unsigned int i = 1; i < HIST_WRAP_JOBS; i++) {
+      simPressKey('#');
+      histRunOut();
+    }
+  }
+
+  fprintf(out, "%u %u %u %u ", historyCount, historyNext, historyDropped, wornErr);
+  fprintf(out, "%lu %lu %lu %u\n", (unsigned long)prod.jobsDone, (unsigned long)prod.jobsAborted,
+          (unsigned long)prod.spinSec, prodJobsPerHour);
+  for (byte i = 0; i < historyCount; i++) {
+    HistoryRecord r;
+    while (!historyRead(i, r)) simRun(1);
+    fprintf(out, "%u %lu %u %u %u %u %u\n", r.boot, (unsigned long)r.startSec, r.runSec, r.recipeId, r.end,
+            r.errMean, r.errMax);
+  }
+  simWriteEeprom(out);
+}
+
+/* Expected record */
+struct HistWant {
+  uint16_t boot;
+  uint8_t end;
+  uint8_t recipeId;
+  uint16_t runSec;
+};
+
+int scenarioHistory() {
+  if (!simNeedKeys("history", "*1356#AD") || !simNeedPots("history")) return 2;
+
+  RecipeData recipe;
+  blendDefaultRecipe(recipe);
+  uint8_t eeprom[SIM_EEPROM_BYTES];
+  memset(eeprom, 0xFF, sizeof(eeprom));
+  memcpy(eeprom + RECIPE_ADDR, &recipe, sizeof(recipe));
+
+  /* Everything the three power-ups should leave, in order */
+  std::vector<HistWant> want = {
+      {1, JOB_MANUAL << 4 | JOB_END_DONE, 0, 6},
+      {1, JOB_MANUAL << 4 | JOB_END_KEY, 0, 1},
+      {1, JOB_MANUAL << 4 | JOB_END_VACUUM, 0, 1},
+      {1, JOB_RECIPE << 4 | JOB_END_KEY, recipe.id, 2},
+      {1, JOB_MANUAL << 4 | JOB_END_POWER, 0, HISTORY_RUN_OPEN},
+  };
+  for (unsigned int i = 0; i < HIST_WRAP_JOBS; i++) want.push_back({2, JOB_MANUAL << 4 | JOB_END_DONE, 0, 1});
+
+  const char *names[] = {"", "one of each end, then cut", "wrap the ring", "power-up on it"};
+  unsigned int jobsSoFar = 0;
+  const unsigned int jobsIn[] = {0, 5, HIST_WRAP_JOBS, 0};
+  /* Production counters after each phase; the cut job is neither, and
+     jobs per hour do not outlive a power-up */
+  const unsigned long doneAfter[] = {0, 1, 1 + HIST_WRAP_JOBS, 1 + HIST_WRAP_JOBS};
+  const unsigned long abortedAfter[] = {0, 3, 3, 3};
+  const unsigned int perHourIn[] = {0, 1, HIST_WRAP_JOBS, 0};
+  unsigned long runSoFar = 0;
+  int failures = 0;
+  for (int phase = 1; phase <= 3; phase++) {
+    FILE *in;
+    unsigned int countAtBoot, nextAtBoot, count, next, dropped, wornErr, perHour;
+    unsigned long done, aborted, spinSec;
+    bool ran = simPowerUp(eeprom, histJob, &phase, &in) &&
+               fscanf(in, "%u %u %u %u %u %u %lu %lu %lu %u", &countAtBoot, &nextAtBoot, &count, &next, &dropped,
+                      &wornErr, &done, &aborted, &spinSec, &perHour) == 10;
+    std::vector<HistoryRecord> seen(ran ? count : 0);
+    for (HistoryRecord &r : seen) {
+      unsigned int boot, runSec, recipeId, end, errMean, errMax;
+      unsigned long startSec;
+      ran = ran && fscanf(in, "%u %lu %u %u %u %u %u", &boot, &startSec, &runSec, &recipeId, &end, &errMean,
+                          &errMax) == 7;
+      r = {(uint32_t)startSec, (uint16_t)runSec, (uint8_t)recipeId, (uint8_t)end, (uint8_t)errMean,
+           (uint8_t)errMax, (uint16_t)boot};
+    }
+    if (!ran || !simReadEeprom(in, eeprom)) {
+      fprintf(stderr, "fanSim: history run did not complete (phase %d)\n", phase);
+      return 1;
+    }
+    fclose(in);
+
+    unsigned int bootCount = jobsSoFar < HISTORY_SLOTS ? jobsSoFar : HISTORY_SLOTS;
+    jobsSoFar += jobsIn[phase];
+    unsigned int wantCount = jobsSoFar < HISTORY_SLOTS ? jobsSoFar : HISTORY_SLOTS;
+    unsigned int first = jobsSoFar - wantCount;
+
+    /* The firmware's view, oldest first, and the slots themselves */
+    int wrong = 0;
+    uint32_t lastStart = 0;
+    for (unsigned int i = 0; i < wantCount && i < seen.size(); i++) {
+      const HistWant &w = want[first + i];
+      const HistoryRecord &r = seen[i];
+      HistoryRecord slot;
+      memcpy(&slot, eeprom + HISTORY_ADDR + ((first + i) % HISTORY_SLOTS) * sizeof(HistoryRecord), sizeof(slot));
+      bool ok = r.boot == w.boot && r.end == w.end && r.recipeId == w.recipeId && r.runSec == w.runSec &&
+                r.errMax >= r.errMean && !memcmp(&slot, &r, sizeof(slot)) &&
+                (i == 0 || r.boot != seen[i - 1].boot || r.startSec >= lastStart);
+      if (!ok) {
+        printf("  record %u: boot %u end %02x recipe %u run %u (want boot %u end %02x recipe %u run %u)%s\n",
+               first + i, r.boot, r.end, r.recipeId, r.runSec, w.boot, w.end, w.recipeId, w.runSec,
+               memcmp(&slot, &r, sizeof(slot)) ? ", EEPROM differs" : "");
+        wrong++;
+      }
+      lastStart = r.startSec;
+    }
+
+    /* The worn fan's error, to the record's 8 RPM */
+    if (wornErr) {
+      unsigned int meanRpm = (unsigned int)seen[0].errMean << HISTORY_ERR_SHIFT;
+      unsigned int maxRpm = (unsigned int)seen[0].errMax << HISTORY_ERR_SHIFT;
+      bool errOk = abs((int)meanRpm - (int)wornErr) <= 16 && maxRpm >= meanRpm;
+      printf("  fan 10 %% slow: tach error %u RPM mean, %u max, model %u%s\n", meanRpm, maxRpm, wornErr,
+             errOk ? "" : "  FAIL");
+      if (!errOk) wrong++;
+    }
+
+    bool ok = countAtBoot == bootCount && nextAtBoot == (jobsSoFar - jobsIn[phase]) % HISTORY_SLOTS &&
+              count == wantCount && next == jobsSoFar % HISTORY_SLOTS && !dropped && !wrong;
+    printf("%-27s found %2u at power-up, %2u records, next slot %2u, %u wrong%s\n", names[phase], countAtBoot,
+           count, next, wrong, ok ? "" : "  FAIL");
+    if (!ok) failures++;
+
+    /* Counters: spin time at least what the closed records ran, and
+       their copy in EEPROM (the one with the most jobs) agrees */
+    for (unsigned int i = jobsSoFar - jobsIn[phase]; i < jobsSoFar; i++) {
+      if (want[i].runSec != HISTORY_RUN_OPEN) runSoFar += want[i].runSec;
+    }
+    ProdCounters stored = {};
+    for (unsigned int c = 0; c < PROD_COPIES; c++) {
+      ProdCounters p;
+      memcpy(&p, eeprom + PROD_ADDR + c * sizeof(ProdCounters), sizeof(p));
+      if (p.jobsDone != 0xFFFFFFFFUL && p.jobsDone + p.jobsAborted >= stored.jobsDone + stored.jobsAborted) {
+        stored = p;
+      }
+    }
+    bool prodOk = done == doneAfter[phase] && aborted == abortedAfter[phase] && perHour == perHourIn[phase] &&
+                  spinSec >= runSoFar && spinSec < runSoFar + 5 * (done + aborted) &&
+                  stored.jobsDone == done && stored.jobsAborted == aborted && stored.spinSec == spinSec;
+    printf("%-27s counters %2lu done %lu aborted, spin %3lu s, %2u/h%s\n", "", done, aborted, spinSec, perHour,
+           prodOk ? "" : "  FAIL");
+    if (!prodOk) failures++;
+  }
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+/*
+  modbus scenario
+*/
+
+#if USE_MODBUS
+/* Recipe window requests (function, first word, words): the most one
+   reply holds, the rest of the image, all of it (too much for one
+   reply), the most one request holds written back unchanged, and the
+   first read again */
+const unsigned int MB_READ_MAX = (MODBUS_BUF_SIZE - 5) / 2;
+const unsigned int MB_WRITE_MAX = (MODBUS_BUF_SIZE - 9) / 2;
+const unsigned int mbRequests[][3] = {
+    {0x03, 0, MB_READ_MAX},
+    {0x03, MB_READ_MAX, MODBUS_RECIPE_WORDS - MB_READ_MAX},
+    {0x03, 0, MODBUS_RECIPE_WORDS},
+    {0x10, 0, MB_WRITE_MAX},
+    {0x03, 0, MB_READ_MAX},
+};
+const int MB_REQUESTS = sizeof(mbRequests) / sizeof(mbRequests[0]);
+
+/* Recipe image byte as the window has it (word n is bytes 2n, 2n + 1) */
+uint8_t mbImageByte(const RecipeData &r, unsigned int b) {
+  return b < sizeof(r) ? ((const uint8_t *)&r)[b] : 0;
+}
+
+void mbAppendCrc(std::vector<uint8_t> &frame) {
+  unsigned int crc = 0xFFFF;
+  for (uint8_t b : frame) crc = modbusCrcUpdate(crc, b);
+  frame.push_back((uint8_t)(crc & 0xFF));
+  frame.push_back((uint8_t)(crc >> 8));
+}
+
+/* Request (CRC appended here) over the UART; the reply, CRC and all */
+std::vector<uint8_t> mbTransact(std::vector<uint8_t> req) {
+  mbAppendCrc(req);
+  simUartOut.clear();
+  simUartIn = req;
+  simUartInPos = 0;
+  /* Request, T3.5 and the longest reply */
+  simRun(30);
+  return simUartOut;
+}
+
+/* Child: each request in turn, its reply as hex */
+void modbusJob(void *, FILE *out) {
+  simRun(100);
+  for (const auto &q : mbRequests) {
+    unsigned int reg = MODBUS_RECIPE_BASE + q[1];
+    std::vector<uint8_t> req = {MODBUS_ADDR, (uint8_t)q[0], (uint8_t)(reg >> 8), (uint8_t)reg, (uint8_t)(q[2] >> 8),
+                                (uint8_t)q[2]};
+    if (q[0] == 0x10) {
+      req.push_back((uint8_t)(q[2] * 2));
+      for (unsigned int b = q[1] * 2; b < (q[1] + q[2]) * 2; b++) req.push_back(mbImageByte(recipeData, b));
+    }
+    std::vector<uint8_t> reply = mbTransact(req);
+
+    fprintf(out, "%zu", reply.size());
+    for (uint8_t b : reply) fprintf(out, " %02x", b);
+    fprintf(out, "\n");
+  }
+}
+
+/* Holding register writes: FC 06 for one value, FC 16 for more. True if
+   the reply is the echo, or the exception ex when given */
+bool mbWrite(unsigned int reg, std::vector<unsigned int> values, uint8_t ex = 0) {
+  uint8_t fn = values.size() == 1 ? 0x06 : 0x10;
+  std::vector<uint8_t> req = {MODBUS_ADDR, fn, (uint8_t)(reg >> 8), (uint8_t)reg};
+  if (fn == 0x06) {
+    req.insert(req.end(), {(uint8_t)(values[0] >> 8), (uint8_t)values[0]});
+  } else {
+    req.insert(req.end(), {0, (uint8_t)values.size(), (uint8_t)(values.size() * 2)});
+    for (unsigned int v : values) req.insert(req.end(), {(uint8_t)(v >> 8), (uint8_t)v});
+  }
+
+  std::vector<uint8_t> want;
+  if (ex) {
+    want = {MODBUS_ADDR, (uint8_t)(fn | 0x80), ex};
+  } else {
+    want.assign(req.begin(), req.begin() + 6);
+  }
+  mbAppendCrc(want);
+  return mbTransact(req) == want;
+}
+
+/* Child: the job settings and the command over the holding registers;
+   a line per check, its result and what it checked */
+void modbusSettingsJob(void *, FILE *out) {
+  const unsigned int recipeReg = MODBUS_HOLD_DURATION + 2;
+  const unsigned int commandReg = MODBUS_HOLD_DURATION + MODBUS_SETTING_WORDS;
+  const unsigned long durS = 70000UL;
+  simRun(100);
+
+  /* As if 'B' had been pressed on a full keypad */
+  trajMode = true;
+  bool ok = mbWrite(recipeReg, {1}) && recipeMode && !trajMode;
+  fprintf(out, "%d settings: recipe mode on while idle, trajectory mode off\n", ok);
+  ok = mbWrite(recipeReg, {0}) && !recipeMode;
+  fprintf(out, "%d settings: recipe mode off while idle\n", ok);
+
+  ok = mbWrite(MODBUS_HOLD_DURATION, {durS & 0xFFFF, durS >> 16, 0, 0, MODBUS_CMD_START}) && isRunning &&
+       jobDurationSeconds == durS;
+  fprintf(out, "%d settings: duration (both words) and start in one write\n", ok);
+
+  ok = mbWrite(recipeReg, {1}, MODBUS_EX_BUSY) && !recipeMode && !trajMode;
+  fprintf(out, "%d settings: recipe mode refused while running\n", ok);
+  ok = mbWrite(MODBUS_HOLD_DURATION, {5, 0}, MODBUS_EX_BUSY);
+  simRun(10);
+  ok = ok && durationSeconds == durS;
+  fprintf(out, "%d settings: duration refused while running\n", ok);
+  ok = mbWrite(0, {100}) && pwmOverride == 100;
+  fprintf(out, "%d settings: setpoint written while running\n", ok);
+
+  ok = mbWrite(commandReg, {MODBUS_CMD_STOP}) && !isRunning && durationSeconds == durS;
+  fprintf(out, "%d settings: stop\n", ok);
+
+  /* Save, on images as an upload through the window would leave them:
+     a bad one is refused and the stored recipe loaded again */
+  const RecipeData stored = recipeData;
+  recipeData.steps[0].dispenseUs = stepMs(0) * 1000UL;
+  ok = mbWrite(commandReg, {MODBUS_CMD_SAVE_RECIPE}) && !memcmp(&recipeData, &stored, sizeof(stored));
+  fprintf(out, "%d save: dispense past the step end refused\n", ok);
+  recipeData.steps[1].rampQ8++;
+  ok = mbWrite(commandReg, {MODBUS_CMD_SAVE_RECIPE}) && !memcmp(&recipeData, &stored, sizeof(stored));
+  fprintf(out, "%d save: slope that does not match its ramp refused\n", ok);
+  recipeData.count = 0;
+  ok = mbWrite(commandReg, {MODBUS_CMD_SAVE_RECIPE}) && !memcmp(&recipeData, &stored, sizeof(stored));
+  fprintf(out, "%d save: no steps refused\n", ok);
+  recipeData.id++;
+  ok = mbWrite(commandReg, {MODBUS_CMD_SAVE_RECIPE}) && recipeData.id == stored.id + 1;
+  fprintf(out, "%d save: good image taken\n", ok);
+}
+
+int scenarioModbus() {
+  RecipeData r;
+  blendDefaultRecipe(r);
+  uint8_t eeprom[SIM_EEPROM_BYTES];
+  memset(eeprom, 0xFF, sizeof(eeprom));
+  memcpy(eeprom + RECIPE_ADDR, &r, sizeof(r));
+
+  FILE *in;
+  if (!simPowerUp(eeprom, modbusJob, nullptr, &in)) {
+    fprintf(stderr, "fanSim: modbus run did not complete\n");
+    return 1;
+  }
+
+  int failures = 0;
+  for (int i = 0; i < MB_REQUESTS; i++) {
+    unsigned int fn = mbRequests[i][0];
+    unsigned int word = mbRequests[i][1];
+    unsigned int count = mbRequests[i][2];
+    unsigned int reg = MODBUS_RECIPE_BASE + word;
+
+    /* Expected: a write echoes its start and count, a read returns the
+       image words high byte first, or an illegal value exception if the
+       reply would not fit */
+    std::vector<uint8_t> want;
+    if (fn == 0x10) {
+      want = {MODBUS_ADDR, 0x10, (uint8_t)(reg >> 8), (uint8_t)reg, (uint8_t)(count >> 8), (uint8_t)count};
+    } else if (count <= MB_READ_MAX) {
+      want = {MODBUS_ADDR, 0x03, (uint8_t)(count * 2)};
+      for (unsigned int b = word * 2; b < (word + count) * 2; b++) want.push_back(mbImageByte(r, b));
+    } else {
+      want = {MODBUS_ADDR, 0x83, MODBUS_EX_VALUE};
+    }
+    mbAppendCrc(want);
+
+    size_t n;
+    std::vector<uint8_t> got;
+    bool ran = fscanf(in, "%zu", &n) == 1;
+    for (size_t k = 0; ran && k < n; k++) {
+      unsigned int b;
+      ran = fscanf(in, "%x", &b) == 1;
+      got.push_back((uint8_t)b);
+    }
+    if (!ran) {
+      fprintf(stderr, "fanSim: modbus run did not complete\n");
+      return 1;
+    }
+
+    bool ok = got == want;
+    printf("%-5s words %2u..%2u (%2u): %3zu byte reply, %s%s\n", fn == 0x10 ? "write" : "read", word,
+           word + count - 1, count, got.size(), got.size() > 1 && (got[1] & 0x80) ? "exception" : "ok", ok ? "" : "  FAIL");
+    if (!ok) failures++;
+  }
+  fclose(in);
+
+  if (!simPowerUp(eeprom, modbusSettingsJob, nullptr, &in)) {
+    fprintf(stderr, "fanSim: modbus settings run did not complete\n");
+    return 1;
+  }
+  int ok, checks = 0;
+  char what[80];
+  while (fscanf(in, "%d %79[^\n]", &ok, what) == 2) {
+    printf("%s%s\n", what, ok ? "" : "  FAIL");
+    if (!ok) failures++;
+    checks++;
+  }
+  fclose(in);
+  if (checks == 0) {
+    fprintf(stderr, "fanSim: modbus settings run did not complete\n");
+    return 1;
+  }
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+#else
+int scenarioModbus() {
+  fprintf(stderr, "fanSim: the modbus scenario needs a build with -DUSE_MODBUS=1\n");
+  return 2;
+}
+#endif
+
+int main(int argc, char **argv) {
+  if (argc >= 2 && !strcmp(argv[1], "blend")) {
+    return scenarioBlend(argc >= 3 ? argv[2] : nullptr);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "inertia")) return scenarioInertia();
+  if (argc >= 2 && !strcmp(argv[1], "powerfail")) return scenarioPowerFail();
+  if (argc >= 2 && !strcmp(argv[1], "vacuum")) return scenarioVacuum();
+  if (argc >= 2 && !strcmp(argv[1], "thermal")) return scenarioThermal();
+  if (argc >= 2 && !strcmp(argv[1], "vibration")) return scenarioVibration();
+  if (argc >= 2 && !strcmp(argv[1], "faults")) return scenarioFaults();
+  if (argc >= 2 && !strcmp(argv[1], "history")) return scenarioHistory();
+  if (argc >= 2 && !strcmp(argv[1], "modbus")) return scenarioModbus();
+  if (argc >= 2 && !strcmp(argv[1], "soak")) {
+    unsigned long jobs = argc >= 3 ? strtoul(argv[2], nullptr, 10) : 500UL;
+    if (jobs > 0) return scenarioSoak(jobs);
+  }
+
+  fprintf(stderr, "usage: fanSim blend [recipe.bin]\n"
+                  "       fanSim inertia\n"
+                  "       fanSim powerfail\n"
+                  "       fanSim vacuum\n"
+                  "       fanSim thermal\n"
+                  "       fanSim vibration\n"
+                  "       fanSim faults\n"
+                  "       fanSim soak [jobs]\n"
+                  "       fanSim history\n"
+                  "       fanSim modbus\n");
+  return 2;
+}
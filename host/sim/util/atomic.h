@@ -0,0 +1,7 @@
+/*
+  Nothing preempts loop() in the simulator
+*/
+#pragma once
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type)
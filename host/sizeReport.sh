@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Size report (host side)
+#
+# Builds fanControl.cc in each configuration below, with its build
+# options given as -D flags, and prints flash and static RAM (.data and
+# .bss) per configuration, and the difference from the full build.
+#
+# Usage
+#   host/sizeReport.sh [fqbn]        (default arduino:avr:nano)
+#
+# Needs arduino-cli with the board's core and the Keypad library, and
+# avr-size (from the same toolchain) on the PATH or in $AVR_SIZE.
+#
+# Loop time is not here: it depends on the hardware fitted. Read it on
+# the board from the Modbus input registers (loopUsMean, loopUsMax) or
+# from a USE_PROFILER build through host/profSym.
+
+set -e
+
+FQBN=${1:-arduino:avr:nano}
+AVR_SIZE=${AVR_SIZE:-avr-size}
+SRC=$(dirname "$0")/../fanControl.cc
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# name, then the build options that differ from fanControl.cc
+CONFIGS='
+full
+no-pots USE_POTS=0
+sd USE_SD_LOG=1
+telemetry USE_TELEMETRY=1
+telemetry-sd USE_TELEMETRY=1 USE_SD_LOG=1
+modbus USE_MODBUS=1
+modbus-sd USE_MODBUS=1 USE_SD_LOG=1
+headless USE_LCD=0 USE_KEYPAD=0 USE_MODBUS=1
+headless-no-pots USE_LCD=0 USE_KEYPAD=0 USE_POTS=0 USE_MODBUS=1
+headless-sd USE_LCD=0 USE_KEYPAD=0 USE_POTS=0 USE_MODBUS=1 USE_SD_LOG=1
+'
+
+# The ATmega328P's RAM
+RAM=2048
+
+printf '%-18s %7s %7s %7s %7s %7s\n' config flash delta ram delta free
+echo "$CONFIGS" | while read -r name opts; do
+  [ -n "$name" ] || continue
+  dir=$TMP/$name/fanControl
+  mkdir -p "$dir"
+  # A sketch is built from its folder; the .ino only names it, and
+  # arduino-cli compiles .cpp files but not .cc
+  cp "$SRC" "$dir/fanControl.cpp"
+  : > "$dir/fanControl.ino"
+  flags=
+  for opt in $opts; do
+    flags="$flags -D$opt"
+  done
+
+  if ! arduino-cli compile -b "$FQBN" --build-property "compiler.cpp.extra_flags=$flags" \
+      --output-dir "$TMP/$name/out" "$dir" > "$TMP/$name/log" 2>&1; then
+    echo "$name: build failed" >&2
+    cat "$TMP/$name/log" >&2
+    exit 1
+  fi
+
+  # text data bss: flash holds text and data, RAM data and bss
+  set -- $("$AVR_SIZE" "$TMP/$name/out/fanControl.ino.elf" | tail -1)
+  flash=$(($1 + $2))
+  ram=$(($2 + $3))
+  if [ "$name" = full ]; then
+    echo "$flash $ram" > "$TMP/full.size"
+  fi
+  read -r fullFlash fullRam < "$TMP/full.size"
+  printf '%-18s %7d %+7d %7d %+7d %7d\n' "$name" "$flash" $((flash - fullFlash)) "$ram" $((ram - fullRam)) \
+    $((RAM - ram))
+done
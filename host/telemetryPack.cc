@@ -0,0 +1,321 @@
+/*
+  Change-only telemetry tool (host side)
+
+  Decodes the binary frames of a USE_TELEMETRY_DELTA build of
+  fanControl.cc, and reports what that encoding saves on a trace
+  recorded from a text (USE_TELEMETRY) build.
+
+  Build
+    g++ -O2 -o telemetryPack host/telemetryPack.cc
+
+  Usage
+    telemetryPack < capture.bin > trace.csv
+    telemetryPack -r < trace.csv
+
+  Decode
+  - Frames become CSV lines under the firmware's header line; delta
+    frames before the first keyframe are dropped. Text between frames
+    (query answers) and bytes that do not make a frame go to stderr.
+
+  Report (-r)
+  - Encodes the trace's lines as the firmware would have sent them,
+    decodes the result, and prints the bytes of both forms, the link
+    share at TELEMETRY_BAUD, how often each field was sent and the
+    largest error the receiver saw per field. Exits 1 if an error is
+    over its deadband (the encoder and decoder disagree).
+  - A missing line (skipped by the firmware) still counts towards the
+    next keyframe, by its ms; ms going back is taken as a power-up.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/* As in fanControl.cc */
+static const int FIELDS = 11;
+static const char *const fieldNames[FIELDS] = {
+  "ms", "run", "step", "pwm", "rpm", "left_s", "temp_dC", "pwm_max", "vib_mg", "stack_free", "skipped"
+};
+static const uint32_t deadband[FIELDS] = {0, 0, 0, 2, 20, 0, 3, 0, 20, 16, 0};
+static const uint8_t SYNC = 0xA5;
+static const uint8_t KEY_FLAG = 0x01;
+static const int KEY_TICKS = 50;
+static const uint32_t TICK_MS = 100;
+static const double BAUD = 115200.0;
+
+static void usage() {
+  fprintf(stderr, "usage: telemetryPack [-r] < input\n");
+  exit(2);
+}
+
+/* Sender side, as sendTelemetryFrame() */
+struct Encoder {
+  uint32_t sent[FIELDS] = {};
+  int keyIn = 0;
+
+  static void varint(std::vector<uint8_t> &out, uint32_t v) {
+    while (v >= 0x80) {
+      out.push_back((uint8_t)(v | 0x80));
+      v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+  }
+
+  static uint32_t zigzag(uint32_t d) { return (d << 1) ^ (uint32_t)((int32_t)d >> 31); }
+
+  /* Appends the frame for one tick, if any; returns the field mask */
+  unsigned frame(const uint32_t *v, std::vector<uint8_t> &out) {
+    bool key = keyIn == 0;
+    unsigned mask = 0;
+    for (int i = 0; i < FIELDS; i++) {
+      uint32_t d = v[i] - sent[i];
+      uint32_t mag = (int32_t)d < 0 ? 0u - d : d;
+      if (key || i == 0 || mag > deadband[i]) mask |= 1u << i;
+    }
+    if (mask == 1) return 0;
+
+    std::vector<uint8_t> body;
+    body.push_back(key ? KEY_FLAG : 0);
+    varint(body, mask);
+    for (int i = 0; i < FIELDS; i++) {
+      if (!(mask & (1u << i))) continue;
+      varint(body, zigzag(key ? v[i] : v[i] - sent[i]));
+      sent[i] = v[i];
+    }
+    out.push_back(SYNC);
+    out.push_back((uint8_t)body.size());
+    uint8_t sum = (uint8_t)body.size();
+    for (uint8_t b : body) sum += b;
+    out.insert(out.end(), body.begin(), body.end());
+    out.push_back(sum);
+    if (key) keyIn = KEY_TICKS;
+    return mask;
+  }
+
+  /* A tick passed, sent or skipped */
+  void tick() {
+    if (keyIn) keyIn--;
+  }
+};
+
+/* Receiver side */
+struct Decoder {
+  uint32_t value[FIELDS] = {};
+  bool synced = false;
+  unsigned frames = 0;
+  unsigned keyframes = 0;
+  unsigned unsynced = 0;
+  unsigned bad = 0;
+
+  static bool varint(const uint8_t *&p, const uint8_t *end, uint32_t &v) {
+    v = 0;
+    for (int shift = 0; shift < 35 && p < end; shift += 7) {
+      uint8_t b = *p++;
+      v |= (uint32_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) return true;
+    }
+    return false;
+  }
+
+  /* Frame at p (p[0] is SYNC): its length, or 0 if it is not one;
+     updated says whether value[] took it */
+  size_t take(const uint8_t *p, size_t avail, bool &updated) {
+    updated = false;
+    if (avail < 4) return 0;
+    size_t len = p[1];
+    if (len < 2 || avail < len + 3) return 0;
+    uint8_t sum = 0;
+    for (size_t i = 1; i < len + 2; i++) sum += p[i];
+    if (sum != p[len + 2]) return 0;
+
+    const uint8_t *q = p + 3;
+    const uint8_t *end = p + 2 + len;
+    bool key = p[2] & KEY_FLAG;
+    uint32_t mask, v[FIELDS];
+    if (!varint(q, end, mask) || mask >= (1u << FIELDS) || !(mask & 1)) return 0;
+    for (int i = 0; i < FIELDS; i++) {
+      if ((mask & (1u << i)) && !varint(q, end, v[i])) return 0;
+    }
+    if (q != end) return 0;
+
+    frames++;
+    if (key) {
+      keyframes++;
+      synced = true;
+    }
+    if (!synced) {
+      unsynced++;
+      return len + 3;
+    }
+    for (int i = 0; i < FIELDS; i++) {
+      if (!(mask & (1u << i))) continue;
+      uint32_t d = (v[i] >> 1) ^ (0u - (v[i] & 1));
+      value[i] = key ? d : value[i] + d;
+    }
+    updated = true;
+    return len + 3;
+  }
+};
+
+static void printRow(const uint32_t *v) {
+  printf("%lu", (unsigned long)v[0]);
+  for (int i = 1; i < FIELDS; i++) printf(",%ld", (long)(int32_t)v[i]);
+  printf("\n");
+}
+
+static int decode() {
+  std::vector<uint8_t> in;
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) in.insert(in.end(), buf, buf + n);
+
+  Decoder dec;
+  std::string text;
+  bool header = false;
+  for (size_t i = 0; i < in.size();) {
+    if (in[i] == SYNC) {
+      bool updated;
+      size_t len = dec.take(&in[i], in.size() - i, updated);
+      if (len) {
+        if (updated) {
+          if (!header) {
+            printf("%s", fieldNames[0]);
+            for (int f = 1; f < FIELDS; f++) printf(",%s", fieldNames[f]);
+            printf("\n");
+            header = true;
+          }
+          printRow(dec.value);
+        }
+        i += len;
+        continue;
+      }
+      dec.bad++;
+    }
+    uint8_t c = in[i++];
+    if (c == '\n') {
+      if (!text.empty() && text.back() == '\r') text.pop_back();
+      /* The firmware's header line names the columns */
+      if (!header && text.compare(0, 3, "ms,") == 0) {
+        printf("%s\n", text.c_str());
+        header = true;
+      } else if (!text.empty()) {
+        fprintf(stderr, "%s\n", text.c_str());
+      }
+      text.clear();
+    } else {
+      text += (char)c;
+    }
+  }
+  if (!text.empty()) fprintf(stderr, "%s\n", text.c_str());
+
+  fprintf(stderr, "telemetryPack: %u frames (%u keyframes), %u before the first keyframe, %u bad sync bytes\n",
+          dec.frames, dec.keyframes, dec.unsynced, dec.bad);
+  return 0;
+}
+
+static bool parseLine(const char *line, uint32_t *v) {
+  const char *p = line;
+  for (int i = 0; i < FIELDS; i++) {
+    char *end;
+    long x = strtol(p, &end, 10);
+    if (end == p) return false;
+    v[i] = i == 0 ? (uint32_t)strtoul(p, &end, 10) : (uint32_t)(int32_t)x;
+    p = end;
+    if (i + 1 < FIELDS) {
+      if (*p != ',') return false;
+      p++;
+    }
+  }
+  return *p == '\r' || *p == '\n' || *p == 0;
+}
+
+static int report() {
+  Encoder enc;
+  Decoder dec;
+  std::vector<uint8_t> out;
+  unsigned long lines = 0, textBytes = 0, quiet = 0, powerUps = 0;
+  unsigned long sentCount[FIELDS] = {};
+  uint32_t maxErr[FIELDS] = {};
+  uint32_t lastMs = 0;
+  double spanS = 0;
+
+  char line[256];
+  while (fgets(line, sizeof(line), stdin)) {
+    uint32_t v[FIELDS];
+    if (!parseLine(line, v)) continue;
+    if (!lines || v[0] < lastMs) {
+      /* Power-up: the firmware starts over with a keyframe */
+      enc = Encoder();
+      powerUps++;
+    } else {
+      /* Ticks the firmware skipped since the last line */
+      uint32_t ticks = (v[0] - lastMs + TICK_MS / 2) / TICK_MS;
+      for (uint32_t t = 1; t < ticks && t <= (uint32_t)KEY_TICKS; t++) enc.tick();
+      spanS += (v[0] - lastMs) / 1000.0;
+    }
+    enc.tick();
+    lastMs = v[0];
+    lines++;
+    textBytes += strlen(line);
+
+    size_t at = out.size();
+    unsigned mask = enc.frame(v, out);
+    if (!mask) quiet++;
+    for (int i = 0; i < FIELDS; i++) {
+      if (mask & (1u << i)) sentCount[i]++;
+    }
+    if (out.size() > at) {
+      bool updated;
+      if (dec.take(&out[at], out.size() - at, updated) != out.size() - at) {
+        fprintf(stderr, "telemetryPack: frame at line %lu does not decode\n", lines);
+        return 1;
+      }
+    }
+
+    /* What the receiver holds now against the line; ms only when sent */
+    for (int i = mask ? 0 : 1; i < FIELDS; i++) {
+      uint32_t d = dec.value[i] - v[i];
+      uint32_t mag = (int32_t)d < 0 ? 0u - d : d;
+      if (mag > maxErr[i]) maxErr[i] = mag;
+    }
+  }
+  if (!lines) {
+    fprintf(stderr, "telemetryPack: no telemetry lines in the input\n");
+    return 1;
+  }
+
+  double packBytes = out.size();
+  printf("%lu lines over %.1f s (%lu power-up%s): text %lu bytes, frames %.0f bytes (%.1f %%, %.1fx smaller)\n", lines, spanS,
+         powerUps, powerUps == 1 ? "" : "s", textBytes, packBytes, 100.0 * packBytes / textBytes, packBytes ? textBytes / packBytes : 0.0);
+  printf("%u frames (%u keyframes), %lu lines with nothing to send\n", dec.frames, dec.keyframes, quiet);
+  if (spanS > 0) {
+    /* 10 bits a byte on the wire (8N1) */
+    printf("link at %.0f baud: text %.0f B/s (%.2f %%), frames %.0f B/s (%.2f %%)\n", BAUD, textBytes / spanS,
+           100.0 * textBytes * 10 / spanS / BAUD, packBytes / spanS, 100.0 * packBytes * 10 / spanS / BAUD);
+  }
+
+  bool ok = true;
+  printf("  field       sent  max err  deadband\n");
+  for (int i = 0; i < FIELDS; i++) {
+    bool fieldOk = i == 0 || maxErr[i] <= deadband[i];
+    if (!fieldOk) ok = false;
+    printf("  %-10s %5lu  %7lu  %8lu%s\n", fieldNames[i], sentCount[i], (unsigned long)maxErr[i],
+           (unsigned long)deadband[i], fieldOk ? "" : "  FAIL");
+  }
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  bool doReport = false;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-r")) {
+      doReport = true;
+    } else {
+      usage();
+    }
+  }
+  return doReport ? report() : decode();
+}